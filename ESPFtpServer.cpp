@@ -27,12 +27,78 @@
 #endif
 #ifdef ESP32
 #include <WiFi.h>
+#include <lwip/sockets.h>
 #endif
+#include <errno.h>
 #include <time.h>
+#ifdef ESP32
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+#if FTP_FS_TASK
+#include <esp_pthread.h>
+#include <new>
+#include <thread>
+#endif
 
 
 WiFiServer ftpServer (FTP_CTRL_PORT);
-WiFiServer dataServer (FTP_DATA_PORT_PASV);
+
+uint32_t __attribute__ ((weak)) ftpAllocCount () {
+  return 0;
+}
+
+#ifdef ESP8266
+static time_t fileTime;               // time given to the file by ftpSetFileTime ()
+
+static time_t fileTimeCallback () {
+  return fileTime;
+}
+
+static time_t nowCallback () {         // the default callback of the core
+  return time (NULL);
+}
+#endif
+
+// Set the time of a file for MFMT (see FtpStorage.h)
+//
+//  ESP8266: the core can't give back the time callback of the FS, so
+//  the default one is set again.
+//  ESP32: the FS is reached in the VFS below FTP_VFS_MOUNT; if the file
+//  isn't there, the FS is mounted elsewhere (or isn't in the VFS).
+//
+// return:
+//    false if not done; errno is ENOTSUP if the file system can't do it
+
+bool __attribute__ ((weak)) ftpSetFileTime (fs::FS &fs, const char * path, time_t mtime) {
+  #ifdef ESP8266
+  fileTime = mtime;
+  fs.setTimeCallback (fileTimeCallback);
+  File f = fs.open (path, "a");       // stamped when closed
+  boolean opened = f;
+  f.close ();
+  fs.setTimeCallback (nowCallback);
+  return opened;
+  #endif
+  #ifdef ESP32
+  char vfsPath[sizeof (FTP_VFS_MOUNT) + FTP_CWD_SIZE];
+  strcpy (vfsPath, FTP_VFS_MOUNT);
+  strcat (vfsPath, path);
+  struct stat st;
+  if (stat (vfsPath, &st) != 0) {
+    errno = ENOTSUP;
+    return false;
+  }
+  struct utimbuf times = { mtime, mtime };
+  if (utime (vfsPath, &times) == 0) {
+    return true;
+  }
+  if (errno == ENOSYS) {               // SPIFFS without CONFIG_SPIFFS_USE_MTIME
+    errno = ENOTSUP;
+  }
+  return false;
+  #endif
+}
 
 void FtpServer::begin (String uname, String pword) {
   // Tells the ftp server to begin listening for incoming connection
@@ -41,861 +107,3097 @@ void FtpServer::begin (String uname, String pword) {
 
   ftpServer.begin ();
   delay (10);
-  dataServer.begin ();
-  delay (10);
-  millisTimeOut = (uint32_t)FTP_TIME_OUT * 60 * 1000;
-  millisDelay = 0;
-  cmdStatus = 0;
-  iniVariables ();
+  // passive ports only listen while they are handed out to a session
+  for (uint8_t i = 0; i < FTP_DATA_PORT_COUNT; i ++) {
+    if (dataServers[i] == NULL) {
+      dataServers[i] = new WiFiServer (FTP_DATA_PORT_PASV + i);
+    }
+    dataPortOwner[i] = NULL;
+  }
+  #if FTP_LIST_CACHE
+  for (uint8_t i = 0; i < FTP_LIST_CACHE_ENTRIES; i ++) {
+    listCache[i].claimed = false;
+  }
+  #endif
+  invalidateCache ();
+  resetStats ();
+  nextTransfer = 0;
+  rateLimit.set (FTP_SERVER_RATE);
+  sessionRate = FTP_SESSION_RATE;
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++) {
+    sessions[i].begin (this);
+  }
+  #if FTP_FS_TASK
+  if (fsTask == NULL) {
+    fsTask = new FtpFsTask ();
+    fsTask->wakes = 0;
+    fsTask->sleeping = false;
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config ();
+    cfg.thread_name = "ftpfs";
+    cfg.pin_to_core = FTP_FS_TASK_CORE;
+    cfg.stack_size = 4096;
+    esp_pthread_set_cfg (&cfg);
+    std::thread (&FtpServer::runFsTask, this).detach ();
+  }
+  #endif
 }
 
-void FtpServer::iniVariables () {
-  // Default for data port
-  dataPort = FTP_DATA_PORT_PASV;
-  
-  // Default Data connection is Active
-  dataPassiveConn = false;
-  
-  // Set the root directory
-  strcpy (cwdName, "/");
+#if FTP_FS_TASK
+// The file system task: reads the files of RETR into their ring, and
+// writes those of STOR from it, a part of each in turn, and sleeps
+// when there is nothing to do
 
-  rnfrCmd = false;
-  transferStatus = 0;
+void FtpServer::runFsTask () {
+  while (true) {
+    uint32_t wakes = fsTask->wakes;
+    boolean worked = false;
+    for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++) {
+      std::lock_guard<std::mutex> guard (fsTask->sessionLock[i]);
+      worked |= sessions[i].fsWork ();
+    }
+    if (!worked) {
+      std::unique_lock<std::mutex> lock (fsTask->lock);
+      fsTask->sleeping = true;
+      fsTask->wake.wait_for (lock, std::chrono::milliseconds (100), [&] { return fsTask->wakes != wakes; });
+      fsTask->sleeping = false;
+    }
+  }
 }
+#endif
 
-void FtpServer::handleFTP (fs::FS &fs) {
-  if ((int32_t) (millisDelay - millis ()) > 0) {
-    return;
+// Tell the file system task that a ring has bytes, or room, for it
+
+void FtpServer::wakeFsTask () {
+  #if FTP_FS_TASK
+  fsTask->wakes ++;
+  if (fsTask->sleeping) {
+    std::lock_guard<std::mutex> guard (fsTask->lock);
+    fsTask->wake.notify_one ();
   }
-  
+  #endif
+}
+
+// Serve a file system of the core (SPIFFS, LittleFS, SD...)
+
+void FtpServer::handleFTP (fs::FS &fs) {
+  fsStorage.setFS (fs);
+  handleFTP (fsStorage);
+}
+
+void FtpServer::handleFTP (fs::FS &fs, uint32_t maxWaitMillis) {
+  fsStorage.setFS (fs);
+  handleFTP (fsStorage, maxWaitMillis);
+}
+
+// Serve a storage: an FtpFsStorage, an FtpPosixStorage, or one of the
+// application (see FtpStorage.h)
+
+void FtpServer::handleFTP (FtpStorage &fs) {
   if (ftpServer.hasClient ()) {
-    #ifdef FTP_DEBUG
-    Serial.println ("-> disconnecting client");
-    #endif  
-    client.stop ();
-    client = ftpServer.available ();
-  }
-  
-  if (cmdStatus == 0) {
-    if (client.connected ()) {
-      disconnectClient ();
-    }
-    cmdStatus = 1;
-  }
-  else if (cmdStatus == 1) {         // Ftp server waiting for connection
-    abortTransfer ();
-    iniVariables ();
-    #ifdef FTP_DEBUG
-  	Serial.println ("-> ftp server waiting for connection on port " + String (FTP_CTRL_PORT));
-    #endif
-    cmdStatus = 2;
-  }
-  else if (cmdStatus == 2) {         // Ftp server idle
-    if (client.connected ()) {       // A client connected
-      clientConnected ();      
-      millisEndConnection = millis () + 10 * 1000; // wait client id during 10 s.
-      cmdStatus = 3;
-    }
-  }
-  else if (readChar () > 0) {        // got response
-    if (cmdStatus == 3) {            // Ftp server waiting for user identity
-      if (userIdentity ()) {
-        cmdStatus = 4;
+    FtpSession * idle = NULL;
+    bool resetting = false;
+    for (uint8_t i = 0; i < FTP_MAX_SESSIONS && idle == NULL; i ++) {
+      if (sessions[i].isIdle ()) {
+        idle = &sessions[i];
       }
-      else {
-        cmdStatus = 0;
+      else if (sessions[i].cmdStatus < 2) {
+        resetting = true;
       }
     }
-    else if (cmdStatus == 4) {       // Ftp server waiting for user registration
-      if (userPassword ()) {
-        cmdStatus = 5;
-        millisEndConnection = millis () + millisTimeOut;
-      }
-      else {
-        cmdStatus = 0;
-      }
+    if (idle != NULL) {
+      #ifdef FTP_DEBUG
+      Serial.println ("-> new client assigned to session " + String (idle - sessions));
+      #endif
+      idle->client = ftpServer.available ();
+      stats.sessions ++;
     }
-    else if (cmdStatus == 5) {       // Ftp server waiting for user command
-      if (!processCommand (fs)) {
-        cmdStatus = 0;
-      }
-      else {
-        millisEndConnection = millis () + millisTimeOut;
-      }
+    else if (!resetting) {             // all sessions are busy: turn the newcomer away
+      #ifdef FTP_DEBUG
+      Serial.println ("-> no free session, rejecting client");
+      #endif
+      WiFiClient rejected = ftpServer.available ();
+      rejected.println ("421 Too many connections, try again later");
+      rejected.stop ();
+      stats.rejected ++;
     }
-  }
-  else if (!client.connected () || !client) {
-	cmdStatus = 1;
-    #ifdef FTP_DEBUG
-    Serial.println ("-> client disconnected");
-    #endif
+    // else wait for a session to finish its reset, and accept the client on next call
   }
 
-  if (transferStatus == 1) {         // Retrieve data
-    if (!doRetrieve ()) {
-      transferStatus = 0;
-    }
+  // Commands first, so that ABOR or NOOP are answered even during transfers
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++) {
+    sessions[i].handleControl (fs);
   }
-  else if (transferStatus == 2) {    // Store data
-    if (!doStore ()) {
-      transferStatus = 0;
-    }
+  // then a quantum of each transfer, taking turns to begin
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++) {
+    sessions[(nextTransfer + i) % FTP_MAX_SESSIONS].handleTransfer (fs);
   }
-  else if (cmdStatus > 2 && ! ((int32_t) (millisEndConnection - millis ()) > 0 )) {
-	client.println ("530 Timeout");
-    millisDelay = millis () + 200;   // delay of 200 ms
-    cmdStatus = 0;
+  nextTransfer = (nextTransfer + 1) % FTP_MAX_SESSIONS;
+}
+
+// Wait for something to do, at most maxWaitMillis, then handle it
+//
+//  Same as handleFTP (fs), but instead of returning at once when nothing
+//  happens, it sleeps until a client connects, a command arrives, a
+//  transfer can progress or a time out expires. A sketch with nothing
+//  else to do can call it with a long wait, keeping the CPU idle.
+
+void FtpServer::handleFTP (FtpStorage &fs, uint32_t maxWaitMillis) {
+  if (maxWaitMillis > 0) {
+    waitEvent (maxWaitMillis);
   }
+  handleFTP (fs);
 }
 
-void FtpServer::clientConnected () {
-  #ifdef FTP_DEBUG
-  Serial.println ("-> client connected");
+// What the sessions wait for, gathered by waitEvent ()
+struct FtpWait {
+  uint32_t millis;                      // time until the first time out, 0 if there is work to do now
+  boolean  poll;                        // a socket can't be watched: check it every FTP_EVENT_POLL_MS
+  #ifdef ESP32
+  fd_set   readFds,
+           writeFds;
+  int      maxFd;                       // highest socket in the sets, -1 if none
   #endif
-  client.println ("220-Welcome to FTP for ESP8266/ESP32");
-  client.println ("220-By David Paiva");
-  client.println ("220-Version " + String (FTP_SERVER_VERSION));
-  client.println ("220 Put your ftp client in passive mode, and do not attempt more than one connection");
-  iCL = 0;
+};
+
+// Socket of a listening port, or -1 if the core keeps it to itself (the
+// host build gives it)
+
+template <typename S> static auto listenerFd (S & server, int) -> decltype (server.fd ()) {
+  return server.fd ();
 }
 
-void FtpServer::disconnectClient () {
-  #ifdef FTP_DEBUG
-  Serial.println ("-> disconnecting client");
+template <typename S> static int listenerFd (S & server, long) {
+  return -1;
+}
+
+#ifdef ESP32
+static void watchFd (FtpWait & wait, int fd, fd_set * set) {
+  FD_SET (fd, set);
+  if (fd > wait.maxFd) {
+    wait.maxFd = fd;
+  }
+}
+#endif
+
+// Wait for a client to connect on a listening port
+
+static void waitAccept (FtpWait & wait, WiFiServer & server) {
+  #ifdef ESP32
+  int fd = listenerFd (server, 0);
+  if (fd >= 0) {
+    watchFd (wait, fd, &wait.readFds);
+    return;
+  }
   #endif
-  abortTransfer ();
-  client.println ("221 Goodbye");
-  client.stop ();
+  if (server.hasClient ()) {
+    wait.millis = 0;
+  }
+  else {
+    wait.poll = true;
+  }
 }
 
-boolean FtpServer::userIdentity () {	
-  if (strcmp (command, "USER")) {
-    client.println ("500 Syntax error");
+// Wait for bytes (or the end of the connection) to be received
+
+static void waitRead (FtpWait & wait, WiFiClient & client) {
+  if (client.available () > 0) {       // maybe already buffered by the core
+    wait.millis = 0;
+    return;
   }
-  if (strcmp (parameters, _FTP_USER.c_str ())) {
-    client.println ("530 user not found");
+  #ifdef ESP8266
+  if (!client.connected ()) {
+    wait.millis = 0;
   }
   else {
-    client.println ("331 OK. Password required");
-    strcpy (cwdName, "/");
-    return true;
+    wait.poll = true;
   }
-  millisDelay = millis () + 100;  // delay of 100 ms
-  return false;
+  #endif
+  #ifdef ESP32
+  if (client.fd () < 0) {
+    wait.millis = 0;
+  }
+  else {
+    watchFd (wait, client.fd (), &wait.readFds);
+  }
+  #endif
 }
 
-boolean FtpServer::userPassword () {
-  if (strcmp (command, "PASS")) {
-    client.println ("500 Syntax error");
+// Wait for room in the send buffer
+
+static void waitWrite (FtpWait & wait, WiFiClient & client) {
+  #ifdef ESP8266
+  if (client.availableForWrite () > 0 || !client.connected ()) {
+    wait.millis = 0;
+  }
+  else {
+    wait.poll = true;
   }
-  else if (strcmp (parameters, _FTP_PASS.c_str ())) {
-    client.println ("530 ");
+  #endif
+  #ifdef ESP32
+  if (client.fd () < 0) {
+    wait.millis = 0;
   }
   else {
-    #ifdef FTP_DEBUG
-    Serial.println ("-> user authenticated");
-    #endif
-    client.println ("230 OK.");
-    return true;
+    watchFd (wait, client.fd (), &wait.writeFds);
   }
-  millisDelay = millis () + 100;  // delay of 100 ms
-  return false;
+  #endif
 }
 
-boolean FtpServer::processCommand (fs::FS &fs) {
-  struct tm * ptm;
-  time_t ftime;
-  char buffer[80];
-
-  ///////////////////////////////////////
-  //                                   //
-  //      ACCESS CONTROL COMMANDS      //
-  //                                   //
-  ///////////////////////////////////////
-
-  //
-  //  CDUP - Change to Parent Directory 
-  //
-  if (!strcmp (command, "CDUP") || (!strcmp (command, "CWD") && !strcmp (parameters, ".."))) {
-    bool ok = false;
-    if (strlen (cwdName) > 1) {            // do nothing if cwdName is root
-      // if cwdName ends with '/', remove it (must not append)
-      if (cwdName[strlen (cwdName) - 1] == '/') {
-        cwdName[ strlen (cwdName ) - 1 ] = 0;
-      }
-      // search last '/'
-      char * pSep = strrchr (cwdName, '/');
-      ok = pSep > cwdName;
-      // if found, ends the string on its position
-      if (ok) {
-        * pSep = 0;
-        ok = fs.exists (cwdName);
-      }
+static void waitUntil (FtpWait & wait, uint32_t millisEnd) {
+  int32_t left = millisEnd - millis ();
+  if (left <= 0) {
+    wait.millis = 0;
+  }
+  else if ((uint32_t) left < wait.millis) {
+    wait.millis = left;
+  }
+}
+
+// Sleep until a session has something to do, at most maxMillis
+//
+//  On ESP32 (and the host build) the sockets are watched with select (),
+//  that lets the CPU sleep. What can't be watched that way (all sockets on
+//  ESP8266, the listening ports on ESP32) is checked every
+//  FTP_EVENT_POLL_MS, with delay () in between.
+
+void FtpServer::waitEvent (uint32_t maxMillis) {
+  uint32_t start = millis ();
+  while (true) {
+    uint32_t elapsed = millis () - start;
+    if (elapsed >= maxMillis) {
+      return;
+    }
+    FtpWait wait;
+    wait.millis = maxMillis - elapsed;
+    wait.poll = false;
+    #ifdef ESP32
+    FD_ZERO (&wait.readFds);
+    FD_ZERO (&wait.writeFds);
+    wait.maxFd = -1;
+    #endif
+    waitAccept (wait, ftpServer);
+    for (uint8_t i = 0; i < FTP_MAX_SESSIONS && wait.millis > 0; i ++) {
+      sessions[i].prepareWait (wait);
+    }
+    if (wait.millis == 0) {
+      return;
     }
-    // if an error appends, move to root
-    if (!ok) {
-      strcpy (cwdName, "/");
+    uint32_t ms = wait.poll && wait.millis > FTP_EVENT_POLL_MS ? FTP_EVENT_POLL_MS : wait.millis;
+    #ifdef ESP32
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = ms % 1000 * 1000;
+    if (select (wait.maxFd + 1, &wait.readFds, &wait.writeFds, NULL, &tv) != 0) {
+      return;                          // a socket is ready (or select failed: poll)
+    }
+    #endif
+    #ifdef ESP8266
+    delay (ms);
+    #endif
+    if (!wait.poll) {
+      return;                          // a time out expired
     }
-    client.println ("250 Ok. Current directory is " + String (cwdName));
   }
-  
-  //
-  //  CWD - Change Working Directory
-  //
-  else if (!strcmp (command, "CWD")) { 
-    char path[FTP_CWD_SIZE];
-    if (haveParameter () && makeExistsPath (fs, path)) {
-      strcpy (cwdName, path);
-      client.println ("250 Ok. Current directory is " + String (cwdName));
-    }  
+}
+
+// Counters of the server, for monitoring; see also SITE STATS
+
+const FtpServerStats & FtpServer::getStats () {
+  return stats;
+}
+
+void FtpServer::resetStats () {
+  memset (&stats, 0, sizeof (stats));
+}
+
+// Bytes of RAM taken by the path index, 0 if it is disabled (FTP_PATH_INDEX)
+
+uint32_t FtpServer::getPathIndexFootprint () {
+  #if FTP_PATH_INDEX
+  return pathIndex.footprint ();
+  #else
+  return 0;
+  #endif
+}
+
+// Limit the rate of RETR and STOR, in bytes/s (0: no limit)
+//
+//  setServerRate () limits all sessions together, setSessionRate () each
+//  of them, connected ones included. A client can change both with
+//  SITE RATE.
+
+void FtpServer::setServerRate (uint32_t bytesPerSecond) {
+  rateLimit.set (bytesPerSecond);
+}
+
+void FtpServer::setSessionRate (uint32_t bytesPerSecond) {
+  sessionRate = bytesPerSecond;
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; i ++) {
+    sessions[i].rateLimit.set (bytesPerSecond);
   }
-  
-  //
-  //  PWD - Print Directory
-  //
-  else if (!strcmp (command, "PWD")) {
-    client.println ("257 \"" + String (cwdName) + "\" is your current directory");
+}
+
+// Token bucket: tokens (bytes) are added at the rate, up to a burst of
+// FTP_RATE_BURST_MS, and a transfer may move as many bytes as there are
+// tokens
+
+void FtpRateLimit::set (uint32_t rate) {
+  bytesPerSecond = rate;
+  burst = (uint64_t) rate * FTP_RATE_BURST_MS / 1000;
+  if (burst < FTP_LIST_MSS) {
+    burst = FTP_LIST_MSS;              // at least a full TCP segment
   }
-  
-  //
-  //  QUIT
-  //
-  else if (!strcmp (command, "QUIT")) {
-    disconnectClient ();
-    return false;
+  // time to fill the bucket from empty; micros () wraps after 71 minutes
+  fillMillis = rate > 0 ? (uint64_t) burst * 1000 / rate + 1 : 0;
+  if (fillMillis > 3600000) {
+    fillMillis = 3600000;
+  }
+  tokens = burst;
+  microsRefill = micros ();
+  millisRefill = millis ();
+}
+
+uint32_t FtpRateLimit::rate () {
+  return bytesPerSecond;
+}
+
+// return:
+//    number of bytes that may be transferred now, 0xFFFFFFFF if not limited
+
+uint32_t FtpRateLimit::allowance () {
+  if (bytesPerSecond == 0) {
+    return 0xFFFFFFFF;
+  }
+  uint32_t now = micros ();
+  if (millis () - millisRefill >= fillMillis) {
+    // long enough to fill the bucket, and maybe for micros () to wrap
+    tokens = burst;
+    microsRefill = now;
+    millisRefill = millis ();
+    return tokens;
+  }
+  uint32_t added = (uint64_t) (uint32_t) (now - microsRefill) * bytesPerSecond / 1000000;
+  if (added > 0) {                     // keep the fraction of a byte for the next time: move the
+                                       // refill time on by the time of the bytes added, not to now
+    microsRefill += (uint32_t) (((uint64_t) added * 1000000 + bytesPerSecond - 1) / bytesPerSecond);
+    millisRefill = millis ();
+    tokens = added > burst - tokens ? burst : tokens + added;
+  }
+  return tokens;
+}
+
+void FtpRateLimit::consume (uint32_t bytes) {
+  if (bytesPerSecond > 0) {
+    tokens = bytes < tokens ? tokens - bytes : 0;
+  }
+}
+
+// return:
+//    ms until a TCP segment may be transferred, 0 if bytes may be transferred now
+
+uint32_t FtpRateLimit::millisToWait () {
+  if (allowance () > 0) {
+    return 0;
   }
+  return (uint64_t) FTP_LIST_MSS * 1000 / bytesPerSecond + 1;
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //    TRANSFER PARAMETER COMMANDS    //
-  //                                   //
-  ///////////////////////////////////////
+// Add the counters of a finished transfer to those of the server
 
-  //
-  //  MODE - Transfer Mode 
-  //
-  else if (!strcmp (command, "MODE")) {
-    if (!strcmp (parameters, "S")) {
-      client.println ("200 S Ok");
+void FtpServer::recordTransfer (const FtpTransferStats & xfer) {
+  stats.last = xfer;
+  boolean upload = xfer.command[0] == 'S' || xfer.command[0] == 'A';
+  if (upload) {
+    stats.bytesReceived += xfer.bytes;
+  }
+  else {
+    stats.bytesSent += xfer.bytes;
+  }
+  stats.fsMicros += xfer.fsMicros;
+  stats.netMicros += xfer.netMicros;
+  stats.stalls += xfer.stalls;
+  if (!xfer.completed) {
+    stats.transfersFailed ++;
+    return;
+  }
+  stats.transfers ++;
+  if ((upload || xfer.command[0] == 'R') && xfer.bytes > 0 && xfer.millis > 0) {
+    uint32_t kbps = xfer.bytes / xfer.millis;
+    if (stats.fileTransfers == 0 || kbps < stats.kbpsMin) {
+      stats.kbpsMin = kbps;
     }
-    else {
-      client.println ("504 Only S (tream) is supported");
+    if (kbps > stats.kbpsMax) {
+      stats.kbpsMax = kbps;
     }
+    stats.fileTransfers ++;
+    stats.fileBytes += xfer.bytes;
+    stats.fileMillis += xfer.millis;
   }
-  
-  //
-  //  PASV - Passive Connection management
-  //
-  else if (!strcmp (command, "PASV")) {
-    if (data.connected ()) {
-      data.stop ();
+}
+
+// Hand out a free passive port to a session, and start listening on it
+//
+// return:
+//    index of the port in the pool, or -1 if all ports are in use
+
+int8_t FtpServer::acquireDataPort (FtpSession * session) {
+  for (uint8_t i = 0; i < FTP_DATA_PORT_COUNT; i ++) {
+    if (dataPortOwner[i] == NULL) {
+      dataPortOwner[i] = session;
+      dataServers[i]->begin ();
       #ifdef FTP_DEBUG
-      Serial.println ("-> client disconnected from dataserver");
+      Serial.println ("-> data port " + String (FTP_DATA_PORT_PASV + i) + " bound to session " + String (session - sessions));
       #endif
+      return i;
     }
-  	dataIp = WiFi.localIP ();	  
-  	dataPort = FTP_DATA_PORT_PASV;
+  }
+  return -1;
+}
+
+// Give a passive port back to the pool
+//
+//  The listener is closed, so that a late client can never reach the next
+//  session the port is handed out to
+
+void FtpServer::releaseDataPort (int8_t index) {
+  if (index >= 0 && index < FTP_DATA_PORT_COUNT) {
+    dataServers[index]->stop ();
+    dataPortOwner[index] = NULL;
     #ifdef FTP_DEBUG
-  	Serial.println ("-> connection management set to passive");
-    Serial.println ("-> data port set to " + String (dataPort));
+    Serial.println ("-> data port " + String (FTP_DATA_PORT_PASV + index) + " released");
     #endif
-    client.println ("227 Entering Passive Mode (" + String (dataIp[0]) + "," + String (dataIp[1]) + "," + String (dataIp[2]) + "," + String (dataIp[3]) + "," + String (dataPort >> 8) + "," + String (dataPort & 255) + ").");
-    dataPassiveConn = true;
   }
-  
-  //
-  //  PORT - Data Port
-  //
-  else if (!strcmp (command, "PORT")) {
-    if (data) {
-      data.stop ();
-      #ifdef FTP_DEBUG
-      Serial.println ("-> client disconnected from dataserver");
-      #endif
+}
+
+// Look for a listing of a directory in the cache
+//
+// parameters:
+//   path: the listed directory
+//   command: LIST, MLSD or NLST, as each has its own format
+//
+// return:
+//    the cache entry, or NULL if there is none (or it is too old)
+
+FtpListCacheEntry * FtpServer::findListing (const char * path, const char * command) {
+  #if FTP_LIST_CACHE
+  for (uint8_t i = 0; i < FTP_LIST_CACHE_ENTRIES; i ++) {
+    FtpListCacheEntry * entry = &listCache[i];
+    if (entry->path[0] != 0 && !entry->claimed && !strcmp (entry->command, command) && !strcmp (entry->path, path)) {
+      if ((int32_t) (millis () - entry->millisStored) > (int32_t) FTP_LIST_CACHE_TIME_OUT * 1000) {
+        entry->path[0] = 0;
+        return NULL;
+      }
+      entry->millisUsed = millis ();
+      return entry;
     }
-    // get IP of data client
-    dataIp[0] = atoi (parameters);
-    char * p = strchr (parameters, ',');
-    for (uint8_t i = 1; i < 4; i ++) {
-      dataIp[i] = atoi (++ p);
-      p = strchr (p, ',');
+  }
+  #endif
+  return NULL;
+}
+
+// Free the least recently used cache entry, to store a new listing in it
+//
+//  The entry stays free (empty path) until the caller fills in its key
+//
+// return:
+//    the emptied entry, or NULL if the cache is disabled
+
+FtpListCacheEntry * FtpServer::claimListing () {
+  FtpListCacheEntry * oldest = NULL;
+  #if FTP_LIST_CACHE
+  for (uint8_t i = 0; i < FTP_LIST_CACHE_ENTRIES; i ++) {
+    FtpListCacheEntry * entry = &listCache[i];
+    if (entry->claimed) {              // another session is filling it
+      continue;
     }
-    // get port of data client
-    dataPort = 256 * atoi (++ p);
-    p = strchr (p, ',');
-    dataPort += atoi (++ p);
-    if (p == NULL) {
-      client.println ("501 Can't interpret parameters");
+    if (entry->path[0] == 0) {
+      oldest = entry;
+      break;
     }
-    else {
-      client.println ("200 PORT command successful");
-      dataPassiveConn = false;
+    if (oldest == NULL || (int32_t) (entry->millisUsed - oldest->millisUsed) < 0) {
+      oldest = entry;
     }
   }
-  
-  //
-  //  STRU - File Structure
-  //
-  else if (!strcmp (command, "STRU")) {
-    if (!strcmp (parameters, "F")) {
-      client.println ("200 F Ok");
+  if (oldest != NULL) {
+    oldest->path[0] = 0;
+    oldest->length = 0;
+    oldest->claimed = true;
+    oldest->millisUsed = millis ();
+  }
+  #endif
+  return oldest;
+}
+
+// Find the digest of a file, made by HASH, XCRC or XMD5 with algorithm
+//
+// return:
+//    the cache entry, or NULL if there is none for this size and time of the file
+
+const FtpHashCacheEntry * FtpServer::findHash (const char * path, uint32_t size, time_t mtime, uint8_t algorithm) {
+  for (uint8_t i = 0; i < FTP_HASH_CACHE_ENTRIES; i ++) {
+    FtpHashCacheEntry * entry = &hashCache[i];
+    if (entry->path[0] != 0 && entry->algorithm == algorithm && entry->size == size
+        && entry->mtime == mtime && !strcmp (entry->path, path)) {
+      entry->millisUsed = millis ();
+      return entry;
     }
-    else {
-      client.println ("504 Only F (ile) is supported");
+  }
+  return NULL;
+}
+
+// Keep the digest of a file, in place of the least recently used one
+
+void FtpServer::storeHash (const char * path, uint32_t size, time_t mtime, uint8_t algorithm,
+                           const uint8_t * digest, uint8_t length) {
+  FtpHashCacheEntry * oldest = NULL;
+  for (uint8_t i = 0; i < FTP_HASH_CACHE_ENTRIES; i ++) {
+    FtpHashCacheEntry * entry = &hashCache[i];
+    if (entry->path[0] == 0) {
+      oldest = entry;
+      break;
+    }
+    if (oldest == NULL || (int32_t) (entry->millisUsed - oldest->millisUsed) < 0) {
+      oldest = entry;
     }
   }
-  
-  //
-  //  TYPE - Data Type
-  //
-  else if (!strcmp (command, "TYPE")) {
-    if (!strcmp (parameters, "A")) {
-      client.println ("200 TYPE is now ASCII");
+  if (oldest != NULL) {
+    strcpy (oldest->path, path);
+    oldest->size = size;
+    oldest->mtime = mtime;
+    oldest->algorithm = algorithm;
+    oldest->length = length;
+    memcpy (oldest->digest, digest, length);
+    oldest->millisUsed = millis ();
+  }
+}
+
+// Forget what is cached about a file or directory
+//
+//  The listings of the directory itself, of everything below it, and of
+//  the directory that contains it are dropped, with the digests and the
+//  cached copies of the file or of the files below the directory, and the path index is
+//  brought up to date. Call it after changing the file system outside of
+//  the ftp server, or with NULL to empty the cache.
+
+void FtpServer::invalidateCache (const char * path) {
+  uint16_t len = path != NULL ? strlen (path) : 0;
+  #if FTP_LIST_CACHE
+  const char * sep = path != NULL ? strrchr (path, '/') : NULL;
+  uint16_t parentLen = sep != NULL ? sep - path : 0;
+  for (uint8_t i = 0; i < FTP_LIST_CACHE_ENTRIES; i ++) {
+    char * cached = listCache[i].path;
+    bool drop = path == NULL;
+    if (!drop && !strncmp (cached, path, len) && (cached[len] == 0 || cached[len] == '/')) {
+      drop = true;                     // the directory itself, or one below it
+    }
+    else if (!drop && parentLen == 0) {
+      drop = !strcmp (cached, "/");    // parent is the root
+    }
+    else if (!drop) {
+      drop = strlen (cached) == parentLen && !strncmp (cached, path, parentLen);
+    }
+    if (drop) {
+      #ifdef FTP_DEBUG
+      if (cached[0] != 0) {
+        Serial.println ("-> listing of " + String (cached) + " removed from cache");
+      }
+      #endif
+      cached[0] = 0;
+    }
+  }
+  #endif
+  for (uint8_t i = 0; i < FTP_HASH_CACHE_ENTRIES; i ++) {
+    char * hashed = hashCache[i].path;
+    if (path == NULL || (!strncmp (hashed, path, len) && (hashed[len] == 0 || hashed[len] == '/'))) {
+      hashed[0] = 0;
     }
-    else if (!strcmp (parameters, "I" )) {
-      client.println ("200 TYPE is now 8-bit binary");
+  }
+  #if FTP_FILE_CACHE
+  fileCache.invalidate (path);
+  #endif
+  #if FTP_PATH_INDEX
+  if (path == NULL) {
+    pathIndex.clear ();
+  }
+  else {
+    pathIndex.update (path);
+  }
+  #endif
+}
+
+void FtpSession::begin (FtpServer * owner) {
+  server = owner;
+  dataPortIndex = -1;
+  listCache = NULL;
+  zs = NULL;
+  zPlain = NULL;
+  pipe = NULL;
+  file = NULL;
+  millisTimeOut = (uint32_t)FTP_TIME_OUT * 60 * 1000;
+  millisDelay = 0;
+  cmdStatus = 0;
+  iniVariables ();
+}
+
+bool FtpSession::isIdle () {
+  return cmdStatus == 2 && !client.connected ();
+}
+
+// Tell waitEvent () what brings work to this session: sockets to watch,
+// and the time of its next time out, or that it has work to do now
+
+void FtpSession::prepareWait (FtpWait & wait) {
+  if ((int32_t) (millisDelay - millis ()) > 0) {
+    waitUntil (wait, millisDelay);
+  }
+  else if (cmdStatus < 2) {
+    wait.millis = 0;
+  }
+  else if (cmdStatus > 2) {          // (when idle, the server watches its port)
+    if (iCL == FTP_CMD_SIZE || memchr (cmdLine + nCL, '\n', iCL - nCL) != NULL) {
+      wait.millis = 0;               // lines received but not run yet
     }
     else {
-      client.println ("504 Unknown TYPE");
+      waitRead (wait, client);
+    }
+    if (transferStatus == 0) {
+      waitUntil (wait, millisEndConnection);
     }
   }
 
-  ///////////////////////////////////////
-  //                                   //
-  //        FTP SERVICE COMMANDS       //
-  //                                   //
-  ///////////////////////////////////////
+  if (transferStatus == 3) {
+    if (dataPortIndex >= 0) {
+      waitAccept (wait, * server->dataServers[dataPortIndex]);
+    }
+    waitUntil (wait, millisEndData);
+  }
+  else if (transferStatus != 0) {
+    uint32_t rateMillis = max (rateLimit.millisToWait (), server->rateLimit.millisToWait ());
+    if (!stalled || transferStatus == 5 || pipeWaiting ()) {
+      wait.millis = 0;               // (the file system task can't wake select () up: poll it)
+    }
+    else if (rateMillis > 0 && transferStatus != 4) {
+      wait.millis = min (wait.millis, rateMillis);
+    }
+    else if (transferStatus == 2) {
+      waitRead (wait, data);
+    }
+    else {                           // RETR and listings, that also end if the client goes away
+      waitWrite (wait, data);
+      waitRead (wait, data);
+    }
+  }
+}
 
-  //
-  //  ABOR - Abort
-  //
-  else if (!strcmp (command, "ABOR")) {
-    abortTransfer ();
-    client.println ("226 Data connection closed");
+void FtpSession::iniVariables () {
+  // Default for data port
+  dataPort = FTP_DATA_PORT_PASV;
+  releaseDataPort ();
+  
+  // Default Data connection is Active
+  dataPassiveConn = false;
+  
+  // Set the root directory
+  strcpy (cwdName, "/");
+
+  rnfrCmd = false;
+  restartOffset = 0;
+  transferMode = 'S';
+  hashAlgorithm = FtpHash::SHA1;
+  transferStatus = 0;
+  stalled = false;
+}
+
+// Run the commands of the client
+
+void FtpSession::handleControl (FtpStorage &fs) {
+  if ((int32_t) (millisDelay - millis ()) > 0) {
+    return;
   }
   
-  //
-  //  DELE - Delete a File 
-  //
-  else if (!strcmp (command, "DELE")) {
-    char path[FTP_CWD_SIZE];
-    if (strlen (parameters) == 0) {
-      client.println ("501 No file name");
-    }
-    else if (makePath (path)) {
-      if (!fs.exists (path)) {
-        client.println ("550 File " + String (parameters) + " not found");
+  if (cmdStatus == 0) {
+    if (client.connected ()) {
+      disconnectClient ();
+    }
+    cmdStatus = 1;
+  }
+  else if (cmdStatus == 1) {         // Ftp server waiting for connection
+    abortTransfer ();
+    iniVariables ();
+    #ifdef FTP_DEBUG
+  	Serial.println ("-> ftp server waiting for connection on port " + String (FTP_CTRL_PORT));
+    #endif
+    cmdStatus = 2;
+  }
+  else if (cmdStatus == 2) {         // Ftp server idle
+    if (client.connected ()) {       // A client connected
+      clientConnected ();      
+      millisEndConnection = millis () + 10 * 1000; // wait client id during 10 s.
+      cmdStatus = 3;
+    }
+  }
+  else {
+    // run the command lines already received, up to FTP_CMD_PIPELINE of them
+    int16_t rc = -1;
+    for (uint8_t n = 0; n < FTP_CMD_PIPELINE && cmdStatus > 2; n ++) {
+      rc = readCommand ();
+      if (rc == -1) {                // no complete line
+        break;
       }
-      else {
-        if (fs.remove (path)) {
-          client.println ("250 Deleted " + String (parameters));
-          // silently recreate the directory if it vanished with the last file it contained
-          String directory = String (path).substring (0, String(path).lastIndexOf ("/"));
-          if (!fs.exists (directory.c_str())) {
-            fs.mkdir (directory.c_str());
-          }
+      if (rc <= 0) {                 // empty line, or syntax error already answered
+        continue;
+      }
+      if (cmdStatus == 3) {          // Ftp server waiting for user identity
+        if (userIdentity ()) {
+          cmdStatus = 4;
         }
         else {
-          client.println ("450 Can't delete " + String (parameters));
+          cmdStatus = 0;
         }
       }
-    }
-  }
-  
-  //
-  //  LIST - List 
-  //
-  else if (!strcmp (command, "LIST")) {
-    if (dataConnect ()) {
-      client.println ("150 Accepted data connection");
-      uint16_t nm = 0;
-      
-      #ifdef ESP8266
-      Dir dir = fs.openDir (cwdName);
-      while (dir.next ()) {
-        String fname, fsize;
-        fname = dir.fileName ();
-        time_t ftime = dir.fileTime ();
-        ptm = gmtime (&ftime);
-        int pos = fname.lastIndexOf ("/"); //looking for the beginning of the file by the last "/"
-        fname.remove (0, pos + 1); //Delete everything up to and including the filename
-        fsize = String (dir.fileSize ());
-        if (dir.isDirectory ()){
-          sprintf (buffer, "%04d-%02d-%02d  %02d:%02d    <DIR>           %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, fname.c_str());
-        } 
+      else if (cmdStatus == 4) {     // Ftp server waiting for user registration
+        if (userPassword ()) {
+          cmdStatus = 5;
+          millisEndConnection = millis () + millisTimeOut;
+        }
         else {
-          sprintf (buffer, "%04d-%02d-%02d  %02d:%02d    %s  %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, fillSpaces (14, String (fsize)).c_str(), fname.c_str());
+          cmdStatus = 0;
         }
-        data.println (buffer);
-        nm ++;
       }
-      client.println( "226 " + String (nm) + " matches total");
-      #endif
-      #ifdef ESP32
-      File dir = fs.open (cwdName);
-      if ((!dir) || (!dir.isDirectory ())) {
-        client.println ("550 Can't open directory " + String (cwdName));
-      }
-      else {
-        File file = dir.openNextFile ();
-        while (file) {
-          String fname, fsize;
-          fname = file.name ();
-          ftime = file.getLastWrite ();
-          ptm = gmtime (&ftime);
-          int pos = fname.lastIndexOf ("/"); //looking for the beginning of the file by the last "/"
-          fname.remove (0, pos + 1); //Delete everything up to and including the filename
-          #ifdef FTP_DEBUG
-          Serial.println ("-> " + fname);
-          #endif
-          fsize = String (file.size ());   
-          if (file.isDirectory ()){
-          	sprintf (buffer, "%04u-%02u-%02u  %02u:%02u    <DIR>           %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, fname.c_str());
-          } 
-          else {
-          	sprintf (buffer, "%04u-%02u-%02u  %02d:%02u    %s  %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, fillSpaces (14, String (fsize)).c_str(), fname.c_str());
-          }           
-          data.println (buffer);
-          nm ++;
-          file = dir.openNextFile ();
+      else if (cmdStatus == 5) {     // Ftp server waiting for user command
+        #ifdef FTP_DEBUG
+        uint32_t allocs = ftpAllocCount ();
+        #endif
+        if (!processCommand (fs)) {
+          cmdStatus = 0;
+        }
+        else {
+          millisEndConnection = millis () + millisTimeOut;
         }
-        client.println ("226 " + String (nm) + " matches total");
+        #ifdef FTP_DEBUG
+        if (ftpAllocCount () != allocs) {
+          Serial.println ("-> " + String (ftpAllocCount () - allocs) + " heap allocations by " + String (command));
+        }
+        #endif
       }
-      #endif
-      data.stop ();
+    }
+    if (rc == -1 && cmdStatus > 2 && (!client.connected () || !client)) {
+      cmdStatus = 1;
       #ifdef FTP_DEBUG
-      Serial.println ("-> client disconnected from dataserver");
+      Serial.println ("-> client disconnected");
       #endif
     }
-    else {
-      client.println ("425 No data connection");
-      data.stop ();
-    }    
+    else if (cmdStatus > 2 && transferStatus == 0 && ! ((int32_t) (millisEndConnection - millis ()) > 0 )) {
+      reply (530, "Timeout");
+      millisDelay = millis () + 200; // delay of 200 ms
+      cmdStatus = 0;
+    }
   }
-  
-  //
-  //  MLSD - Listing for Machine Processing (see RFC 3659)
-  //
-  else if (!strcmp (command, "MLSD")) {
-    if (!dataConnect ()) {
-      client.println ("425 No data connection MLSD");
+}
+
+// Give the transfer in progress its quantum
+//
+//  A transfer runs until it has moved FTP_QUANTUM_BYTES, or for
+//  FTP_QUANTUM_MICROS, or until it can't progress (socket or file system
+//  not ready), or until the client sends a command, and then lets the
+//  transfers of the other sessions run.
+
+void FtpSession::handleTransfer (FtpStorage &fs) {
+  if (transferStatus == 3) {         // Waiting for data connection
+    if (dataConnect ()) {
+      dataConnected (fs, false);
     }
-    else {
-      client.println ("150 Accepted data connection");
-      uint16_t nm = 0;
-      #ifdef ESP8266
-      Dir dir = fs.openDir (cwdName);
-      char dtStr[15];
-      while (dir.next ()) {
-        String fn, fs;
-        fn = dir.fileName ();
-        int pos = fn.lastIndexOf ("/"); //looking for the beginning of the file by the last "/"
-        fn.remove (0, pos + 1); //Delete everything up to and including the filename
-        fs = String (dir.fileSize ());
-        ftime = dir.fileTime ();
-        ptm = gmtime (&ftime);
-        if (dir.isDirectory ()) {
-          sprintf (buffer, "Type=dir;Modify=%04u%02u%02u%02u%02u%02u; %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, ptm->tm_sec, fn.c_str());
-        } 
-        else {                 
-          sprintf (buffer, "Type=file;Size=%s;Modify=%04u%02u%02u%02u%02u%02u; %s", fs.c_str(), ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, ptm->tm_sec, fn.c_str());
-        }
-        data.println (buffer);
-        nm ++;
-      }
-      client.println ("226-options: -a -l");
-      client.println("226 " + String(nm) + " matches total");
-      #endif
-      #ifdef ESP32
-      File dir = fs.open (cwdName);
-      char dtStr[15];
-      if (!fs.exists (cwdName)) {
-        client.println ("550 Can't open directory " + String (parameters));
-      }
-      else {
-        File file = dir.openNextFile ();
-        while (file) {
-          String fn, fs;
-          fn = file.name ();
-          int pos = fn.lastIndexOf ("/"); // looking for the beginning of the file by the last "/"
-          fn.remove (0, pos + 1); // delete everything up to and including the filename
-          fs = String (file.size ());
-          ftime = file.getLastWrite ();
-          ptm = gmtime (&ftime);
-          if (file.isDirectory ()) {
-            sprintf (buffer, "Type=dir;Modify=%04u%02u%02u%02u%02u%02u; %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, ptm->tm_sec, fn.c_str());
-          } 
-          else {
-            sprintf (buffer, "Type=file;Size=%s;Modify=%04u%02u%02u%02u%02u%02u; %s", fs.c_str(), ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, ptm->tm_sec, fn.c_str());
-          } 
-          data.println (buffer);
-          nm ++;
-          file = dir.openNextFile ();
-        }
-        client.println ("226-options: -a -l");
-        client.println ("226 " + String (nm) + " matches total");
-      }
-      #endif
-      data.stop ();
-      #ifdef FTP_DEBUG
-      Serial.println ("-> client disconnected from dataserver");
-      #endif
+    else if (! ((int32_t) (millisEndData - millis ()) > 0)) {
+      reply (425, "No data connection");
+      closeFile ();
+      releaseDataPort ();
+      transferStatus = 0;
     }
+    return;
   }
-  
-  //
-  //  NLST - Name List 
-  //
-  else if (!strcmp (command, "NLST" )) {
-    if (!dataConnect ()) {
-      client.println ("425 No data connection");
+  if (transferStatus == 0) {
+    return;
+  }
+  uint32_t start = micros ();
+  uint32_t first = bytesTransferred;
+  boolean  more;
+  stalled = false;
+  do {
+    uint32_t bytes = bytesTransferred;
+    uint16_t pending = nBuf;
+    if (transferStatus == 1) {       // Retrieve data
+      more = doRetrieve ();
     }
-    else {
-      client.println ("150 Accepted data connection");
-      uint16_t nm = 0;
-      #ifdef ESP8266
-      Dir dir = fs.openDir (cwdName);
-      if (!fs.exists (cwdName)) {
-        client.println ("550 Can't open directory " + String (parameters));
-      }
-      else {
-        while (dir.next ()) {
-          data.println (dir.fileName ());
-          nm ++;
-        }
-        client.println ("226 " + String(nm) + " matches total");
-      }
-      #endif
-      #ifdef ESP32
-      File dir = fs.open (cwdName);
-      if (!fs.exists (cwdName)) {
-        client.println ("550 Can't open directory " + String (parameters));
-      }
-      else {
-        File file = dir.openNextFile ();
-        while (file) {
-          data.println (file.name ());
-          nm ++;
-          file = dir.openNextFile ();
-        }
-        client.println ("226 " + String (nm) + " matches total");
-      }
-      #endif
-      data.stop ();
-      #ifdef FTP_DEBUG
-      Serial.println ("-> client disconnected from dataserver");
-      #endif
+    else if (transferStatus == 2) {  // Store data
+      more = doStore ();
+    }
+    else if (transferStatus == 5) {  // Hash a file
+      more = doHash ();
+    }
+    else {                           // Send listing
+      more = doListing ();
+    }
+    if (!more) {
+      transferStatus = 0;
+    }
+    else if (bytesTransferred == bytes && nBuf == pending) {
+      stalled = true;                // let the others run
+      break;
+    }
+  } while (more && bytesTransferred - first < FTP_QUANTUM_BYTES
+           && (uint32_t) (micros () - start) < FTP_QUANTUM_MICROS && client.available () == 0);
+  // a transfer keeps the control connection alive
+  millisEndConnection = millis () + millisTimeOut;
+}
+
+void FtpSession::clientConnected () {
+  #ifdef FTP_DEBUG
+  Serial.println ("-> client connected");
+  #endif
+  nReply = 0;
+  rateLimit.set (server->sessionRate);
+  client.setNoDelay (true);            // replies go in one write each: don't hold a 226 until its 150 is acked
+  replyPart (220, "Welcome to FTP for ESP8266/ESP32");
+  replyPart (220, "By David Paiva");
+  replyPart (220, "Version %s", FTP_SERVER_VERSION);
+  reply (220, "Put your ftp client in passive mode");
+  iCL = 0;
+  nCL = 0;
+  skipLine = false;
+}
+
+void FtpSession::disconnectClient () {
+  #ifdef FTP_DEBUG
+  Serial.println ("-> disconnecting client");
+  #endif
+  abortTransfer ();
+  reply (221, "Goodbye");
+  client.stop ();
+  data.stop ();                        // kept open after the last transfer in MODE B
+}
+
+boolean FtpSession::userIdentity () {	
+  if (commandCode != FTP_CMD ('U', 'S', 'E', 'R')) {
+    reply (500, "Syntax error");
+  }
+  if (strcmp (parameters, server->_FTP_USER.c_str ())) {
+    reply (530, "user not found");
+  }
+  else {
+    reply (331, "OK. Password required");
+    strcpy (cwdName, "/");
+    return true;
+  }
+  server->stats.loginsFailed ++;
+  millisDelay = millis () + 100;  // delay of 100 ms
+  return false;
+}
+
+boolean FtpSession::userPassword () {
+  if (commandCode != FTP_CMD ('P', 'A', 'S', 'S')) {
+    reply (500, "Syntax error");
+  }
+  else if (strcmp (parameters, server->_FTP_PASS.c_str ())) {
+    reply (530, "Login incorrect");
+  }
+  else {
+    #ifdef FTP_DEBUG
+    Serial.println ("-> user authenticated");
+    #endif
+    reply (230, "OK.");
+    return true;
+  }
+  server->stats.loginsFailed ++;
+  millisDelay = millis () + 100;  // delay of 100 ms
+  return false;
+}
+
+// Run the command received from the client
+//
+//  The command is found by its code (see readCommand ()), with a switch
+//  that the compiler turns into a table or a binary search
+//
+// return:
+//    false, if the client must be disconnected
+
+boolean FtpSession::processCommand (FtpStorage &fs) {
+  // file, dataCommand and the data connection belong to the transfer or
+  // hash in progress (and to the file system task, until it ends), and
+  // its mode and offset are read all along it
+  if (transferStatus != 0 || pipe != NULL) {
+    switch (commandCode) {
+      case FTP_CMD ('M', 'O', 'D', 'E'):
+      case FTP_CMD ('P', 'A', 'S', 'V'):
+      case FTP_CMD ('P', 'O', 'R', 'T'):
+      case FTP_CMD ('R', 'E', 'S', 'T'):
+      case FTP_CMD ('R', 'E', 'T', 'R'):
+      case FTP_CMD ('S', 'T', 'O', 'R'):
+      case FTP_CMD ('A', 'P', 'P', 'E'):
+      case FTP_CMD ('L', 'I', 'S', 'T'):
+      case FTP_CMD ('M', 'L', 'S', 'D'):
+      case FTP_CMD ('N', 'L', 'S', 'T'):
+      case FTP_CMD ('H', 'A', 'S', 'H'):
+      case FTP_CMD ('X', 'C', 'R', 'C'):
+      case FTP_CMD ('X', 'M', 'D', '5'):
+        reply (425, "Transfer in progress");
+        return true;
+    }
+  }
+  switch (commandCode) {
+    // access control commands
+    case FTP_CMD ('C', 'D', 'U', 'P'):
+      cmdCdup (fs);
+      break;
+    case FTP_CMD ('C', 'W', 'D', 0):
+      cmdCwd (fs);
+      break;
+    case FTP_CMD ('P', 'W', 'D', 0):
+      cmdPwd ();
+      break;
+    case FTP_CMD ('Q', 'U', 'I', 'T'):
+      disconnectClient ();
+      return false;
+
+    // transfer parameter commands
+    case FTP_CMD ('M', 'O', 'D', 'E'):
+      cmdMode ();
+      break;
+    case FTP_CMD ('P', 'A', 'S', 'V'):
+      cmdPasv ();
+      break;
+    case FTP_CMD ('P', 'O', 'R', 'T'):
+      cmdPort ();
+      break;
+    case FTP_CMD ('S', 'T', 'R', 'U'):
+      cmdStru ();
+      break;
+    case FTP_CMD ('T', 'Y', 'P', 'E'):
+      cmdType ();
+      break;
+    case FTP_CMD ('R', 'E', 'S', 'T'):
+      cmdRest ();
+      break;
+
+    // ftp service commands
+    case FTP_CMD ('A', 'B', 'O', 'R'):
+      cmdAbor ();
+      break;
+    case FTP_CMD ('D', 'E', 'L', 'E'):
+      cmdDele (fs);
+      break;
+    case FTP_CMD ('L', 'I', 'S', 'T'):
+      cmdList (fs);
+      break;
+    case FTP_CMD ('M', 'L', 'S', 'D'):
+      cmdMlsd (fs);
+      break;
+    case FTP_CMD ('N', 'L', 'S', 'T'):
+      cmdNlst (fs);
+      break;
+    case FTP_CMD ('N', 'O', 'O', 'P'):
+      cmdNoop ();
+      break;
+    case FTP_CMD ('R', 'E', 'T', 'R'):
+      cmdRetr (fs);
+      break;
+    case FTP_CMD ('S', 'T', 'O', 'R'):
+    case FTP_CMD ('A', 'P', 'P', 'E'):
+      cmdStor (fs);
+      break;
+    case FTP_CMD ('M', 'K', 'D', 0):
+      cmdMkd (fs);
+      break;
+    case FTP_CMD ('R', 'M', 'D', 0):
+      cmdRmd (fs);
+      break;
+    case FTP_CMD ('R', 'N', 'F', 'R'):
+      cmdRnfr (fs);
+      break;
+    case FTP_CMD ('R', 'N', 'T', 'O'):
+      cmdRnto (fs);
+      break;
+
+    // extensions commands (rfc 3659)
+    case FTP_CMD ('F', 'E', 'A', 'T'):
+      cmdFeat ();
+      break;
+    case FTP_CMD ('M', 'D', 'T', 'M'):
+      cmdMdtm (fs);
+      break;
+    case FTP_CMD ('M', 'F', 'M', 'T'):
+      cmdMfmt (fs);
+      break;
+    case FTP_CMD ('S', 'I', 'Z', 'E'):
+      cmdSize (fs);
+      break;
+    case FTP_CMD ('S', 'I', 'T', 'E'):
+      cmdSite ();
+      break;
+    case FTP_CMD ('O', 'P', 'T', 'S'):
+      cmdOpts ();
+      break;
+
+    // digests of files (HASH: draft-bryan-ftpext-hash)
+    case FTP_CMD ('H', 'A', 'S', 'H'):
+    case FTP_CMD ('X', 'C', 'R', 'C'):
+    case FTP_CMD ('X', 'M', 'D', '5'):
+      cmdHash (fs);
+      break;
+
+    default:
+      reply (500, "Unknown command");
+  }
+  return true;
+}
+
+///////////////////////////////////////
+//                                   //
+//      ACCESS CONTROL COMMANDS      //
+//                                   //
+///////////////////////////////////////
+
+// CDUP - Change to Parent Directory
+
+void FtpSession::cmdCdup (FtpStorage &fs) {
+  bool ok = false;
+  if (strlen (cwdName) > 1) {            // do nothing if cwdName is root
+    // if cwdName ends with '/', remove it (must not append)
+    if (cwdName[strlen (cwdName) - 1] == '/') {
+      cwdName[ strlen (cwdName ) - 1 ] = 0;
+    }
+    // search last '/'
+    char * pSep = strrchr (cwdName, '/');
+    ok = pSep > cwdName;
+    // if found, ends the string on its position
+    if (ok) {
+      * pSep = 0;
+      ok = pathExists (fs, cwdName);
     }
   }
-  
-  //
-  //  NOOP
-  //
-  else if (!strcmp (command, "NOOP")) {
-    client.println ("200 Zzz...");
+  // if an error appends, move to root
+  if (!ok) {
+    strcpy (cwdName, "/");
+  }
+  reply (250, "Ok. Current directory is %s", cwdName);
+}
+
+// CWD - Change Working Directory
+
+void FtpSession::cmdCwd (FtpStorage &fs) {
+  if (!strcmp (parameters, "..")) {
+    cmdCdup (fs);
+    return;
+  }
+  char path[FTP_CWD_SIZE];
+  if (haveParameter () && makeExistsPath (fs, path)) {
+    strcpy (cwdName, path);
+    reply (250, "Ok. Current directory is %s", cwdName);
+  }  
+}
+
+// PWD - Print Directory
+
+void FtpSession::cmdPwd () {
+  reply (257, "\"%s\" is your current directory", cwdName);
+}
+
+///////////////////////////////////////
+//                                   //
+//    TRANSFER PARAMETER COMMANDS    //
+//                                   //
+///////////////////////////////////////
+
+// MODE - Transfer Mode
+
+void FtpSession::cmdMode () {
+  if (!strcmp (parameters, "S")) {
+    transferMode = 'S';
+    reply (200, "S Ok");
+  }
+  else if (!strcmp (parameters, "B")) {
+    transferMode = 'B';
+    reply (200, "B Ok");
+  }
+  #if FTP_MODE_Z
+  else if (!strcmp (parameters, "Z")) {
+    transferMode = 'Z';
+    reply (200, "Z Ok");
+  }
+  else {
+    reply (504, "Only S (tream), B (lock) and Z (deflate) are supported");
+  }
+  #else
+  else {
+    reply (504, "Only S (tream) and B (lock) are supported");
+  }
+  #endif
+}
+
+// PASV - Passive Connection management
+
+void FtpSession::cmdPasv () {
+  if (data.connected ()) {
+    data.stop ();
+    #ifdef FTP_DEBUG
+    Serial.println ("-> client disconnected from dataserver");
+    #endif
+  }
+  releaseDataPort ();
+  dataPortIndex = server->acquireDataPort (this);
+  if (dataPortIndex < 0) {
+    reply (425, "No passive port available, try again later");
+    dataPassiveConn = false;
+  }
+  else {
+    dataIp = WiFi.localIP ();
+    dataPort = FTP_DATA_PORT_PASV + dataPortIndex;
+    #ifdef FTP_DEBUG
+    Serial.println ("-> connection management set to passive");
+    Serial.println ("-> data port set to " + String (dataPort));
+    #endif
+    reply (227, "Entering Passive Mode (%u,%u,%u,%u,%u,%u).", dataIp[0], dataIp[1], dataIp[2], dataIp[3], dataPort >> 8, dataPort & 255);
+    dataPassiveConn = true;
+  }
+}
+
+// PORT - Data Port
+
+void FtpSession::cmdPort () {
+  if (data) {
+    data.stop ();
+    #ifdef FTP_DEBUG
+    Serial.println ("-> client disconnected from dataserver");
+    #endif
+  }
+  // get IP of data client
+  dataIp[0] = atoi (parameters);
+  char * p = strchr (parameters, ',');
+  for (uint8_t i = 1; i < 4; i ++) {
+    dataIp[i] = atoi (++ p);
+    p = strchr (p, ',');
+  }
+  // get port of data client
+  dataPort = 256 * atoi (++ p);
+  p = strchr (p, ',');
+  dataPort += atoi (++ p);
+  if (p == NULL) {
+    reply (501, "Can't interpret parameters");
+  }
+  else {
+    reply (200, "PORT command successful");
+    dataPassiveConn = false;
+    releaseDataPort ();
+  }
+}
+
+// STRU - File Structure
+
+void FtpSession::cmdStru () {
+  if (!strcmp (parameters, "F")) {
+    reply (200, "F Ok");
+  }
+  else {
+    reply (504, "Only F (ile) is supported");
+  }
+}
+
+// TYPE - Data Type
+
+void FtpSession::cmdType () {
+  if (!strcmp (parameters, "A")) {
+    reply (200, "TYPE is now ASCII");
+  }
+  else if (!strcmp (parameters, "I" )) {
+    reply (200, "TYPE is now 8-bit binary");
+  }
+  else {
+    reply (504, "Unknown TYPE");
+  }
+}
+
+// REST - Restart a transfer from an offset (see RFC 3659)
+
+void FtpSession::cmdRest () {
+  char * end;
+  restartOffset = strtoul (parameters, &end, 10);
+  if (strlen (parameters) == 0 || * end != 0) {
+    restartOffset = 0;
+    reply (501, "Can't interpret parameters");
+  }
+  else {
+    reply (350, "Restarting at %lu", (unsigned long) restartOffset);
+  }
+}
+
+///////////////////////////////////////
+//                                   //
+//        FTP SERVICE COMMANDS       //
+//                                   //
+///////////////////////////////////////
+
+// ABOR - Abort
+
+void FtpSession::cmdAbor () {
+  abortTransfer ();
+  reply (226, "Data connection closed");
+}
+
+// DELE - Delete a File
+
+void FtpSession::cmdDele (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  if (strlen (parameters) == 0) {
+    reply (501, "No file name");
+  }
+  else if (makePath (path)) {
+    if (!pathExists (fs, path)) {
+      reply (550, "File %s not found", parameters);
+    }
+    else {
+      if (fs.remove (path)) {
+        server->invalidateCache (path);
+        reply (250, "Deleted %s", parameters);
+        // silently recreate the directory if it vanished with the last file it contained
+        char * slash = strrchr (path, '/');
+        if (slash != NULL && slash != path) {
+          * slash = 0;
+          #if FTP_PATH_INDEX
+          boolean vanished = !server->pathIndex.hasChildren (path) && !fs.stat (path, NULL);
+          #else
+          boolean vanished = !fs.stat (path, NULL);
+          #endif
+          if (vanished) {
+            fs.mkdir (path);
+          }
+        }
+      }
+      else {
+        reply (450, "Can't delete %s", parameters);
+      }
+    }
+  }
+}
+
+// LIST - List
+
+void FtpSession::cmdList (FtpStorage &fs) {
+  waitDataConnection (fs);
+}
+
+// MLSD - Listing for Machine Processing (see RFC 3659)
+
+void FtpSession::cmdMlsd (FtpStorage &fs) {
+  waitDataConnection (fs);
+}
+
+// NLST - Name List
+
+void FtpSession::cmdNlst (FtpStorage &fs) {
+  waitDataConnection (fs);
+}
+
+// NOOP
+
+void FtpSession::cmdNoop () {
+  reply (200, "Zzz...");
+}
+
+// RETR - Retrieve
+//
+//  RETR <dir>.tar, if there is no such file, sends the directory as a
+//  tar archive (see FtpTarReader)
+
+void FtpSession::cmdRetr (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  if (strlen (parameters) == 0) {
+    reply (501, "No file name");
+  }
+  else if (makePath (path)) {
+    file = fs.open (path, "r");
+    #if FTP_FILE_CACHE
+    if (file != NULL) {
+      useFileCache (path);
+    }
+    #endif
+    if (file == NULL && FTP_TAR) {
+      file = FtpTarReader::open (fs, path);
+    }
+    if (file == NULL) {
+      reply (550, "File %s not found", parameters);
+    }
+    else if (restartOffset > file->size () || !file->seek (restartOffset)
+             || (restartOffset > 0 && transferMode == 'Z')) {
+      reply (554, "Can't restart at %lu", (unsigned long) restartOffset);
+      closeFile ();
+    }
+    else {
+      #ifdef FTP_DEBUG
+      Serial.println ("-> sending " + String (parameters) + " from byte " + String (restartOffset));
+      #endif
+      strcpy (pathName, path);
+      waitDataConnection (fs);
+    }
+  }
+  restartOffset = 0;
+}
+
+// STOR - Store
+// APPE - Append
+//
+//  STOR <FTP_TAR_EXTRACT_DIR>/<dir>/<name>.tar extracts the archive into
+//  <dir> as it arrives (see FtpTarWriter)
+
+void FtpSession::cmdStor (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  char dir[FTP_CWD_SIZE];
+  if (strlen (parameters) == 0) {
+    reply (501, "No file name");
+  }
+  else if (makePath (path)) {
+    boolean extract = FTP_TAR && FtpTarWriter::target (path, dir);
+    if (extract && (commandCode != FTP_CMD ('S', 'T', 'O', 'R') || restartOffset > 0)) {
+      reply (554, "Can't append to or restart an extraction");
+      restartOffset = 0;
+      return;
+    }
+    else if (extract) {
+      file = FtpTarWriter::open (fs, dir);
+      strcpy (path, dir);              // what the transfer changes
+      storeOffset = 0;
+    }
+    else if (commandCode == FTP_CMD ('A', 'P', 'P', 'E')) {
+      file = fs.open (path, "a");
+      storeOffset = file != NULL ? file->size () : 0;
+    }
+    else if (restartOffset > 0 && transferMode == 'Z') {
+      reply (554, "Can't restart at %lu in MODE Z", (unsigned long) restartOffset);
+      restartOffset = 0;
+      return;
+    }
+    else if (restartOffset > 0) {
+      // resume: keep what is in the file up to the restart offset
+      file = fs.open (path, "r+");
+      if (file != NULL && (restartOffset > file->size () || !file->seek (restartOffset))) {
+        closeFile ();
+      }
+      storeOffset = restartOffset;
+    }
+    else {
+	    file = fs.open (path, "w");
+      storeOffset = 0;
+    }
+    if (file == NULL) {
+      reply (451, "Can't open/create %s", parameters);
+    }
+    else {
+      #ifdef FTP_DEBUG
+      Serial.println ("-> receiving " + String (parameters) + " from byte " + String (storeOffset));
+      #endif
+      strcpy (pathName, path);
+      server->invalidateCache (pathName);
+      waitDataConnection (fs);
+    }
+  }
+  restartOffset = 0;
+}
+
+// MKD - Make Directory
+
+void FtpSession::cmdMkd (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  if (haveParameter () && makePath (path)) {
+    if (pathExists (fs, path)) {
+      reply (521, "Can't create \"%s\", Directory exists", parameters);
+    }
+    else {
+      if (fs.mkdir (path)) {
+        server->invalidateCache (path);
+        reply (257, "\"%s\" created", parameters);
+      }
+      else {
+        reply (550, "Can't create \"%s\"", parameters);
+      }
+    }  
+  }
+}
+
+// RMD - Remove a Directory
+
+void FtpSession::cmdRmd (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  if (haveParameter () && makePath (path)) {
+    boolean removed = fs.rmdir (path);
+    server->invalidateCache (path);
+    if (removed) {
+      #ifdef FTP_DEBUG
+      Serial.println ("-> deleting " + String (parameters));
+      #endif
+      reply (250, "\"%s\" deleted", parameters);
+    }
+    else {
+    	if (pathExists (fs, path)) { // hack
+        reply (550, "Can't remove \"%s\". Directory not empty?", parameters);
+      }
+      else {
+        #ifdef FTP_DEBUG
+        Serial.println ("-> deleting " + String (parameters));
+        #endif
+        reply (250, "\"%s\" deleted", parameters);
+      }
+    }
+  }
+}
+
+// RNFR - Rename From
+
+void FtpSession::cmdRnfr (FtpStorage &fs) {
+  buf[0] = 0;
+  if (strlen (parameters) == 0) {
+    reply (501, "No file name");
+  }
+  else if (makePath (buf)) {
+    if (!pathExists (fs, buf)) {
+      reply (550, "File %s not found", parameters);
+    }
+    else {
+      #ifdef FTP_DEBUG
+      Serial.println ("-> renaming " + String (buf));
+      #endif
+      reply (350, "RNFR accepted - file exists, ready for destination");     
+      rnfrCmd = true;
+    }
+  }
+}
+
+// RNTO - Rename To
+
+void FtpSession::cmdRnto (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  if (strlen (buf ) == 0 || ! rnfrCmd) {
+    reply (503, "Need RNFR before RNTO");
+  }
+  else if (strlen (parameters ) == 0) {
+    reply (501, "No file name");
+  }
+  else if (makePath (path)) {
+    if (pathExists (fs, path)) {
+      reply (553, "%s already exists", parameters);
+    }
+    else {          
+      #ifdef FTP_DEBUG
+      Serial.println ("-> renaming " + String (buf) + " to " + String (path));
+      #endif
+      if (fs.rename (buf, path)) {
+        server->invalidateCache (buf);
+        server->invalidateCache (path);
+        reply (250, "File successfully renamed or moved");
+      }
+      else {
+        reply (451, "Rename/move failure");
+      }
+    }
+  }
+  rnfrCmd = false;
+}
+
+///////////////////////////////////////
+//                                   //
+//   EXTENSIONS COMMANDS (RFC 3659)  //
+//                                   //
+///////////////////////////////////////
+
+// FEAT - New Features
+
+void FtpSession::cmdFeat () {
+  replyPart (211, "Extensions supported:");
+  char algorithms[48];
+  algorithms[0] = 0;
+  for (uint8_t i = 0; i < FtpHash::COUNT; i ++) {
+    strcat (algorithms, FtpHash::name ((FtpHash::Algorithm) i));
+    strcat (algorithms, i == hashAlgorithm ? "*;" : ";");
+  }
+  algorithms[strlen (algorithms) - 1] = 0;
+  replyPart (0, " HASH %s", algorithms);
+  replyPart (0, " MDTM");
+  replyPart (0, " MFMT");
+  replyPart (0, " MLSD");
+  replyPart (0, " MODE B");
+  #if FTP_MODE_Z
+  replyPart (0, " MODE Z");
+  #endif
+  replyPart (0, " REST STREAM");
+  replyPart (0, " XCRC");
+  replyPart (0, " XMD5");
+  reply (211, "End.");
+}
+
+// Time of a date and time (UTC), inverse of splitTime ()
+
+static time_t joinTime (uint16_t year, uint8_t month, uint8_t day,
+                        uint8_t hour, uint8_t minute, uint8_t second) {
+  // days since 1970-01-01 of a civil date, counted in 400 year eras from 0000-03-01
+  uint32_t y = year - (month <= 2);
+  uint32_t era = y / 400;
+  uint32_t yoe = y - era * 400;
+  uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int32_t days = (int32_t) (era * 146097 + doe) - 719468;
+  return (time_t) days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+// MDTM - File Modification Time (see RFC 3659)
+//
+//  MDTM YYYYMMDDHHMMSS <file> sets the time, as MFMT does
+
+void FtpSession::cmdMdtm (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  char tstr[15];
+  uint16_t year;
+  uint8_t  month, day, hour, minute, second;
+  if (!haveParameter ()) {
+    return;
+  }
+  if (getDateTime (&year, &month, &day, &hour, &minute, &second) > 0) {
+    cmdMfmt (fs);
+  }
+  else if (makeExistsPath (fs, path)) {
+    FtpPathInfo info;
+    if (!pathInfo (fs, path, &info) || info.mtime <= 0) {
+      reply (550, "Unable to retrieve time of %s", parameters);
+    }
+    else {
+      reply (213, "%s", makeDateTimeStr (tstr, info.mtime));
+    }
+  }
+}
+
+// MFMT - Modify Fact: Modification Time (see draft-somers-ftp-mfxx)
+//
+//  MFMT YYYYMMDDHHMMSS <file>, the time being UTC
+
+void FtpSession::cmdMfmt (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  char tstr[15];
+  uint16_t year;
+  uint8_t  month, day, hour, minute, second;
+  uint8_t length = getDateTime (&year, &month, &day, &hour, &minute, &second);
+  if (length == 0 || year < 1970 || month < 1 || month > 12 || day < 1 || day > 31
+      || hour > 23 || minute > 59 || second > 59) {
+    reply (501, "Expected YYYYMMDDHHMMSS <file>");
+    return;
+  }
+  if (!makeExistsPath (fs, path, parameters + length)) {
+    return;
+  }
+  time_t t = joinTime (year, month, day, hour, minute, second);
+  FtpPathInfo info;
+  errno = 0;
+  if (!fs.setTime (path, t)) {
+    if (errno == ENOTSUP) {
+      // on ESP32, fs::FS files only below FTP_VFS_MOUNT ("/littlefs")
+      reply (550, "Setting file times is not supported on this file system");
+    }
+    else {
+      reply (550, "Can't set the time of %s", parameters + length);
+    }
+  }
+  else if (!fs.stat (path, &info) || info.mtime != t) {
+    reply (550, "Can't set the time of %s", parameters + length);
+  }
+  else {
+    server->invalidateCache (path);    // listings show the time
+    reply (213, "Modify=%s; %s", makeDateTimeStr (tstr, t), parameters + length);
+  }
+}
+
+// SIZE - Size of the file
+
+void FtpSession::cmdSize (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  if (strlen (parameters) == 0) {
+    reply (501, "No file name");
+  }
+  else if (makePath (path)) {
+    FtpPathInfo info;
+    if (!pathInfo (fs, path, &info)) {
+      reply (450, "Can't open %s", parameters);
+    }
+    else {
+      reply (213, "%lu", (unsigned long) info.size);
+    }
+  }
+}
+
+// OPTS - Options of a command (see RFC 2389); OPTS HASH [algorithm]
+
+void FtpSession::cmdOpts () {
+  if (!strncasecmp (parameters, "HASH", 4) && (parameters[4] == 0 || parameters[4] == ' ')) {
+    if (parameters[4] == ' ') {
+      int8_t algorithm = FtpHash::find (parameters + 5);
+      if (algorithm < 0) {
+        reply (504, "Unknown algorithm %s", parameters + 5);
+        return;
+      }
+      hashAlgorithm = (FtpHash::Algorithm) algorithm;
+    }
+    reply (200, "%s", FtpHash::name (hashAlgorithm));
+  }
+  else {
+    reply (501, "Unknown option %s", parameters);
+  }
+}
+
+// HASH - Digest of a file, with the algorithm set by OPTS HASH
+// XCRC - CRC-32 of a file
+// XMD5 - MD5 of a file
+//
+//  The file is read through buf by doHash (), a part on each call of
+//  handleFTP (), and the digest is kept while the file keeps its size
+//  and time, so that checking it again is answered at once.
+
+void FtpSession::cmdHash (FtpStorage &fs) {
+  char path[FTP_CWD_SIZE];
+  if (strlen (parameters) == 0) {
+    reply (501, "No file name");
+  }
+  else if (makePath (path)) {
+    file = fs.open (path, "r");
+    if (file == NULL) {
+      reply (550, "File %s not found", parameters);
+      return;
+    }
+    strcpy (pathName, path);
+    strcpy (dataCommand, command);
+    hashRunning = commandCode == FTP_CMD ('X', 'C', 'R', 'C') ? FtpHash::CRC32
+                : commandCode == FTP_CMD ('X', 'M', 'D', '5') ? FtpHash::MD5 : hashAlgorithm;
+    hashSize = file->size ();
+    hashMtime = file->lastWrite ();
+    const FtpHashCacheEntry * cached = server->findHash (pathName, hashSize, hashMtime, hashRunning);
+    if (cached != NULL) {
+      closeFile ();
+      replyHash (hashRunning, cached->digest, cached->length);
+      return;
+    }
+    hash.begin (hashRunning);
+    bytesTransferred = 0;
+    transferStatus = 5;
+  }
+}
+
+// Hash the next part of the file of HASH, XCRC or XMD5
+//
+// return:
+//    false, once the digest is sent
+
+boolean FtpSession::doHash () {
+  int32_t nb = file->read ((uint8_t *) buf, FTP_BUF_SIZE);
+  if (nb > 0) {
+    hash.update ((uint8_t *) buf, nb);
+    bytesTransferred += nb;
+    return true;
+  }
+  closeFile ();
+  if (bytesTransferred != hashSize) {
+    reply (451, "Can't read %s", pathName);
+    return false;
+  }
+  uint8_t digest[FTP_HASH_MAX_SIZE];
+  uint8_t length = hash.finish (digest);
+  server->storeHash (pathName, hashSize, hashMtime, hashRunning, digest, length);
+  replyHash (hashRunning, digest, length);
+  return false;
+}
+
+void FtpSession::replyHash (FtpHash::Algorithm algorithm, const uint8_t * digest, uint8_t length) {
+  static const char hexDigits[] = "0123456789abcdef";
+  char hex[2 * FTP_HASH_MAX_SIZE + 1];
+  for (uint8_t i = 0; i < length; i ++) {
+    hex[2 * i] = hexDigits[digest[i] >> 4];
+    hex[2 * i + 1] = hexDigits[digest[i] & 15];
+  }
+  hex[2 * length] = 0;
+  if (!strcmp (dataCommand, "HASH")) {
+    reply (213, "%s 0-%lu %s %s", FtpHash::name (algorithm), (unsigned long) hashSize, hex, pathName);
+  }
+  else {
+    reply (250, "%s", hex);
+  }
+}
+
+// SITE - System command
+
+void FtpSession::cmdSite () {
+  if (!strcasecmp (parameters, "STATS")) {
+    siteStats ();
+  }
+  else if (!strncasecmp (parameters, "RATE", 4) && (parameters[4] == 0 || parameters[4] == ' ')) {
+    siteRate (parameters + 4);
+  }
+  else {
+    reply (500, "Unknown SITE command %s", parameters);
+  }
+}
+
+// SITE STATS - counters of the server and of the last transfer
+
+void FtpSession::siteStats () {
+  const FtpServerStats & st = server->getStats ();
+  replyPart (211, "Statistics");
+  replyPart (0, " Sessions: %lu accepted, %lu rejected, %lu failed logins",
+             (unsigned long) st.sessions, (unsigned long) st.rejected, (unsigned long) st.loginsFailed);
+  replyPart (0, " Transfers: %lu completed, %lu failed, %lu KB sent, %lu KB received",
+             (unsigned long) st.transfers, (unsigned long) st.transfersFailed,
+             (unsigned long) (st.bytesSent >> 10), (unsigned long) (st.bytesReceived >> 10));
+  replyPart (0, " Throughput: %lu min, %lu avg, %lu max kbytes/s",
+             (unsigned long) st.kbpsMin, (unsigned long) (st.fileMillis > 0 ? st.fileBytes / st.fileMillis : 0),
+             (unsigned long) st.kbpsMax);
+  replyPart (0, " Time: %lu ms in file system, %lu ms on network, %lu stalls",
+             (unsigned long) (st.fsMicros / 1000), (unsigned long) (st.netMicros / 1000), (unsigned long) st.stalls);
+  if (st.last.command[0] != 0) {
+    replyPart (0, " Last: %s %s, %lu bytes in %lu ms, %lu ms in file system, %lu ms on network, %lu stalls",
+               st.last.command, st.last.completed ? "completed" : "failed",
+               (unsigned long) st.last.bytes, (unsigned long) st.last.millis,
+               (unsigned long) (st.last.fsMicros / 1000), (unsigned long) (st.last.netMicros / 1000),
+               (unsigned long) st.last.stalls);
+  }
+  #if FTP_PATH_INDEX
+  replyPart (0, " Path index: %u entries, %lu bytes (max %lu)", server->pathIndex.count (),
+             (unsigned long) server->pathIndex.footprint (), (unsigned long) FTP_PATH_INDEX_SIZE);
+  #endif
+  #if FTP_FILE_CACHE
+  replyPart (0, " File cache: %u files, %lu bytes (max %lu), %lu hits, %lu misses", server->fileCache.count (),
+             (unsigned long) server->fileCache.footprint (), (unsigned long) FTP_FILE_CACHE_SIZE,
+             (unsigned long) st.fileCacheHits, (unsigned long) st.fileCacheMisses);
+  #endif
+  reply (211, "End.");
+}
+
+// SITE RATE                 - show the limits of RETR and STOR
+// SITE RATE <kbytes/s>      - limit this session (0: no limit)
+// SITE RATE SERVER <kbytes/s> - limit all sessions together
+
+void FtpSession::siteRate (const char * args) {
+  while (* args == ' ') {
+    args ++;
+  }
+  if (* args == 0) {
+    reply (211, "Rate limits: session %lu, server %lu kbytes/s (0: none)",
+           (unsigned long) (rateLimit.rate () / 1000), (unsigned long) (server->rateLimit.rate () / 1000));
+    return;
+  }
+  boolean serverWide = !strncasecmp (args, "SERVER ", 7);
+  if (serverWide) {
+    args += 7;
+  }
+  char * end;
+  unsigned long rate = strtoul (args, &end, 10);
+  if (end == args || * end != 0 || rate > 0xFFFFFFFF / 1000) {
+    reply (501, "Can't interpret parameters");
+  }
+  else if (serverWide) {
+    server->setServerRate (rate * 1000);
+    reply (200, "Server rate limit set to %lu kbytes/s", rate);
+  }
+  else {
+    rateLimit.set (rate * 1000);
+    reply (200, "Session rate limit set to %lu kbytes/s", rate);
+  }
+}
+
+// Accept the client on the passive data port, without waiting for it
+//
+// return:
+//    true, if the data connection is open
+
+boolean FtpSession::dataConnect () {
+  if (!data.connected () && dataPortIndex >= 0 && server->dataServers[dataPortIndex]->hasClient ()) {
+    data.stop ();
+    data = server->dataServers[dataPortIndex]->available ();
+    #ifdef FTP_DEBUG
+    Serial.println ("-> client connected to dataserver");
+    #endif
+  }
+  return data.connected ();
+}
+
+// Give the passive port of this session back to the pool
+
+void FtpSession::releaseDataPort () {
+  if (dataPortIndex >= 0) {
+    server->releaseDataPort (dataPortIndex);
+    dataPortIndex = -1;
+  }
+}
+
+// Keep the current command pending until the client opens the data connection
+//
+//  handleFTP () then polls for the connection, and runs the command with
+//  dataConnected () or answers 425 after FTP_DATA_TIME_OUT seconds
+
+void FtpSession::waitDataConnection (FtpStorage &fs) {
+  strcpy (dataCommand, command);
+  millisEndData = millis () + (uint32_t)FTP_DATA_TIME_OUT * 1000;
+  transferStatus = 3;
+  boolean reused = data.connected ();   // kept open by the last MODE B transfer
+  if (dataConnect ()) {
+    dataConnected (fs, reused);
+  }
+}
+
+// Run the pending command, now that the data connection is open
+//
+// parameters:
+//   reused: true if the connection is the one kept open after the last
+//     transfer, not a new one
+
+void FtpSession::dataConnected (FtpStorage &fs, boolean reused) {
+  transferStatus = 0;
+  beginStats ();
+  if (!zBegin ()) {
+    reply (451, "Not enough memory for MODE Z");
+    closeFile ();
+    endStats (false);
+    data.stop ();
+    releaseDataPort ();
+    return;
+  }
+  if (!strcmp (dataCommand, "RETR")) {
+    if (reused) {
+      replyPart (150, "Using open data connection");
+    }
+    else {
+      replyPart (150, "Connected to port %u", dataPort);
+    }
+    if (file->size () == UINT32_MAX) {
+      reply (150, "Sending an archive of unknown size");
+    }
+    else {
+      reply (150, "%lu bytes to download", (unsigned long) (file->size () - file->position ()));
+    }
+    if (zs != NULL) {
+      openPrecompressed (fs);
+    }
+    bytesTransferred = 0;
+    iBuf = nBuf = 0;
+    blockBegin (true);
+    transferStatus = 1;
+    pipeBegin ();
+  }
+  else if (!strcmp (dataCommand, "STOR") || !strcmp (dataCommand, "APPE")) {
+    if (reused) {
+      reply (150, "Using open data connection");
+    }
+    else {
+      reply (150, "Connected to port %u", dataPort);
+    }
+    bytesTransferred = 0;
+    nBuf = 0;
+    fsWrites = 0;
+    blockBegin (false);
+    transferStatus = 2;
+    pipeBegin ();
+  }
+  else {
+    bytesTransferred = 0;
+    iBuf = nBuf = 0;
+    blockBegin (true);
+    listMatches = 0;
+    FtpListCacheEntry * cached = server->findListing (cwdName, dataCommand);
+    if (cached != NULL) {
+      #ifdef FTP_DEBUG
+      Serial.println ("-> listing of " + String (cwdName) + " sent from cache");
+      #endif
+      memcpy (buf, cached->data, cached->length);
+      nBuf = cached->length;
+      listMatches = cached->matches;
+      listEnd = true;
+    }
+    else if (openListing (fs)) {
+      // keep a copy of the listing, if it fits in the cache
+      listCache = server->claimListing ();
+      if (listCache != NULL) {
+        strcpy (listCache->path, cwdName);
+        strcpy (listCache->command, dataCommand);
+      }
+      listEnd = false;
+    }
+    else {
+      reply (550, "Can't open directory %s", cwdName);
+      zEnd ();
+      endStats (false);
+      data.stop ();
+      releaseDataPort ();
+      return;
+    }
+    reply (150, reused ? "Using open data connection" : "Accepted data connection");
+    transferStatus = 4;
+  }
+}
+
+// Open the current directory, to be listed by doListing ()
+//
+// return:
+//    false, if the directory can't be read
+
+boolean FtpSession::openListing (FtpStorage &fs) {
+  if (strcmp (cwdName, "/") && !pathExists (fs, cwdName)) {
+    return false;
+  }
+  file = fs.openDir (cwdName);
+  return file != NULL;
+}
+
+// Send a part of the listing of the current directory, in the format of dataCommand
+//
+//  Entries are read from the directory until a full TCP segment is
+//  ready in buf, and whole segments are sent as far as the socket takes
+//  them, so that a long listing doesn't hold up the other sessions.
+//
+// return:
+//    false, once the listing is sent
+
+boolean FtpSession::doListing () {
+  if (!data.connected ()) {
+    abortTransfer ();
+    return false;
+  }
+  if (iBuf == nBuf) {
+    iBuf = nBuf = 0;
+  }
+  else if (nBuf + FTP_FIL_SIZE + 64 > FTP_BUF_SIZE) {
+    memmove (buf, buf + iBuf, nBuf - iBuf);
+    nBuf -= iBuf;
+    iBuf = 0;
+  }
+
+  uint32_t t = micros ();
+  while (!listEnd && nBuf - iBuf < FTP_LIST_MSS && nBuf + FTP_FIL_SIZE + 64 <= FTP_BUF_SIZE) {
+    FtpPathInfo info;
+    const char * name = file->next (&info);
+    if (name != NULL) {
+      listEntry (name, info.size, info.mtime, info.isDir);
+    }
+    else {
+      closeFile ();
+      listEnd = true;
+    }
+  }
+  xfer.fsMicros += micros () - t;
+
+  // whole segments only, unless the listing is complete
+  uint16_t nw = listEnd ? nBuf - iBuf : (nBuf - iBuf) / FTP_LIST_MSS * FTP_LIST_MSS;
+  if (nw > 0 || zPending ()) {
+    t = micros ();
+    int32_t nb = dataSend (nw, UINT32_MAX, listEnd);
+    xfer.netMicros += micros () - t;
+    if (nb > 0) {
+      bytesTransferred += nb;
+    }
+    else {
+      xfer.stalls ++;                  // send buffer full
+    }
+  }
+  if (!listEnd || iBuf < nBuf || zPending () || !dataEnd ()) {
+    return true;
+  }
+
+  releaseListing (true);
+  zEnd ();
+  if (!strcmp (dataCommand, "MLSD")) {
+    replyPart (226, "options: -a -l");
+  }
+  reply (226, "%u matches total", listMatches);
+  xfer.bytes = bytesTransferred;
+  endStats (true);
+  dataRelease (true);
+  return false;
+}
+
+// Add one entry to the listing being sent, and copy it to the listing cache
+
+void FtpSession::listEntry (const char * name, uint32_t size, time_t mtime, boolean isDir) {
+  uint16_t len = formatEntry (buf + nBuf, dataCommand, name, size, mtime, isDir);
+  #ifdef FTP_DEBUG
+  Serial.write ((uint8_t *) buf + nBuf, len);
+  #endif
+  if (listCache != NULL) {
+    if (listCache->length + len > FTP_LIST_CACHE_SIZE) {
+      releaseListing (false);          // too long to be cached
+    }
+    else {
+      memcpy (listCache->data + listCache->length, buf + nBuf, len);
+      listCache->length += len;
+    }
+  }
+  nBuf += len;
+  listMatches ++;
+}
+
+// Give back the cache entry the listing was copied to
+//
+//  The listing is kept if asked, unless a change in the directory
+//  dropped the entry meanwhile (see FtpServer::invalidateCache ())
+
+void FtpSession::releaseListing (boolean keep) {
+  if (listCache == NULL) {
+    return;
+  }
+  if (keep && listCache->path[0] != 0) {
+    listCache->matches = listMatches;
+    listCache->millisStored = millis ();
+  }
+  else {
+    listCache->path[0] = 0;
+    listCache->length = 0;
+  }
+  listCache->claimed = false;
+  listCache = NULL;
+}
+
+// Write a number in decimal, right aligned on width characters
+//
+// return:
+//    pointer to the character following the number
+
+static char * putUint (char * p, uint32_t value, uint8_t width, char pad) {
+  char digits[10];
+  uint8_t n = 0;
+  do {
+    digits[n ++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (width > n) {
+    * p ++ = pad;
+    width --;
+  }
+  while (n > 0) {
+    * p ++ = digits[-- n];
+  }
+  return p;
+}
+
+// Split a time into year, month, day, hour, minute and second (UTC)
+//
+//  Same result as gmtime (), but without the static or heap allocated
+//  struct tm of the C library
+
+static void splitTime (time_t t, uint16_t * pyear, uint8_t * pmonth, uint8_t * pday,
+                       uint8_t * phour, uint8_t * pminute, uint8_t * psecond) {
+  if (t < 0) {
+    t = 0;
+  }
+  uint32_t days = t / 86400;
+  uint32_t secs = t % 86400;
+  * phour = secs / 3600;
+  * pminute = secs / 60 % 60;
+  * psecond = secs % 60;
+  // days to civil date, counted in 400 year eras from 0000-03-01
+  uint32_t z = days + 719468;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  * pday = doy - (153 * mp + 2) / 5 + 1;
+  * pmonth = mp < 10 ? mp + 3 : mp - 9;
+  * pyear = yoe + era * 400 + (* pmonth <= 2);
+}
+
+// Write one line of a directory listing
+//
+//  Never allocates memory: the number and date are converted in place.
+//
+// parameters:
+//   line: where to store the line, ending with CRLF. Must have room for
+//         FTP_FIL_SIZE + 64 characters
+//   format: LIST, MLSD or NLST
+//   name: name of the file; anything up to the last '/' is skipped
+//
+// return:
+//    length of the line
+
+uint16_t FtpSession::formatEntry (char * line, const char * format, const char * name,
+                                  uint32_t size, time_t mtime, boolean isDir) {
+  uint16_t year;
+  uint8_t  month, day, hour, minute, second;
+  char *   p = line;
+
+  const char * sep = strrchr (name, '/');
+  if (sep != NULL) {
+    name = sep + 1;
+  }
+  uint16_t len = strlen (name);
+  if (len > FTP_FIL_SIZE) {
+    len = FTP_FIL_SIZE;
+  }
+
+  if (!strcmp (format, "LIST")) {
+    // YYYY-MM-DD  HH:MM    <size or <DIR>>  name
+    splitTime (mtime, &year, &month, &day, &hour, &minute, &second);
+    p = putUint (p, year, 4, '0');
+    * p ++ = '-';
+    p = putUint (p, month, 2, '0');
+    * p ++ = '-';
+    p = putUint (p, day, 2, '0');
+    memcpy (p, "  ", 2);
+    p = putUint (p + 2, hour, 2, '0');
+    * p ++ = ':';
+    p = putUint (p, minute, 2, '0');
+    memcpy (p, "    ", 4);
+    p += 4;
+    if (isDir) {
+      memcpy (p, "<DIR>         ", 14);
+      p += 14;
+    }
+    else {
+      p = putUint (p, size, 14, ' ');
+    }
+    memcpy (p, "  ", 2);
+    p += 2;
+  }
+  else if (!strcmp (format, "MLSD")) {
+    // Type=file;Size=<size>;Modify=YYYYMMDDHHMMSS; name
+    splitTime (mtime, &year, &month, &day, &hour, &minute, &second);
+    if (isDir) {
+      memcpy (p, "Type=dir;", 9);
+      p += 9;
+    }
+    else {
+      memcpy (p, "Type=file;Size=", 15);
+      p = putUint (p + 15, size, 0, ' ');
+      * p ++ = ';';
+    }
+    memcpy (p, "Modify=", 7);
+    p = putUint (p + 7, year, 4, '0');
+    p = putUint (p, month, 2, '0');
+    p = putUint (p, day, 2, '0');
+    p = putUint (p, hour, 2, '0');
+    p = putUint (p, minute, 2, '0');
+    p = putUint (p, second, 2, '0');
+    memcpy (p, "; ", 2);
+    p += 2;
+  }
+  memcpy (p, name, len);
+  p += len;
+  * p ++ = '\r';
+  * p ++ = '\n';
+  return p - line;
+}
+
+// Swap the file of RETR, just opened, for its copy in the file cache,
+// reading it into the cache if it is not there yet
+
+void FtpSession::useFileCache (const char * path) {
+  #if FTP_FILE_CACHE
+  if (file->size () > FTP_FILE_CACHE_MAX_FILE) {
+    return;
+  }
+  FtpStorageFile * cached = server->fileCache.find (path, file->size (), file->lastWrite ());
+  if (cached != NULL) {
+    server->stats.fileCacheHits ++;
+  }
+  else {
+    server->stats.fileCacheMisses ++;
+    cached = server->fileCache.store (path, file);
+  }
+  if (cached != NULL) {
+    closeFile ();
+    file = cached;
+  }
+  #endif
+}
+
+// Send the next part of the file, without ever waiting for the socket
+//
+//  buf is refilled from the file only once all of it has been sent; what
+//  the socket can't take now is sent on a next call, from iBuf on
+//
+// return:
+//    false, when the transfer is over
+
+boolean FtpSession::doRetrieve () {
+  if (pipe != NULL) {
+    return pipeRetrieve ();
+  }
+  if (!data.connected ()) {
+    if (iBuf < nBuf || file->position () < file->size () || zPending ()) {
+      abortTransfer ();                // client went away before the end of the file
+    }
+    else {
+      closeTransfer ();
+    }
+    return false;
+  }
+  uint32_t spanLength;
+  const uint8_t * span;
+  if (zs == NULL && (span = file->borrow (&spanLength)) != NULL) {
+    return sendBorrowed (span, spanLength);
+  }
+  if (iBuf >= nBuf && (zs == NULL || zs->iOut == zs->nOut)) {
+    uint32_t t = micros ();
+    iBuf = 0;
+    if (zs == NULL) {
+      nBuf = file->read ((uint8_t *) buf, FTP_BUF_SIZE);
+    }
+    else if (!zs->passthrough) {
+      nBuf = file->read ((uint8_t *) buf, FTP_ZLIB_CHUNK);
+    }
+    else if (!zs->finished) {
+      nBuf = readPrecompressed ();
+      if (nBuf == 0) {
+        abortTransfer ();              // .gz file shorter than it was
+        return false;
+      }
+    }
+    else {
+      nBuf = 0;
+    }
+    xfer.fsMicros += micros () - t;
+    if (nBuf == 0 && !zPending ()) {
+      if (!dataEnd ()) {
+        return true;                   // send buffer full
+      }
+      closeTransfer ();
+      return false;
+    }
+  }
+  uint32_t length = rateAllowance (FTP_BUF_SIZE);
+  if (length == 0) {                   // over the rate limit: wait for tokens
+    return true;
+  }
+  uint32_t t = micros ();
+  int32_t nb = dataSend (nBuf - iBuf, length, nBuf == 0);
+  xfer.netMicros += micros () - t;
+  if (nb > 0) {
+    bytesTransferred += nb;
+    rateLimit.consume (nb);
+    server->rateLimit.consume (nb);
+  }
+  else {
+    xfer.stalls ++;                    // send buffer full
+  }
+  return true;
+}
+
+// Send the next part of the file straight from where the storage holds
+// it, lent by FtpStorageFile::borrow (): memory-resident files (in RAM,
+// in mapped flash, or mapped by mmap ()) go to the socket without
+// being copied into buf
+//
+// return:
+//    false, when the transfer is over
+
+boolean FtpSession::sendBorrowed (const uint8_t * span, uint32_t length) {
+  if (length == 0) {
+    if (!dataEnd ()) {
+      return true;                     // send buffer full
+    }
+    closeTransfer ();
+    return false;
+  }
+  length = rateAllowance (min (length, (uint32_t) FTP_QUANTUM_BYTES));
+  if (length == 0) {                   // over the rate limit: wait for tokens
+    return true;
+  }
+  uint32_t t = micros ();
+  int32_t nb = dataWrite (span, length);
+  xfer.netMicros += micros () - t;
+  if (nb > 0) {
+    file->release (nb);
+    bytesTransferred += nb;
+    rateLimit.consume (nb);
+    server->rateLimit.consume (nb);
+  }
+  else {
+    xfer.stalls ++;                    // send buffer full
+  }
+  return true;
+}
+
+// Bytes that RETR or STOR may move now, at most length, under the rate
+// limits of the session and of the server
+
+uint32_t FtpSession::rateAllowance (uint32_t length) {
+  return min (length, min (rateLimit.allowance (), server->rateLimit.allowance ()));
+}
+
+// Allocate the compressor (RETR, listings) or decompressor (STOR, APPE)
+// of a transfer in MODE Z, when its data connection opens
+//
+// return:
+//    false, if there is not enough memory
+
+boolean FtpSession::zBegin () {
+  #if FTP_MODE_Z
+  if (transferMode != 'Z') {
+    return true;
+  }
+  zs = (FtpZStream *) malloc (sizeof (FtpZStream));
+  if (zs == NULL) {
+    return false;
+  }
+  if (!strcmp (dataCommand, "STOR") || !strcmp (dataCommand, "APPE")) {
+    zs->inflate.begin ();
+  }
+  else {
+    zs->deflate.begin ();
+  }
+  zs->iOut = zs->nOut = 0;
+  zs->finished = false;
+  zs->passthrough = false;
+  #endif
+  return true;
+}
+
+void FtpSession::zEnd () {
+  if (zs != NULL) {
+    free (zs);
+    zs = NULL;
+  }
+  if (zPlain != NULL) {
+    delete zPlain;
+    zPlain = NULL;
+  }
+}
+
+// A transfer in MODE Z still has compressed bytes to make or send
+
+boolean FtpSession::zPending () {
+  return zs != NULL && (!zs->finished || zs->iOut < zs->nOut);
+}
+
+// Send the precompressed <file>.gz instead of compressing file, if it is
+// not older than file and holds the same number of bytes
+//
+//  The deflate data of the gzip file (RFC 1952) is sent as is, between a
+//  zlib header and the Adler-32 checksum of file. The gzip trailer only
+//  holds a CRC-32, so the first time, the checksum is computed by reading
+//  file along with the .gz file (see readPrecompressed ()); it is then
+//  kept in the digest cache, and the next times only the .gz file is read.
+//
+// return:
+//    true, if file is now the .gz file, and zPlain the original (NULL if
+//    its checksum was in the cache)
+
+boolean FtpSession::openPrecompressed (FtpStorage &fs) {
+  char gzName[FTP_CWD_SIZE];
+  if (strlen (pathName) + 3 >= FTP_CWD_SIZE) {
+    return false;
+  }
+  strcpy (gzName, pathName);
+  strcat (gzName, ".gz");
+  FtpPathInfo info;
+  if (!fs.stat (gzName, &info) || info.isDir || info.size < 18 || info.mtime < file->lastWrite ()) {
+    return false;
+  }
+  FtpStorageFile * gz = fs.open (gzName, "r");
+  uint32_t size = info.size;
+  uint8_t header[10];
+  if (gz == NULL || gz->read (header, 10) != 10
+      || header[0] != 0x1F || header[1] != 0x8B || header[2] != 8) {
+    delete gz;
+    return false;
+  }
+  // skip the optional fields of the header
+  uint8_t flags = header[3];
+  if (flags & 4) {                     // FEXTRA
+    gz->read (header, 2);
+    gz->seek (gz->position () + (header[0] | header[1] << 8));
+  }
+  for (uint8_t field = 8; field <= 16; field <<= 1) {
+    if (flags & field) {               // FNAME, FCOMMENT
+      while (gz->read (header, 1) == 1 && header[0] != 0) {
+      }
+    }
+  }
+  if (flags & 2) {                     // FHCRC
+    gz->seek (gz->position () + 2);
+  }
+  uint32_t start = gz->position ();
+  if (start + 8 >= size || !gz->seek (size - 4) || gz->read (header, 4) != 4
+      || (header[0] | header[1] << 8 | header[2] << 16 | (uint32_t) header[3] << 24) != file->size ()
+      || !gz->seek (start)) {
+    delete gz;
+    return false;
+  }
+  #ifdef FTP_DEBUG
+  Serial.println ("-> sending precompressed " + String (gzName));
+  #endif
+  zs->passthrough = true;
+  zs->size = zs->left = size - 8 - start;
+  zs->plainSize = file->size ();
+  zs->plainMtime = file->lastWrite ();
+  const FtpHashCacheEntry * cached = server->findHash (pathName, zs->plainSize, zs->plainMtime, FTP_HASH_ADLER32);
+  if (cached != NULL) {
+    zs->adler = (uint32_t) cached->digest[0] << 24 | cached->digest[1] << 16 | cached->digest[2] << 8 | cached->digest[3];
+    closeFile ();
+  }
+  else {
+    zs->adler = 1;
+    zPlain = file;
+  }
+  file = gz;
+  return true;
+}
+
+// Fill buf with the next part of a precompressed file, and go on with
+// the checksum of the original, as far as the compressed data read,
+// unless it came from the cache
+//
+// return:
+//    number of bytes in buf, 0 if the .gz file can't be read
+
+uint16_t FtpSession::readPrecompressed () {
+  uint16_t n = 0;
+  if (zs->left == zs->size) {
+    buf[n ++] = 0x78;                  // zlib header: deflate, 32K window
+    buf[n ++] = 0x01;
+  }
+  uint16_t nb = file->read ((uint8_t *) buf + n, min (zs->left, (uint32_t) (FTP_BUF_SIZE - 4 - n)));
+  if (nb == 0 && zs->left > 0) {
+    return 0;
+  }
+  n += nb;
+  zs->left -= nb;
+  if (zPlain != NULL) {
+    uint32_t until = zs->plainSize - (uint64_t) zs->left * zs->plainSize / zs->size;
+    while (zPlain->position () < until) {
+      uint16_t nr = zPlain->read (zs->out, min ((uint32_t) sizeof (zs->out), until - zPlain->position ()));
+      if (nr == 0) {
+        break;
+      }
+      zs->adler = ftpAdler32 (zs->adler, zs->out, nr);
+    }
+    if (zs->left == 0 && zPlain->position () == zs->plainSize) {
+      uint8_t digest[4];
+      for (uint8_t i = 0; i < 4; i ++) {
+        digest[i] = zs->adler >> (24 - 8 * i);
+      }
+      server->storeHash (pathName, zs->plainSize, zs->plainMtime, FTP_HASH_ADLER32, digest, 4);
+    }
+  }
+  if (zs->left == 0) {
+    for (int8_t shift = 24; shift >= 0; shift -= 8) {
+      buf[n ++] = zs->adler >> shift;
+    }
+    zs->finished = true;
+  }
+  return n;
+}
+
+// Decompress the bytes received in MODE Z into buf, writing buf to the
+// file as it fills; end tells that all compressed bytes were received
+//
+// return:
+//    false, if the file system didn't take all bytes
+
+boolean FtpSession::inflateReceived (boolean end) {
+  uint16_t n;
+  do {
+    n = zs->inflate.inflate ((uint8_t *) buf + nBuf, FTP_BUF_SIZE - nBuf, end);
+    nBuf += n;
+    if (nBuf == FTP_BUF_SIZE && !writeBuffer (false)) {
+      return false;
+    }
+  } while (n > 0);
+  return true;
+}
+
+// Send length bytes of buf, from iBuf on, at most limit bytes being
+// written to the data connection
+//
+//  In MODE Z, up to FTP_ZLIB_CHUNK bytes of buf are compressed into
+//  zs->out, that is sent before more are taken; last ends the compressed
+//  stream after the length bytes. iBuf is moved past the bytes taken.
+//
+// return:
+//    number of bytes written to the data connection, 0 if the send buffer is full
+
+int32_t FtpSession::dataSend (uint32_t length, uint32_t limit, boolean last) {
+  if (zs == NULL || zs->passthrough) {
+    int32_t nb = dataWrite ((uint8_t *) buf + iBuf, min (length, limit));
+    iBuf += nb;
+    return nb;
+  }
+  if (zs->iOut == zs->nOut && !zs->finished && (length > 0 || last)) {
+    uint16_t n = min (length, (uint32_t) FTP_ZLIB_CHUNK);
+    zs->finished = last && n == length;
+    zs->nOut = zs->deflate.compress ((uint8_t *) buf + iBuf, n, zs->out, zs->finished);
+    zs->iOut = 0;
+    iBuf += n;
+  }
+  int32_t nb = dataWrite (zs->out + zs->iOut, min ((uint32_t) (zs->nOut - zs->iOut), limit));
+  zs->iOut += nb;
+  return nb;
+}
+
+int32_t FtpSession::dataWrite (const uint8_t * data_buf, uint32_t length) {
+  if (transferMode != 'B') {
+    return socketWrite (data_buf, length);
+  }
+  // In MODE B, each write of file data opens a block of at most 64 KB,
+  // whose header goes first; later writes fill the block up
+  if (blockLeft == 0) {
+    if (length == 0) {
+      return 0;
+    }
+    blockLeft = min (length, (uint32_t) 0xFFFF);
+    blockHeader[0] = 0;
+    blockHeader[1] = blockLeft >> 8;
+    blockHeader[2] = blockLeft & 0xFF;
+    nBlockHeader = 0;
+  }
+  if (nBlockHeader < 3) {
+    nBlockHeader += socketWrite (blockHeader + nBlockHeader, 3 - nBlockHeader);
+    if (nBlockHeader < 3) {
+      return 0;
+    }
+  }
+  int32_t nb = socketWrite (data_buf, min (length, (uint32_t) blockLeft));
+  blockLeft -= nb;
+  return nb;
+}
+
+// Write to the data connection as much as the socket takes right now
+//
+// return:
+//    number of bytes written, 0 if the send buffer is full
+
+int32_t FtpSession::socketWrite (const uint8_t * data_buf, uint32_t length) {
+  #ifdef ESP8266
+  uint32_t room = data.availableForWrite ();
+  if (length > room) {
+    length = room;
+  }
+  return length > 0 ? data.write (data_buf, length) : 0;
+  #endif
+  #ifdef ESP32
+  // WiFiClient::write () retries until all is sent, so talk to the socket directly
+  int nb = send (data.fd (), data_buf, length, MSG_DONTWAIT);
+  return nb > 0 ? nb : 0;
+  #endif
+}
+
+// Mark the end of the file sent by RETR or a listing, all its data
+// being written: in MODE B, with an empty block of descriptor EOF (64)
+//
+// return:
+//    true, once the end is sent; false, if the send buffer is full
+
+boolean FtpSession::dataEnd () {
+  if (transferMode != 'B') {
+    return true;
+  }
+  if (!blockEof) {
+    blockHeader[0] = 64;
+    blockHeader[1] = blockHeader[2] = 0;
+    nBlockHeader = 0;
+    blockEof = true;
+  }
+  nBlockHeader += socketWrite (blockHeader + nBlockHeader, 3 - nBlockHeader);
+  return nBlockHeader == 3;
+}
+
+// Bytes of file data that STOR can read from the data connection now
+//
+//  In MODE B, the headers of the blocks are taken out of the data on the
+//  way, at most blockLeft bytes are left to read, and restart markers
+//  (blocks of descriptor 16) are dropped.
+
+int FtpSession::dataAvailable () {
+  int navail = data.available ();
+  if (transferMode != 'B') {
+    return navail;
+  }
+  while (navail > 0 && (blockLeft == 0 || blockHeader[0] & 16) && !(blockLeft == 0 && blockEof)) {
+    int nb;
+    if (blockLeft == 0) {
+      nb = data.read (blockHeader + nBlockHeader, min (navail, 3 - nBlockHeader));
+      if (nb > 0 && (nBlockHeader += nb) == 3) {
+        blockLeft = blockHeader[1] << 8 | blockHeader[2];
+        blockEof = blockHeader[0] & 64;
+        nBlockHeader = 0;
+      }
+    }
+    else {
+      uint8_t marker[16];
+      nb = data.read (marker, min (navail, (int) min (blockLeft, (uint16_t) sizeof (marker))));
+      blockLeft -= nb > 0 ? nb : 0;
+    }
+    if (nb <= 0) {
+      return 0;
+    }
+    navail -= nb;
+  }
+  return min (navail, (int) blockLeft);
+}
+
+// Read bytes counted by dataAvailable ()
+//
+// return:
+//    number of bytes read
+
+int FtpSession::dataRead (uint8_t * dest, int length) {
+  int nb = data.read (dest, length);
+  if (transferMode == 'B' && nb > 0) {
+    blockLeft -= nb;
+  }
+  return nb;
+}
+
+// return:
+//    true, once all the file sent to STOR is read: in MODE B, up to the
+//    end of the block of descriptor EOF, else up to the close of the
+//    data connection
+
+boolean FtpSession::dataEnded () {
+  if (transferMode == 'B' && blockEof && blockLeft == 0) {
+    return true;
+  }
+  return !data.connected () && data.available () <= 0;
+}
+
+// Reset the block framing of MODE B, as a transfer begins
+//
+//  Headers are written apart from the data, and the EOF block comes
+//  last: Nagle's algorithm would hold each of them until the client
+//  acknowledges what went before, so it is off for the transfer.
+
+void FtpSession::blockBegin (boolean send) {
+  if (transferMode == 'B') {
+    data.setNoDelay (true);
+  }
+  blockLeft = 0;
+  blockEof = false;
+  nBlockHeader = send ? 3 : 0;
+}
+
+// Done with the data connection, at the end of a transfer
+//
+//  In MODE B, where the ends of files are marked by blocks, a transfer
+//  that completed keeps it open for the next transfers; the client opens
+//  a new one only after PASV, so that mirroring many files takes one.
+
+void FtpSession::dataRelease (boolean keep) {
+  if (!keep || transferMode != 'B' || !data.connected ()) {
+    data.stop ();
+    #ifdef FTP_DEBUG
+    Serial.println ("-> client disconnected from dataserver");
+    #endif
   }
-  
-  //
-  //  RETR - Retrieve
-  //
-  else if (!strcmp (command, "RETR")) {
-    char path[FTP_CWD_SIZE];
-    if (strlen (parameters) == 0) {
-      client.println ("501 No file name");
-    }
-    else if (makePath (path)) {
-      file = fs.open (path, "r");
-      if (!file) {
-        client.println ("550 File " + String (parameters) + " not found");
-      }
-      else if (!file) {
-        client.println ("450 Can't open " + String (parameters));
-      }
-      else if (!dataConnect ()) {
-        client.println ("425 No data connection");
-      }
-      else {
-        #ifdef FTP_DEBUG
-        Serial.println ("-> sending " + String (parameters));
-        #endif
-        client.println ("150-Connected to port " + String (dataPort));
-        client.println ("150 " + String (file.size ()) + " bytes to download");
-        millisBeginTrans = millis ();
-        bytesTransferred = 0;
-        transferStatus = 1;
-      }
-    }
+  releaseDataPort ();
+}
+
+boolean FtpSession::doStore () {
+  if (pipe != NULL) {
+    return pipeStore ();
   }
-  
-  //
-  //  STOR - Store
-  //
-  else if (!strcmp (command, "STOR")) {
-    char path[FTP_CWD_SIZE];
-    if (strlen (parameters) == 0) {
-      client.println ("501 No file name");
-    }
-    else if (makePath (path)) {
-	  file = fs.open (path, "w");
-      if (!file) {
-        client.println ("451 Can't open/create " + String (parameters));
-      }
-      else if (!dataConnect ()) {
-        client.println ("425 No data connection");
-        file.close ();
+  // Avoid blocking by never reading more bytes than are available
+  int navail = dataAvailable ();
+  // In MODE Z, received bytes go to the decompressor, that fills buf
+  uint16_t room = FTP_BUF_SIZE - nBuf;
+  uint8_t * dest = (uint8_t *) buf + nBuf;
+  if (zs != NULL) {
+    dest = zs->inflate.inputBuffer (&room);
+  }
+  // And be sure not to overflow the buffer, nor the rate limits
+  int nread = rateAllowance (min (navail > 0 ? navail : 0, (int) room));
+  if (nread > 0) {
+    uint32_t t = micros ();
+    int16_t nb = dataRead (dest, nread);
+    xfer.netMicros += micros () - t;
+    if (nb > 0) {
+      if (zs != NULL) {
+        zs->inflate.inputAdded (nb);
       }
       else {
-        #ifdef FTP_DEBUG
-        Serial.println ("-> receiving " + String (parameters));
-        #endif
-        client.println ("150 Connected to port " + String (dataPort));
-        millisBeginTrans = millis ();
-        bytesTransferred = 0;
-        transferStatus = 2;
+        nBuf += nb;
       }
+      bytesTransferred += nb;
+      rateLimit.consume (nb);
+      server->rateLimit.consume (nb);
     }
-  }
-  
-  //
-  //  MKD - Make Directory
-  //
-  
-  else if (!strcmp (command, "MKD")) {
-    char path[FTP_CWD_SIZE];
-    if (haveParameter () && makePath (path)) {
-      if (fs.exists (path)) {
-        client.println ("521 Can't create \"" + String (parameters) + "\", Directory exists");
-      }
-      else {
-        if (fs.mkdir (path)) {
-          client.println ("257 \"" + String (parameters) + "\" created");
-        }
-        else {
-          client.println ("550 Can't create \"" + String (parameters) + "\"");
-        }
-      }  
+    // Write to the file system only when the staging buffer is full
+    if (nBuf == FTP_BUF_SIZE && !writeBuffer (false)) {
+      abortTransfer ();
+      return false;
     }
   }
-  
-  //
-  //  RMD - Remove a Directory 
-  //
-  else if (!strcmp (command, "RMD")) {
-    char path[FTP_CWD_SIZE];
-    if (haveParameter () && makePath (path)) {
-      if (fs.rmdir (path)) {
-        #ifdef FTP_DEBUG
-        Serial.println ("-> deleting " + String (parameters));
-        #endif
-        client.println ("250 \"" + String (parameters) + "\" deleted");
-      }
-      else {
-      	if (fs.exists (path)) { // hack
-          client.println ("550 Can't remove \"" + String (parameters) + "\". Directory not empty?");  
-        }
-        else {
-          #ifdef FTP_DEBUG
-          Serial.println ("-> deleting " + String (parameters));
-          #endif
-          client.println ("250 \"" + String (parameters) + "\" deleted");
-        }
-      }
+  if (zs != NULL) {
+    boolean end = dataEnded ();
+    if (!inflateReceived (end)) {
+      abortTransfer ();
+      return false;
     }
-  }
-  
-  //
-  //  RNFR - Rename From 
-  //
-  else if (!strcmp (command, "RNFR")) {
-    buf[0] = 0;
-    if (strlen (parameters) == 0) {
-      client.println ("501 No file name");
-    }
-    else if (makePath (buf)) {
-      if (!fs.exists (buf)) {
-        client.println ("550 File " + String (parameters) + " not found");
-      }
-      else {
-        #ifdef FTP_DEBUG
-        Serial.println ("-> renaming " + String (buf));
-        #endif
-        client.println ("350 RNFR accepted - file exists, ready for destination");     
-        rnfrCmd = true;
-      }
+    if (end || zs->inflate.status () != FtpInflate::RUNNING) {
+      closeTransfer ();                // complete, or corrupt
+      return false;
     }
   }
-  
-  //
-  //  RNTO - Rename To 
-  //
-  else if (!strcmp (command, "RNTO")) {  
-    char path[FTP_CWD_SIZE];
-    char dir[FTP_FIL_SIZE];
-    if (strlen (buf ) == 0 || ! rnfrCmd) {
-      client.println ("503 Need RNFR before RNTO");
-    }
-    else if (strlen (parameters ) == 0) {
-      client.println ("501 No file name");
-    }
-    else if (makePath (path)) {
-      if (fs.exists (path)) {
-        client.println ("553 " + String (parameters) + " already exists");
-      }
-      else {          
-        #ifdef FTP_DEBUG
-        Serial.println ("-> renaming " + String (buf) + " to " + String (path));
-        #endif
-        if (fs.rename (buf, path)) {
-          client.println ("250 File successfully renamed or moved");
-        }
-        else {
-          client.println ("451 Rename/move failure");
-        }
-      }
+  if (dataEnded ()) {
+    closeTransfer();
+    return false;
+  }
+  else {
+    if (navail <= 0) {
+      xfer.stalls ++;                  // nothing received yet
     }
-    rnfrCmd = false;
+    return true;
   }
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //   EXTENSIONS COMMANDS (RFC 3659)  //
-  //                                   //
-  ///////////////////////////////////////
+// Hand the bytes staged in buf during STOR to the file system
+//
+//  Unless all is asked (end of transfer), only whole blocks of
+//  FTP_WRITE_BLOCK_SIZE bytes, aligned on their offset in the file, are
+//  written; the remaining bytes are moved to the start of buf
+//
+// return:
+//    false, if the file system didn't take all bytes
 
-  //
-  //  FEAT - New Features
-  //
-  else if (!strcmp (command, "FEAT")) {
-    client.println ("211-Extensions supported:");
-    client.println (" MLSD");
-    client.println ("211 End.");
+boolean FtpSession::writeBuffer (boolean all) {
+  uint32_t nw = nBuf;
+  if (!all) {
+    nw = (storeOffset + nBuf) / FTP_WRITE_BLOCK_SIZE * FTP_WRITE_BLOCK_SIZE - storeOffset;
   }
-  
-  //
-  //  MDTM - File Modification Time (see RFC 3659)
-  //
-  else if (!strcmp (command, "MDTM")) {
-    client.println ("550 Unable to retrieve time");
-  }
-
-  //
-  //  SIZE - Size of the file
-  //
-  else if (!strcmp (command, "SIZE")) {
-    char path[FTP_CWD_SIZE];
-    if (strlen (parameters) == 0) {
-      client.println ("501 No file name");
-    }
-    else if (makePath (path)) {
-      file = fs.open (path, "r");
-      if (!file) {
-        client.println ("450 Can't open " + String (parameters));
-      }
-      else {
-        client.println ("213 " + String (file.size ()));
-        file.close ();
-      }
-    }
+  if (nw == 0) {
+    return true;
   }
-  
-  //
-  //  SITE - System command
-  //
-  else if (!strcmp (command, "SITE")) {
-    client.println ("500 Unknown SITE command " + String (parameters));
+  uint32_t t = micros ();
+  uint32_t written = file->write ((uint8_t *) buf, nw);
+  xfer.fsMicros += micros () - t;
+  fsWrites ++;
+  storeOffset += written;
+  memmove (buf, buf + nw, nBuf - nw);
+  nBuf -= nw;
+  return written == nw;
+}
+
+// Hand the file of RETR or STOR to the file system task, that reads or
+// writes it while handleFTP () moves the data through the ring of a pipe
+//
+//  MODE Z transfers keep to buf, as do all if FTP_FS_TASK is 0; the
+//  files the storage lends in place are sent from there (see sendBorrowed ())
+//
+// return:
+//    false, if the transfer runs without the task
+
+boolean FtpSession::pipeBegin () {
+  #if FTP_FS_TASK
+  uint32_t length;
+  if (zs != NULL || (transferStatus == 1 && file->borrow (&length) != NULL)) {
+    return false;
   }
-  
-  //
-  //  Unrecognized commands ...
-  //
-  else {
-    client.println ("500 Unknown command");
+  FtpFsPipe * p = new (std::nothrow) FtpFsPipe;
+  if (p == NULL) {
+    return false;
+  }
+  p->store = transferStatus == 2;
+  p->ring.begin (p->data, FTP_FS_RING_SIZE, p->store ? storeOffset : 0);
+  p->ended = false;
+  p->failed = false;
+  p->fsMicros = 0;
+  p->fsWrites = 0;
+  {
+    std::lock_guard<std::mutex> guard (server->fsTask->sessionLock[this - server->sessions]);
+    pipe = p;
+  }
+  server->wakeFsTask ();
+  return true;
+  #else
+  return false;
+  #endif
+}
+
+// Take the file back from the file system task
+//
+//  The bytes of a STOR still in the ring are written, so that an aborted
+//  upload can be resumed
+//
+// return:
+//    false, if the file system didn't take all bytes
+
+boolean FtpSession::pipeEnd () {
+  #if FTP_FS_TASK
+  if (pipe == NULL) {
+    return true;
+  }
+  FtpFsPipe * p = pipe;
+  {                                    // wait for the task to be done with it
+    std::lock_guard<std::mutex> guard (server->fsTask->sessionLock[this - server->sessions]);
+    pipe = NULL;
   }
+  boolean written = !p->failed;
+  if (p->store) {
+    uint32_t t = micros ();
+    uint32_t length;
+    uint8_t * span = p->ring.readSpan (&length);
+    while (written && length > 0) {
+      written = file->write (span, length) == length;
+      p->fsWrites ++;
+      p->ring.consume (length);
+      span = p->ring.readSpan (&length);
+    }
+    p->fsMicros += micros () - t;
+    fsWrites += p->fsWrites;
+  }
+  xfer.fsMicros += p->fsMicros;
+  delete p;
+  return written;
+  #else
   return true;
+  #endif
+}
+
+// return:
+//    true, if the transfer waits for the file system task: to read the
+//    file (RETR), or to write the ring when it is full or the upload
+//    is over (STOR)
+
+boolean FtpSession::pipeWaiting () {
+  if (pipe == NULL) {
+    return false;
+  }
+  uint32_t count = pipe->ring.count ();
+  if (pipe->store) {
+    return pipe->ended || count == FTP_FS_RING_SIZE;
+  }
+  return count == 0 && !pipe->ended;
 }
 
-boolean FtpServer::dataConnect () {
-  unsigned long startTime = millis ();
-  //wait 5 seconds for a data connection
+// Send the next part of the file, from the ring filled by the file system task
+//
+// return:
+//    false, when the transfer is over
+
+boolean FtpSession::pipeRetrieve () {
+  boolean ended = pipe->ended;         // before the ring, that then holds the end of the file
+  uint32_t length;
+  uint8_t * span = pipe->ring.readSpan (&length);
   if (!data.connected ()) {
-    while (!dataServer.hasClient () && millis () - startTime < 10000) {
-      yield ();
+    if (length > 0 || !ended) {
+      abortTransfer ();                // client went away before the end of the file
     }
-    if (dataServer.hasClient ()) {
-      data.stop ();
-      #ifdef FTP_DEBUG
-      Serial.println ("-> client disconnected from dataserver");
-      #endif
-      data = dataServer.available ();
-      #ifdef FTP_DEBUG
-      Serial.println ("-> client connected to dataserver");
-      #endif
+    else {
+      closeTransfer ();
+    }
+    return false;
+  }
+  if (length == 0) {
+    if (ended && dataEnd ()) {
+      closeTransfer ();
+      return false;
     }
+    return true;                       // the task is reading the file, or the send buffer is full
   }
-  return data.connected ();
+  length = rateAllowance (length);
+  if (length == 0) {                   // over the rate limit: wait for tokens
+    return true;
+  }
+  uint32_t t = micros ();
+  int32_t nb = dataWrite (span, length);
+  xfer.netMicros += micros () - t;
+  if (nb > 0) {
+    pipe->ring.consume (nb);
+    server->wakeFsTask ();
+    bytesTransferred += nb;
+    rateLimit.consume (nb);
+    server->rateLimit.consume (nb);
+  }
+  else {
+    xfer.stalls ++;                    // send buffer full
+  }
+  return true;
 }
 
-boolean FtpServer::doRetrieve () {
-  if (data.connected ()) {
-    int16_t nb = file.readBytes (buf, FTP_BUF_SIZE);
-    if (nb > 0) {
-      data.write ((uint8_t*)buf, nb);
-      bytesTransferred += nb;
-      return true;
+// Receive the next part of the file into the ring, written by the file system task
+//
+// return:
+//    false, when the transfer is over
+
+boolean FtpSession::pipeStore () {
+  if (pipe->failed) {
+    closeTransfer ();
+    return false;
+  }
+  if (!pipe->ended) {
+    int navail = dataAvailable ();
+    uint32_t room;
+    uint8_t * span = pipe->ring.writeSpan (&room);
+    int nread = rateAllowance (min (navail > 0 ? (uint32_t) navail : 0, room));
+    if (nread > 0) {
+      uint32_t t = micros ();
+      int nb = dataRead (span, nread);
+      xfer.netMicros += micros () - t;
+      if (nb > 0) {
+        pipe->ring.commit (nb);
+        server->wakeFsTask ();
+        bytesTransferred += nb;
+        rateLimit.consume (nb);
+        server->rateLimit.consume (nb);
+      }
+    }
+    if (dataEnded ()) {
+      pipe->ended = true;              // the task writes the end of the file
+      server->wakeFsTask ();
+    }
+    else if (navail <= 0) {
+      xfer.stalls ++;                  // nothing received yet
     }
   }
-  closeTransfer ();
-  return false;
+  if (pipe->ended && pipe->ring.count () == 0) {
+    closeTransfer ();
+    return false;
+  }
+  return true;
 }
 
-boolean FtpServer::doStore () {
-  // Avoid blocking by never reading more bytes than are available
-  int navail = data.available();
-  if (navail > 0) {
-    // And be sure not to overflow the buffer
-    if (navail > FTP_BUF_SIZE) {
-      navail = FTP_BUF_SIZE;
+#if FTP_FS_TASK
+// The part of the work of the file system task for this session: read
+// the file into the ring, or write whole blocks of the ring to the file
+// (all that is left, at the end of the upload). Runs in the task, with
+// the lock of the session held.
+//
+// return:
+//    false, if there was nothing to do
+
+boolean FtpSession::fsWork () {
+  FtpFsPipe * p = pipe;
+  if (p == NULL || p->failed) {
+    return false;
+  }
+  uint32_t length;
+  if (!p->store) {
+    if (p->ended) {
+      return false;
     }
-    int16_t nb = data.read((uint8_t *)buf, navail);
-    if (nb > 0) {
-      file.write((uint8_t *)buf, nb);
-      bytesTransferred += nb;
+    uint8_t * span = p->ring.writeSpan (&length);
+    if (length == 0) {
+      return false;
     }
+    uint32_t t = micros ();
+    int32_t n = file->read (span, min (length, (uint32_t) FTP_BUF_SIZE));
+    p->fsMicros += micros () - t;
+    if (n > 0) {
+      p->ring.commit (n);
+    }
+    else {
+      p->ended = true;
+    }
+    return true;
   }
-  if (!data.connected() && (navail <= 0)) {
-    closeTransfer();
+  boolean ended = p->ended;            // before the ring, that then holds the whole upload
+  uint32_t position;
+  uint8_t * span = p->ring.readSpan (&length, &position);
+  if (!ended) {                        // whole blocks, aligned on their offset in the file
+    uint32_t inBlock = position & (FTP_WRITE_BLOCK_SIZE - 1);
+    length = inBlock + length < FTP_WRITE_BLOCK_SIZE ? 0 : ((inBlock + length) & ~(FTP_WRITE_BLOCK_SIZE - 1)) - inBlock;
+  }
+  if (length == 0) {
     return false;
   }
-  else {
-    return true;
+  uint32_t t = micros ();
+  uint32_t written = file->write (span, length);
+  p->fsMicros += micros () - t;
+  p->fsWrites ++;
+  p->ring.consume (written);
+  if (written != length) {
+    p->failed = true;
   }
+  return true;
+}
+#endif
+
+// Close the file being transferred, hashed or listed
+
+void FtpSession::closeFile () {
+  delete file;
+  file = NULL;
 }
 
-void FtpServer::closeTransfer () {
+void FtpSession::closeTransfer () {
   uint32_t deltaT = (int32_t) (millis () - millisBeginTrans);
-  if (deltaT > 0 && bytesTransferred > 0) {
-    client.println ("226-File successfully transferred");
-    client.println ("226 " + String (deltaT) + " ms, " + String (bytesTransferred / deltaT) + " kbytes/s");
+  boolean completed = true;
+  if (transferStatus == 2 && (!pipeEnd () || !writeBuffer (true))) {
+    if (file->error () != NULL) {      // the storage knows why, as FtpTarWriter does
+      reply (451, "%s", file->error ());
+    }
+    else {
+      reply (451, "Can't write to file, file system full?");
+    }
+    completed = false;
+  }
+  else if (transferStatus == 2 && zs != NULL && zs->inflate.status () != FtpInflate::DONE) {
+    if (zs->inflate.status () == FtpInflate::TOO_FAR) {
+      reply (451, "Compressed data needs a window over %u bytes", FTP_INFLATE_WINDOW);
+    }
+    else {
+      reply (451, "Compressed data is corrupt or incomplete");
+    }
+    completed = false;
+  }
+  else if (deltaT > 0 && bytesTransferred > 0) {
+    replyPart (226, "File successfully transferred");
+    if (transferStatus == 2) {
+      replyPart (226, "%lu writes to file system", (unsigned long) fsWrites);
+    }
+    reply (226, "%lu ms, %lu kbytes/s", (unsigned long) deltaT, (unsigned long) (bytesTransferred / deltaT));
   }
   else {
-    client.println ("226 File successfully transferred");
+    reply (226, "File successfully transferred");
   }
-  file.close ();
-  data.stop ();
+  pipeEnd ();
+  closeFile ();
+  zEnd ();
+  if (transferStatus == 2) {
+    server->invalidateCache (pathName);
+  }
+  xfer.bytes = bytesTransferred;
+  endStats (completed);
+  dataRelease (completed);
   #ifdef FTP_DEBUG
   Serial.println ("-> file successfully transferred");
-  Serial.println ("-> client disconnected from dataserver");
+  if (transferStatus == 2) {
+    Serial.println ("-> " + String (bytesTransferred) + " bytes stored in " + String (fsWrites) + " writes");
+  }
   #endif
 }
 
-void FtpServer::abortTransfer () {
-  if (transferStatus > 0) {
-    file.close ();
+void FtpSession::abortTransfer () {
+  if (transferStatus == 5) {           // hashing: no data connection
+    closeFile ();
+    reply (426, "%s aborted", dataCommand);
+  }
+  else if (transferStatus > 0) {
+    pipeEnd ();
+    const char * error = NULL;
+    if (transferStatus == 2) {
+      writeBuffer (true);              // keep what was received, so that the upload can be resumed
+      error = file->error ();
+    }
+    closeFile ();
+    zEnd ();
+    if (transferStatus == 2) {
+      server->invalidateCache (pathName);
+    }
+    if (transferStatus == 4) {
+      releaseListing (false);
+    }
+    if (transferStatus != 3) {         // the transfer had begun
+      xfer.bytes = bytesTransferred;
+      endStats (false);
+    }
     data.stop (); 
+    releaseDataPort ();
     #ifdef FTP_DEBUG
     Serial.println ("-> client disconnected from dataserver");
     #endif
-    client.println ("426 Transfer aborted");
+    if (error != NULL) {
+      reply (451, "%s", error);
+    }
+    else {
+      reply (426, "Transfer aborted");
+    }
     #ifdef FTP_DEBUG
     Serial.println ("-> transfer aborted");
     #endif
@@ -903,81 +3205,185 @@ void FtpServer::abortTransfer () {
   transferStatus = 0;
 }
 
-// Read a char from client connected to ftp server
+// Start the counters of a transfer, when its data connection is open
+
+void FtpSession::beginStats () {
+  memset (&xfer, 0, sizeof (xfer));
+  strcpy (xfer.command, dataCommand);
+  millisBeginTrans = millis ();
+}
+
+// Hand the counters of the transfer to the server
+
+void FtpSession::endStats (boolean completed) {
+  xfer.completed = completed;
+  xfer.millis = millis () - millisBeginTrans;
+  server->recordTransfer (xfer);
+}
+
+// Build a reply to the client, without heap allocation
+//
+//  replyPart () adds a "code-text" line of a multi-line reply (or a line of
+//  text alone if code is 0), reply () adds the last "code text" line and
+//  sends the whole reply in a single write, that is in one TCP segment.
+//  Text beyond FTP_REPLY_SIZE is cut.
+
+void FtpSession::reply (uint16_t code, const char * format, ...) {
+  va_list args;
+  va_start (args, format);
+  replyLine (code, ' ', format, args);
+  va_end (args);
+  client.write ((const uint8_t *) replyBuf, nReply);
+  nReply = 0;
+}
+
+void FtpSession::replyPart (uint16_t code, const char * format, ...) {
+  va_list args;
+  va_start (args, format);
+  replyLine (code, '-', format, args);
+  va_end (args);
+}
+
+void FtpSession::replyLine (uint16_t code, char sep, const char * format, va_list args) {
+  if (FTP_REPLY_SIZE - nReply < 8) { // no room for a line: send the first ones
+    client.write ((const uint8_t *) replyBuf, nReply);
+    nReply = 0;
+  }
+  char * line = replyBuf + nReply;
+  uint16_t room = FTP_REPLY_SIZE - nReply;
+  uint16_t n = 0;
+  if (code > 0) {
+    line[0] = '0' + code / 100 % 10;
+    line[1] = '0' + code / 10 % 10;
+    line[2] = '0' + code % 10;
+    line[3] = sep;
+    n = 4;
+  }
+  // vsnprintf () ends the text with a 0, overwritten by CR LF
+  int len = vsnprintf (line + n, room - n - 1, format, args);
+  if (len > 0) {
+    n += min (len, room - n - 2);
+  }
+  line[n ++] = '\r';
+  line[n ++] = '\n';
+  nReply += n;
+}
+
+// Read a command line from client connected to ftp server
+//
+//  All the chars available on the control connection are read at once
+//  into cmdLine, so a client may send several commands without waiting
+//  for the replies. The first complete line is parsed in place, the
+//  following ones stay in cmdLine for the next calls.
 //
-//  update cmdLine and command buffers, iCL and parameters pointers
+//  update cmdLine and command buffers, iCL, nCL and parameters pointers
 //
 //  return:
-//    -2 if buffer cmdLine is full
-//    -1 if line not completed
+//    -2 if syntax error or line too long (500 is sent to client)
+//    -1 if no line completed
 //     0 if empty line received
 //    length of cmdLine (positive) if no empty line received 
 
-int8_t FtpServer::readChar () {
-  int8_t rc = -1;
+int16_t FtpSession::readCommand () {
+  if (nCL > 0) {                     // drop the line processed on previous call
+    iCL -= nCL;
+    memmove (cmdLine, cmdLine + nCL, iCL);
+    nCL = 0;
+  }
+  int avail = client.available ();
+  if (avail > 0 && iCL < FTP_CMD_SIZE) {
+    int n = client.read ((uint8_t *) cmdLine + iCL, min (avail, FTP_CMD_SIZE - iCL));
+    if (n > 0) {
+      iCL += n;
+    }
+  }
 
-  if (client.available ()) {
-    char c = client.read ();
-    #ifdef FTP_DEBUG
-    Serial.print (c);
-    #endif
-    if (c == '\\') {
-      c = '/';
+  char * eol = (char *) memchr (cmdLine, '\n', iCL);
+  if (eol == NULL) {
+    if (iCL < FTP_CMD_SIZE) {
+      return -1;
     }
-    if (c != '\r' ) {
-      if (c != '\n' ) {
-        if (iCL < FTP_CMD_SIZE) {
-          cmdLine[iCL ++] = c;
-        }
-        else {
-          rc = -2; //  Line too long
-        }
+    // Line too long: answer once, then drop chars up to its end
+    iCL = 0;
+    if (!skipLine) {
+      skipLine = true;
+      reply (500, "Syntax error");
+      return -2;
+    }
+    return -1;
+  }
+  nCL = eol - cmdLine + 1;
+  if (skipLine) {                    // end of a line too long
+    skipLine = false;
+    return readCommand ();
+  }
+
+  // terminate the line, without '\r', and with '/' as separator
+  uint16_t len = 0;
+  for (char * p = cmdLine; p < eol; p ++) {
+    if (*p == '\\') {
+      cmdLine[len ++] = '/';
+    }
+    else if (*p != '\r') {
+      cmdLine[len ++] = *p;
+    }
+  }
+  cmdLine[len] = 0;
+  #ifdef FTP_DEBUG
+  Serial.println (cmdLine);
+  #endif
+
+  int16_t rc;
+  command[0] = 0;
+  parameters = NULL;
+  // empty line?
+  if (len == 0) {
+    rc = 0;
+  }
+  else {
+    rc = len;
+    // search for space between command and parameters
+    parameters = strchr (cmdLine, ' ');
+    if (parameters != NULL) {
+      if (parameters - cmdLine > 4) {
+        rc = -2; // Syntax error
       }
       else {
-        cmdLine[iCL] = 0;
-        command[0] = 0;
-        parameters = NULL;
-        // empty line?
-        if (iCL == 0) {
-          rc = 0;
-        }
-        else {
-          rc = iCL;
-          // search for space between command and parameters
-          parameters = strchr (cmdLine, ' ');
-          if (parameters != NULL) {
-            if (parameters - cmdLine > 4) {
-              rc = -2; // Syntax error
-            }
-            else {
-              strncpy (command, cmdLine, parameters - cmdLine);
-              command[parameters - cmdLine] = 0;
-              
-              while (* (++ parameters) == ' ') {
-                ;
-              }
-            }
-          }
-          else if (strlen (cmdLine) > 4) {
-            rc = -2; // Syntax error.
-          }
-          else {
-            strcpy (command, cmdLine);
-          }
-          iCL = 0;
+        memcpy (command, cmdLine, parameters - cmdLine);
+        command[parameters - cmdLine] = 0;
+        
+        while (* (++ parameters) == ' ') {
+          ;
         }
       }
     }
-    if (rc > 0) {
-      for (uint8_t i = 0; i < strlen (command); i ++) {
-        command[i] = toupper (command[i]);
-      }
+    else if (len > 4) {
+      rc = -2; // Syntax error.
     }
-    if (rc == -2) {
-      iCL = 0;
-      client.println ("500 Syntax error");
+    else {
+      strcpy (command, cmdLine);
+      parameters = cmdLine + len;  // no parameters: point to the terminating 0
+    }
+  }
+  if (rc > 0) {
+    // pack the command in a code, upper-cased, for processCommand ()
+    commandCode = 0;
+    for (uint8_t i = 0; i < 4; i ++) {
+      char c = command[i];
+      if (c >= 'a' && c <= 'z') {
+        c -= 'a' - 'A';
+        command[i] = c;
+      }
+      commandCode = (commandCode << 8) | (uint8_t) c;
+      if (c == 0) {
+        commandCode <<= 8 * (3 - i);
+        break;
+      }
     }
   }
+  if (rc == -2) {
+    reply (500, "Syntax error");
+  }
   return rc;
 }
 
@@ -991,11 +3397,11 @@ int8_t FtpServer::readChar () {
 // return:
 //    true, if done
 
-boolean FtpServer::makePath (char * fullName) {
+boolean FtpSession::makePath (char * fullName) {
   return makePath (fullName, parameters);
 }
 
-boolean FtpServer::makePath (char * fullName, char * param) {
+boolean FtpSession::makePath (char * fullName, char * param) {
   if (param == NULL) {
     param = parameters;
   }
@@ -1015,15 +3421,36 @@ boolean FtpServer::makePath (char * fullName, char * param) {
   else {
     strcpy (fullName, param);
   }
-  // If ends with '/', remove it
-  uint16_t strl = strlen (fullName) - 1;
-  if (fullName[strl] == '/' && strl > 1) {
-    fullName[strl] = 0;
+  // Resolve "." and ".." and drop empty components: the path can't go
+  //   above the root, so neither can the file system path made from it
+  char * w = fullName;
+  for (char * r = fullName; * r != 0; ) {
+    while (* r == '/') {
+      r ++;
+    }
+    char * end = r;
+    while (* end != 0 && * end != '/') {
+      end ++;
+    }
+    if (end - r == 2 && r[0] == '.' && r[1] == '.') {
+      while (w > fullName && * -- w != '/') {
+      }
+    }
+    else if (end > r && !(end - r == 1 && r[0] == '.')) {
+      * w ++ = '/';
+      memmove (w, r, end - r);
+      w += end - r;
+    }
+    r = end;
+  }
+  if (w == fullName) {
+    * w ++ = '/';
   }
+  * w = 0;
   if (strlen (fullName) < FTP_CWD_SIZE) {
     return true;
   }
-  client.println ("500 Command line too long");
+  reply (500, "Command line too long");
   return false;
 }
 
@@ -1038,7 +3465,7 @@ boolean FtpServer::makePath (char * fullName, char * param) {
 //    0 if parameter is not YYYYMMDDHHMMSS
 //    length of parameter + space
 
-uint8_t FtpServer::getDateTime (uint16_t * pyear, uint8_t * pmonth, uint8_t * pday,
+uint8_t FtpSession::getDateTime (uint16_t * pyear, uint8_t * pmonth, uint8_t * pday,
                                 uint8_t * phour, uint8_t * pminute, uint8_t * psecond) {
   char dt[15];
 
@@ -1068,47 +3495,68 @@ uint8_t FtpServer::getDateTime (uint16_t * pyear, uint8_t * pmonth, uint8_t * pd
   return 15;
 }
 
-// Create string YYYYMMDDHHMMSS from date and time
+// Create string YYYYMMDDHHMMSS from a time (UTC)
 //
 // parameters:
-//    date, time 
+//    t: time
 //    tstr: where to store the string. Must be at least 15 characters long
 //
 // return:
 //    pointer to tstr
 
-char * FtpServer::makeDateTimeStr (char * tstr, uint16_t date, uint16_t time) {
-  sprintf (tstr, "%04u%02u%02u%02u%02u%02u",
-           ((date & 0xFE00) >> 9) + 1980, (date & 0x01E0) >> 5, date & 0x001F,
-           (time & 0xF800) >> 11, (time & 0x07E0) >> 5, (time & 0x001F) << 1);            
+char * FtpSession::makeDateTimeStr (char * tstr, time_t t) {
+  uint16_t year;
+  uint8_t  month, day, hour, minute, second;
+  splitTime (t, &year, &month, &day, &hour, &minute, &second);
+  sprintf (tstr, "%04u%02u%02u%02u%02u%02u", year, month, day, hour, minute, second);
   return tstr;
 }
 
-bool FtpServer::haveParameter () {
+bool FtpSession::haveParameter () {
   if (parameters != NULL && strlen (parameters) > 0) {
     return true;
   }
-  client.println ("501 No file name");
+  reply (501, "No file name");
   return false;  
 }
 
-bool FtpServer::makeExistsPath (fs::FS &fs, char * path, char * param) {
+// Tell if a path exists, from the path index if there is one
+//
+//  Without the index, or if the file system doesn't fit in it, the file
+//  system is asked.
+
+boolean FtpSession::pathExists (FtpStorage &fs, const char * path) {
+  #if FTP_PATH_INDEX
+  FtpPathIndex::Result found = server->pathIndex.find (fs, path);
+  if (found != FtpPathIndex::UNKNOWN) {
+    return found == FtpPathIndex::FOUND;
+  }
+  #endif
+  return fs.stat (path, NULL);
+}
+
+// Size, time and kind of a path, from the path index if there is one
+//
+// return:
+//    false, if the path doesn't exist
+
+boolean FtpSession::pathInfo (FtpStorage &fs, const char * path, FtpPathInfo * info) {
+  #if FTP_PATH_INDEX
+  FtpPathIndex::Result found = server->pathIndex.find (fs, path, info);
+  if (found != FtpPathIndex::UNKNOWN) {
+    return found == FtpPathIndex::FOUND;
+  }
+  #endif
+  return fs.stat (path, info);
+}
+
+bool FtpSession::makeExistsPath (FtpStorage &fs, char * path, char * param) {
   if (!makePath (path, param)) {
     return false;
   }
-  if (fs.exists (path)) {
+  if (pathExists (fs, path)) {
     return true;
   }
-  client.println ("550 " + String (path) + " not found.");
+  reply (550, "%s not found.", path);
   return false;
 }
-
-String FtpServer::fillSpaces (uint8_t length, String input) {
-  String output;
-  output = "";
-  while (output.length() < length - input.length()) {
-  	output += " ";
-  }
-  output += input;
-  return (output);
-}
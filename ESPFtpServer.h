@@ -35,68 +35,501 @@
 
 #include <FS.h>
 #include <WiFiClient.h>
+#include <WiFiServer.h>
+#include <stdarg.h>
+#include "FtpZlib.h"
+#include "FtpHash.h"
+#include "FtpStorage.h"
+#include "FtpPathIndex.h"
+#include "FtpFileCache.h"
+#include "FtpTar.h"
+#include "FtpRing.h"
 
 #define FTP_SERVER_VERSION "jmwislez/ESP32FtpServer 0.1.0"
 
+#ifndef FTP_CTRL_PORT
 #define FTP_CTRL_PORT      21           // Command port on wich server is listening  
-#define FTP_DATA_PORT_PASV 50009        // Data port in passive mode
+#endif
+#ifndef FTP_DATA_PORT_PASV
+#define FTP_DATA_PORT_PASV 50009        // First data port in passive mode
+#endif
 
 #define FTP_TIME_OUT       5            // Disconnect client after 5 minutes of inactivity
+#define FTP_DATA_TIME_OUT  10           // Wait 10 seconds for the client to open the data connection
 #define FTP_CMD_SIZE       255 + 8      // max size of a command
 #define FTP_CWD_SIZE       255 + 8      // max size of a directory name
 #define FTP_FIL_SIZE       255          // max size of a file name
 
 #define FTP_BUF_SIZE       4096         // 700 KByte/s download in AP mode, direct connection.
 
-class FtpServer {
+#ifndef FTP_CMD_PIPELINE                // max number of command lines run on one call of handleFTP ()
+#define FTP_CMD_PIPELINE   4
+#endif
+
+#ifndef FTP_REPLY_SIZE                  // max size of a reply, all lines of a multi-line reply included
+#define FTP_REPLY_SIZE     512
+#endif
+
+#ifndef FTP_QUANTUM_BYTES               // a transfer moves at most this many bytes per call of handleFTP ()
+#define FTP_QUANTUM_BYTES  (4 * FTP_BUF_SIZE)
+#endif
+#ifndef FTP_QUANTUM_MICROS              // ... and runs at most this long, before the next one
+#define FTP_QUANTUM_MICROS 5000
+#endif
+
+#ifndef FTP_EVENT_POLL_MS               // handleFTP (fs, ms) checks the sockets it can't watch (all of them
+#define FTP_EVENT_POLL_MS  10           // on ESP8266) every this many ms, sleeping in between
+#endif
+
+#ifndef FTP_SERVER_RATE                 // limit of RETR and STOR for the whole server, in bytes/s, 0 for none
+#define FTP_SERVER_RATE    0
+#endif
+#ifndef FTP_SESSION_RATE                // limit of RETR and STOR for each session, in bytes/s, 0 for none
+#define FTP_SESSION_RATE   0
+#endif
+#ifndef FTP_RATE_BURST_MS               // bytes that a limited transfer may send at once, in ms at its rate
+#define FTP_RATE_BURST_MS  100
+#endif
+
+#ifndef FTP_MODE_Z                      // 1 to offer MODE Z (deflate), that takes RAM for each transfer
+#define FTP_MODE_Z         1            // (see FtpZlib.h for the size of the windows)
+#endif
+#define FTP_ZLIB_CHUNK     (FTP_ZLIB_WINDOW < FTP_BUF_SIZE ? FTP_ZLIB_WINDOW : FTP_BUF_SIZE)
+
+#ifdef ESP32
+#ifndef FTP_VFS_MOUNT                   // where the FS is mounted in the VFS, for setting times with utime ()
+#define FTP_VFS_MOUNT      "/littlefs"  // "/spiffs", "/sdcard", "/ffat"...
+#endif
+#endif
+
+#ifndef FTP_WRITE_BLOCK_SIZE            // uploads are written to the file system in aligned blocks of this size
+#define FTP_WRITE_BLOCK_SIZE 4096       // 512 for SD cards, erase/program size for LittleFS
+#endif
+#if FTP_BUF_SIZE < FTP_WRITE_BLOCK_SIZE
+#error "FTP_BUF_SIZE must hold at least one block of FTP_WRITE_BLOCK_SIZE bytes"
+#endif
+
+#ifndef FTP_FS_TASK                     // 1 to read and write the files of RETR and STOR in a task of their
+#define FTP_FS_TASK        0            // own, on the other core, while handleFTP () moves the data (ESP32)
+#endif
+#ifndef FTP_FS_TASK_CORE                // core of that task (the Arduino loop () runs on core 1)
+#define FTP_FS_TASK_CORE   0
+#endif
+#ifndef FTP_FS_RING_SIZE                // bytes between the task and the socket, for each transfer (power of 2)
+#define FTP_FS_RING_SIZE   16384
+#endif
+#if FTP_FS_TASK && !defined (ESP32)
+#error "FTP_FS_TASK needs the threads of ESP32"
+#endif
+#if FTP_FS_RING_SIZE & (FTP_FS_RING_SIZE - 1) || FTP_FS_RING_SIZE % FTP_WRITE_BLOCK_SIZE
+#error "FTP_FS_RING_SIZE must be a power of 2, and a multiple of FTP_WRITE_BLOCK_SIZE"
+#endif
+#if FTP_FS_TASK
+#include <condition_variable>
+#include <mutex>
+#endif
+
+#ifndef FTP_LIST_MSS                    // listings are sent in segments of this size (TCP MSS)
+#define FTP_LIST_MSS       1436
+#endif
+#if FTP_BUF_SIZE < FTP_LIST_MSS + FTP_FIL_SIZE + 64
+#error "FTP_BUF_SIZE must hold a segment of FTP_LIST_MSS bytes plus a listing line"
+#endif
+
+#ifndef FTP_MAX_SESSIONS                // number of clients served at the same time
+#ifdef ESP8266
+#define FTP_MAX_SESSIONS   2            // each session holds FTP_BUF_SIZE + about 1 KByte of RAM
+#else
+#define FTP_MAX_SESSIONS   4
+#endif
+#endif
+
+#ifndef FTP_DATA_PORT_COUNT             // number of passive ports, from FTP_DATA_PORT_PASV up
+#define FTP_DATA_PORT_COUNT FTP_MAX_SESSIONS
+#endif
+
+#ifndef FTP_LIST_CACHE                  // 1 to keep the last directory listings in RAM, each taking
+#define FTP_LIST_CACHE     0            // about FTP_LIST_CACHE_SIZE + 300 bytes of static RAM
+#endif
+#ifndef FTP_LIST_CACHE_ENTRIES          // number of directory listings kept in RAM
+#ifdef ESP8266
+#define FTP_LIST_CACHE_ENTRIES 2
+#else
+#define FTP_LIST_CACHE_ENTRIES 4
+#endif
+#endif
+#ifndef FTP_LIST_CACHE_SIZE             // max size of a cached listing, larger ones are not cached
+#define FTP_LIST_CACHE_SIZE 2048
+#endif
+#if FTP_BUF_SIZE < FTP_LIST_CACHE_SIZE
+#error "FTP_BUF_SIZE must hold a listing of FTP_LIST_CACHE_SIZE bytes"
+#endif
+#ifndef FTP_LIST_CACHE_TIME_OUT         // drop cached listings after 30 seconds, to see changes made by the sketch
+#define FTP_LIST_CACHE_TIME_OUT 30
+#endif
+
+#ifndef FTP_HASH_CACHE_ENTRIES          // number of file digests (HASH, XCRC, XMD5) kept in RAM, 0 to disable
+#ifdef ESP8266
+#define FTP_HASH_CACHE_ENTRIES 4
+#else
+#define FTP_HASH_CACHE_ENTRIES 8
+#endif
+#endif
+
+#ifndef FTP_PATH_INDEX                  // 1 to answer exists/size/time lookups from an index of the
+#define FTP_PATH_INDEX     0            // file system in RAM, of FTP_PATH_INDEX_SIZE bytes at most
+#endif
+
+#ifndef FTP_TAR                         // 1 to send a directory as a tar archive on RETR <dir>.tar, and
+#define FTP_TAR            1            // to extract the archive stored by STOR <FTP_TAR_EXTRACT_DIR>/<dir>/<name>.tar
+#endif
+
+#ifndef FTP_FILE_CACHE                  // 1 to keep the files sent by RETR in RAM, up to FTP_FILE_CACHE_MAX_FILE
+#define FTP_FILE_CACHE     0            // bytes each and FTP_FILE_CACHE_SIZE in all (PSRAM if the board has it)
+#endif
+
+// A directory listing, kept as sent on the data connection
+struct FtpListCacheEntry {
+  char     path[FTP_CWD_SIZE];          // listed directory, empty if the entry is free
+  char     command[5];                  // LIST, MLSD or NLST
+  uint16_t length,                      // number of bytes in data
+           matches;                     // number of files in the listing
+  boolean  claimed;                     // being filled by a listing in progress
+  uint32_t millisStored,                // time the listing was made
+           millisUsed;                  // time the listing was last sent
+  char     data[FTP_LIST_CACHE_SIZE];
+};
+
+#define FTP_HASH_ADLER32   FtpHash::COUNT // algorithm of the Adler-32 of a file sent from its .gz, in the digest cache
+
+// Digest of a file, valid as long as the file keeps its size and time
+struct FtpHashCacheEntry {
+  char     path[FTP_CWD_SIZE];          // hashed file, empty if the entry is free
+  uint32_t size;
+  time_t   mtime;
+  uint8_t  algorithm,                   // FtpHash::Algorithm
+           length;                      // number of bytes in digest
+  uint8_t  digest[FTP_HASH_MAX_SIZE];
+  uint32_t millisUsed;                  // time the digest was last used
+};
+
+// Token bucket limiting the rate of data transfers
+class FtpRateLimit {
   public:
-    void    begin (String uname, String pword);
-    void    handleFTP (fs::FS &fs);
+    void     set (uint32_t bytesPerSecond);
+    uint32_t rate ();
+    uint32_t allowance ();
+    void     consume (uint32_t bytes);
+    uint32_t millisToWait ();
+
+  private:
+    uint32_t bytesPerSecond,            // 0 if not limited
+             burst,                     // max number of tokens
+             tokens,                    // bytes that may be transferred now
+             microsRefill,              // time tokens were last added
+             millisRefill,              // the same in ms, that wraps after 49 days instead of 71 minutes
+             fillMillis;                // time to fill the bucket from empty
+};
+
+// Counters of one transfer (file or listing)
+struct FtpTransferStats {
+  char     command[5];                  // RETR, STOR, APPE, LIST, MLSD or NLST
+  boolean  completed;                   // false if aborted or failed
+  uint32_t bytes,                       // bytes sent or received on the data connection
+           millis,                      // duration, from the data connection to the end
+           fsMicros,                    // time spent reading/writing the file system (walking the directory)
+           netMicros,                   // time spent reading/writing the data connection
+           stalls;                      // turns in which the transfer couldn't progress
+};
+
+// Counters of the server, since begin () or resetStats ()
+struct FtpServerStats {
+  uint32_t sessions,                    // control connections accepted
+           rejected,                    // connections turned away, all sessions busy
+           loginsFailed,                // wrong user name or password
+           transfers,                   // transfers completed
+           transfersFailed,             // transfers aborted or failed
+           stalls,
+           fileTransfers,               // completed RETR/STOR/APPE, used for throughput
+           fileMillis,
+           kbpsMin,                     // throughput of file transfers, in kbytes/s
+           kbpsMax,
+           fileCacheHits,               // RETR sent from the file cache (FTP_FILE_CACHE)
+           fileCacheMisses;             // RETR of a file small enough, but not in the cache
+  uint64_t bytesSent,                   // files and listings
+           bytesReceived,
+           fileBytes,
+           fsMicros,
+           netMicros;
+  FtpTransferStats last;                // last transfer, completed or not
+};
+
+// State of a transfer in MODE Z, allocated when its data connection opens
+struct FtpZStream {
+  union {
+    FtpDeflate deflate;                 // RETR and listings
+    FtpInflate inflate;                 // STOR and APPE
+  };
+  uint8_t  out[FTP_ZLIB_BOUND (FTP_ZLIB_CHUNK)]; // compressed data to send
+  uint16_t iOut,                        // next byte of out to send
+           nOut;                        // number of bytes in out
+  boolean  finished;                    // end of the compressed stream is in out
+  boolean  passthrough;                 // RETR sends a precompressed .gz file as is
+  uint32_t size,                        // passthrough: length of the deflate data of the .gz file
+           left,                        // passthrough: bytes of it not read yet
+           adler,                       // passthrough: checksum of the original file
+           plainSize;                   // passthrough: size of the original file
+  time_t   plainMtime;                  // passthrough: time of the original file
+};
+
+// File of a RETR or STOR being read or written by the file system task
+// (FTP_FS_TASK), allocated when its data connection opens
+struct FtpFsPipe {
+  FtpRing  ring;                        // RETR: file to socket, STOR: socket to file
+  boolean  store;                       // STOR or APPE
+  std::atomic<bool> ended,              // RETR: the whole file is in the ring, STOR: the whole upload
+                    failed;             // the file system didn't take all bytes
+  uint32_t fsMicros,                    // counters of the task, read at the end of the transfer
+           fsWrites;
+  uint8_t  data[FTP_FS_RING_SIZE];
+};
+
+#if FTP_FS_TASK
+// What the file system task shares with handleFTP ()
+struct FtpFsTask {
+  std::mutex lock;                      // held to sleep and to wake the task up
+  std::condition_variable wake;
+  std::atomic<uint32_t> wakes;          // incremented to wake the task up
+  std::atomic<bool> sleeping;
+  std::mutex sessionLock[FTP_MAX_SESSIONS]; // held by the task while it uses the pipe of a session
+};
+#endif
+
+// Code of a command: its 4 letters (or 3 and a 0) in a 32 bit word
+#define FTP_CMD(a, b, c, d) (((uint32_t) (a) << 24) | ((uint32_t) (b) << 16) | ((uint32_t) (c) << 8) | (uint32_t) (d))
+
+class FtpServer;
+struct FtpWait;
+
+// Number of heap allocations made so far by the program. The library only
+// defines it weak, returning 0; an application (like the host build in
+// extras/host) that counts malloc and new can define it, to check how many
+// allocations the commands make.
+uint32_t ftpAllocCount ();
+
+// State of one control connection, with its data connection and open file
+class FtpSession {
+  public:
+    void    begin (FtpServer * server);
+    void    handleControl (FtpStorage &fs);
+    void    handleTransfer (FtpStorage &fs);
+    bool    isIdle ();
+    void    prepareWait (FtpWait & wait);
+    static uint16_t formatEntry (char * line, const char * format, const char * name,
+                                 uint32_t size, time_t mtime, boolean isDir);
 
   private:
     bool    haveParameter ();
-    bool    makeExistsPath (fs::FS &fs, char * path, char * param = NULL);
+    bool    makeExistsPath (FtpStorage &fs, char * path, char * param = NULL);
     void    iniVariables ();
     void    clientConnected ();
     void    disconnectClient ();
     boolean userIdentity ();
     boolean userPassword ();
-    boolean processCommand (fs::FS &fs);
+    boolean processCommand (FtpStorage &fs);
+    void    cmdCdup (FtpStorage &fs);
+    void    cmdCwd (FtpStorage &fs);
+    void    cmdPwd ();
+    void    cmdMode ();
+    void    cmdPasv ();
+    void    cmdPort ();
+    void    cmdStru ();
+    void    cmdType ();
+    void    cmdRest ();
+    void    cmdAbor ();
+    void    cmdDele (FtpStorage &fs);
+    void    cmdList (FtpStorage &fs);
+    void    cmdMlsd (FtpStorage &fs);
+    void    cmdNlst (FtpStorage &fs);
+    void    cmdNoop ();
+    void    cmdRetr (FtpStorage &fs);
+    void    cmdStor (FtpStorage &fs);
+    void    cmdMkd (FtpStorage &fs);
+    void    cmdRmd (FtpStorage &fs);
+    void    cmdRnfr (FtpStorage &fs);
+    void    cmdRnto (FtpStorage &fs);
+    void    cmdFeat ();
+    void    cmdMdtm (FtpStorage &fs);
+    void    cmdMfmt (FtpStorage &fs);
+    void    cmdSize (FtpStorage &fs);
+    void    cmdSite ();
+    void    cmdOpts ();
+    void    cmdHash (FtpStorage &fs);
+    boolean doHash ();
+    void    replyHash (FtpHash::Algorithm algorithm, const uint8_t * digest, uint8_t length);
+    void    siteStats ();
+    void    siteRate (const char * args);
+    uint32_t rateAllowance (uint32_t length);
+    boolean zBegin ();
+    void    zEnd ();
+    boolean zPending ();
+    boolean openPrecompressed (FtpStorage &fs);
+    uint16_t readPrecompressed ();
+    boolean inflateReceived (boolean end);
+    boolean pipeBegin ();
+    boolean pipeEnd ();
+    boolean pipeWaiting ();
+    boolean pipeRetrieve ();
+    boolean pipeStore ();
+    boolean fsWork ();
     boolean dataConnect ();
+    void    releaseDataPort ();
+    void    waitDataConnection (FtpStorage &fs);
+    void    dataConnected (FtpStorage &fs, boolean reused);
+    boolean openListing (FtpStorage &fs);
+    boolean doListing ();
+    void    listEntry (const char * name, uint32_t size, time_t mtime, boolean isDir);
+    void    releaseListing (boolean keep);
+    void    useFileCache (const char * path);
     boolean doRetrieve ();
+    boolean sendBorrowed (const uint8_t * span, uint32_t length);
+    int32_t dataSend (uint32_t length, uint32_t limit, boolean last);
+    int32_t dataWrite (const uint8_t * data_buf, uint32_t length);
+    int32_t socketWrite (const uint8_t * data_buf, uint32_t length);
+    boolean dataEnd ();
+    int     dataAvailable ();
+    int     dataRead (uint8_t * dest, int length);
+    boolean dataEnded ();
+    void    dataRelease (boolean keep);
+    void    blockBegin (boolean send);
     boolean doStore ();
+    boolean writeBuffer (boolean all);
+    void    closeFile ();
     void    closeTransfer ();
     void    abortTransfer ();
+    void    beginStats ();
+    void    endStats (boolean completed);
+    boolean pathExists (FtpStorage &fs, const char * path);
+    boolean pathInfo (FtpStorage &fs, const char * path, FtpPathInfo * info);
     boolean makePath (char * fullname);
     boolean makePath (char * fullName, char * param);
     uint8_t getDateTime (uint16_t * pyear, uint8_t * pmonth, uint8_t * pday,
                          uint8_t * phour, uint8_t * pminute, uint8_t * second);
-    char *  makeDateTimeStr (char * tstr, uint16_t date, uint16_t time);
-    int8_t  readChar ();
-    String  fillSpaces (uint8_t len, String input_str);
+    char *  makeDateTimeStr (char * tstr, time_t t);
+    int16_t readCommand ();
+    void    reply (uint16_t code, const char * format, ...) __attribute__ ((format (printf, 3, 4)));
+    void    replyPart (uint16_t code, const char * format, ...) __attribute__ ((format (printf, 3, 4)));
+    void    replyLine (uint16_t code, char sep, const char * format, va_list args);
+
+    friend class FtpServer;
+    FtpServer * server;                 // owner, holds the credentials
 
     IPAddress  dataIp;                  // IP address of client for data
     WiFiClient client;
     WiFiClient data;
 
-    File file;
+    FtpStorageFile * file;              // file being transferred, or directory being listed, or NULL
+    char     pathName[FTP_CWD_SIZE];    // file being transferred
+    FtpListCacheEntry * listCache;      // where the listing being sent is copied, or NULL
+    uint16_t listMatches;               // number of entries listed so far
+    boolean  listEnd;                   // all entries of the directory are in buf
+    FtpTransferStats xfer;              // counters of the transfer in progress
+    FtpRateLimit rateLimit;             // limit of RETR and STOR of this session
+    boolean  stalled;                   // the transfer couldn't progress on its last turn
+    char     transferMode;              // 'S' (stream), 'B' (block) or 'Z' (deflate), set by MODE
+    uint8_t  blockHeader[3];            // in MODE B, header of the block being sent or received:
+    uint8_t  nBlockHeader;              // descriptor and byte count, and its bytes sent or received
+    uint16_t blockLeft;                 // bytes of the block still to send or receive
+    boolean  blockEof;                  // the EOF block was received, or is being sent
+    FtpZStream * zs;                    // compression of the transfer in MODE Z, or NULL
+    FtpStorageFile * zPlain;            // original of a precompressed file being sent, or NULL
+    FtpFsPipe * pipe;                   // file read or written by the file system task, or NULL
+    FtpHash  hash;                      // digest of the file being hashed
+    FtpHash::Algorithm hashAlgorithm,   // algorithm of HASH, set by OPTS HASH
+             hashRunning;               // algorithm of the file being hashed
+    uint32_t hashSize;                  // size and time of the file being hashed
+    time_t   hashMtime;
   
     boolean  dataPassiveConn;
     uint16_t dataPort;
+    int8_t   dataPortIndex;             // passive port of the pool bound to this session, or -1
     char     buf[FTP_BUF_SIZE];         // data buffer for transfers
-    char     cmdLine[FTP_CMD_SIZE];     // where to store incoming char from client
+    uint16_t iBuf,                      // next byte of buf to send
+             nBuf;                      // number of bytes in buf (read from file, or staged for writing)
+    char     cmdLine[FTP_CMD_SIZE];     // chars received from client, may hold several lines
+    char     replyBuf[FTP_REPLY_SIZE];  // reply being built, sent by reply () in one write
+    uint16_t nReply;                    // number of chars in replyBuf
     char     cwdName[FTP_CWD_SIZE];     // name of current directory
     char     command[5];                // command sent by client
+    uint32_t commandCode;               // command packed by FTP_CMD ()
+    char     dataCommand[5];            // command waiting for the data connection
     boolean  rnfrCmd;                   // previous command was RNFR
     char *   parameters;                // point to begin of parameters sent by client
-    uint16_t iCL;                       // pointer to cmdLine next incoming char
+    uint16_t iCL,                       // number of chars in cmdLine
+             nCL;                       // length of the line in process, dropped on next read
+    boolean  skipLine;                  // drop chars up to the end of a line too long
     int8_t   cmdStatus,                 // status of ftp command connexion
-             transferStatus;            // status of ftp data transfer
+             transferStatus;            // status of ftp data transfer (1: RETR, 2: STOR, 3: waiting for data connection, 4: listing, 5: hashing)
     uint32_t millisTimeOut,             // disconnect after 5 min of inactivity
              millisDelay,
              millisEndConnection,       // 
+             millisEndData,             // give up waiting for the data connection
              millisBeginTrans,          // store time of beginning of a transaction
-             bytesTransferred;          //
+             bytesTransferred,          //
+             restartOffset,             // offset given by REST for the next RETR/STOR
+             storeOffset,               // offset in the file of the first byte staged in buf
+             fsWrites;                  // number of writes to the file system during STOR
+};
+
+class FtpServer {
+  public:
+    void    begin (String uname, String pword);
+    void    handleFTP (fs::FS &fs);
+    void    handleFTP (fs::FS &fs, uint32_t maxWaitMillis);
+    void    handleFTP (FtpStorage &storage);
+    void    handleFTP (FtpStorage &storage, uint32_t maxWaitMillis);
+    void    invalidateCache (const char * path = NULL);
+    const FtpServerStats & getStats ();
+    void    resetStats ();
+    void    setServerRate (uint32_t bytesPerSecond);
+    void    setSessionRate (uint32_t bytesPerSecond);
+    uint32_t getPathIndexFootprint ();
+
+  private:
+    FtpListCacheEntry * findListing (const char * path, const char * command);
+    FtpListCacheEntry * claimListing ();
+    const FtpHashCacheEntry * findHash (const char * path, uint32_t size, time_t mtime, uint8_t algorithm);
+    void    storeHash (const char * path, uint32_t size, time_t mtime, uint8_t algorithm,
+                       const uint8_t * digest, uint8_t length);
+    int8_t  acquireDataPort (FtpSession * session);
+    void    releaseDataPort (int8_t index);
+    void    recordTransfer (const FtpTransferStats & xfer);
+    void    waitEvent (uint32_t maxMillis);
+    void    runFsTask ();
+    void    wakeFsTask ();
+
+    friend class FtpSession;
+    FtpSession sessions[FTP_MAX_SESSIONS];
+    WiFiServer * dataServers[FTP_DATA_PORT_COUNT] = {};   // pool of passive ports
+    FtpSession * dataPortOwner[FTP_DATA_PORT_COUNT] = {}; // session a port is handed out to, or NULL
+    #if FTP_LIST_CACHE
+    FtpListCacheEntry listCache[FTP_LIST_CACHE_ENTRIES];
+    #endif
+    FtpHashCacheEntry hashCache[FTP_HASH_CACHE_ENTRIES];
+    FtpFsStorage fsStorage;             // storage of handleFTP (fs::FS &)
+    #if FTP_PATH_INDEX
+    FtpPathIndex pathIndex;             // paths of the file system, built on first lookup
+    #endif
+    #if FTP_FILE_CACHE
+    FtpFileCache fileCache;             // small files sent by RETR
+    #endif
+    #if FTP_FS_TASK
+    FtpFsTask * fsTask = NULL;          // started by the first begin (), runs for good
+    #endif
+    FtpServerStats stats;
+    uint8_t  nextTransfer;              // session whose transfer runs first on next call
+    FtpRateLimit rateLimit;             // limit of RETR and STOR of all sessions together
+    uint32_t sessionRate;               // limit given to each session when the client connects
     String   _FTP_USER;
     String   _FTP_PASS;
 };
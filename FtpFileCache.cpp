@@ -0,0 +1,233 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * cache of whole small files in RAM (PSRAM if the board has it), for RETR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FtpFileCache.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef BOARD_HAS_PSRAM
+#include <Arduino.h>
+#endif
+
+// A cached file, read in place
+class FtpCachedFile : public FtpStorageFile {
+  public:
+    FtpCachedFile (FtpFileCache * cache, FtpFileCache::Entry * e) : cache (cache), e (e) {}
+    ~FtpCachedFile () { cache->release (e); }
+
+    uint32_t read (uint8_t * buf, uint32_t length) override {
+      if (length > e->size - offset) {
+        length = e->size - offset;
+      }
+      memcpy (buf, e->data + offset, length);
+      offset += length;
+      return length;
+    }
+
+    bool seek (uint32_t position) override {
+      if (position > e->size) {
+        return false;
+      }
+      offset = position;
+      return true;
+    }
+
+    uint32_t position () override { return offset; }
+    uint32_t size () override { return e->size; }
+    time_t   lastWrite () override { return e->mtime; }
+
+    const uint8_t * borrow (uint32_t * length) override {
+      * length = e->size - offset;
+      return e->data + offset;
+    }
+
+    void release (uint32_t length) override {
+      offset += length;
+    }
+
+  private:
+    FtpFileCache * cache;
+    FtpFileCache::Entry * e;
+    uint32_t offset = 0;
+};
+
+static void * cacheAlloc (uint32_t bytes) {
+  #ifdef BOARD_HAS_PSRAM
+  if (psramFound ()) {
+    return ps_malloc (bytes);
+  }
+  #endif
+  return malloc (bytes);
+}
+
+// Look a file up
+//
+//  A copy with another size or time, the file having been changed
+//  outside of the ftp server, is dropped
+//
+// return:
+//    a handle reading the cached file, or NULL if it is not cached with
+//    this size and time
+
+FtpStorageFile * FtpFileCache::find (const char * path, uint32_t size, time_t mtime) {
+  for (uint8_t i = 0; i < FTP_FILE_CACHE_ENTRIES; i ++) {
+    Entry * e = entries[i];
+    if (e != NULL && !strcmp (e->path, path)) {
+      if (e->size == size && e->mtime == mtime) {
+        return open (e);
+      }
+      drop (i);
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Read a whole file into the cache, from its current position (the
+// beginning, just opened), making room for it
+//
+// return:
+//    a handle reading the cached file, or NULL if the file is too large,
+//    there is no room for it or it can't be read; file has been read
+//    from in any case
+
+FtpStorageFile * FtpFileCache::store (const char * path, FtpStorageFile * file) {
+  uint32_t size = file->size ();
+  uint32_t pathLength = strlen (path);
+  uint32_t bytes = sizeof (Entry) + pathLength + size;
+  if (size > FTP_FILE_CACHE_MAX_FILE || !makeRoom (bytes)) {
+    return NULL;
+  }
+  Entry * e = (Entry *) cacheAlloc (bytes);
+  if (e == NULL) {
+    return NULL;
+  }
+  e->data = (uint8_t *) e->path + pathLength + 1;
+  uint32_t n = 0;
+  while (n < size) {
+    uint32_t nr = file->read (e->data + n, size - n);
+    if (nr == 0) {
+      break;
+    }
+    n += nr;
+  }
+  if (n != size) {                     // shorter than it was
+    free (e);
+    return NULL;
+  }
+  memcpy (e->path, path, pathLength + 1);
+  e->size = size;
+  e->mtime = file->lastWrite ();
+  e->bytes = bytes;
+  e->users = 0;
+  e->stale = false;
+  for (uint8_t i = 0; i < FTP_FILE_CACHE_ENTRIES; i ++) {
+    if (entries[i] == NULL) {
+      entries[i] = e;
+      break;
+    }
+  }
+  used += bytes;
+  return open (e);
+}
+
+// Drop a file, or the files below a directory; NULL drops all
+
+void FtpFileCache::invalidate (const char * path) {
+  uint16_t len = path != NULL ? strlen (path) : 0;
+  for (uint8_t i = 0; i < FTP_FILE_CACHE_ENTRIES; i ++) {
+    const char * cached = entries[i] != NULL ? entries[i]->path : NULL;
+    if (cached != NULL && (path == NULL
+        || (!strncmp (cached, path, len) && (cached[len] == 0 || cached[len] == '/')))) {
+      drop (i);
+    }
+  }
+}
+
+// Number of files cached
+
+uint8_t FtpFileCache::count () {
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < FTP_FILE_CACHE_ENTRIES; i ++) {
+    n += entries[i] != NULL;
+  }
+  return n;
+}
+
+// Bytes of RAM taken by the cached files, those still being sent once dropped included
+
+uint32_t FtpFileCache::footprint () {
+  return used;
+}
+
+FtpStorageFile * FtpFileCache::open (Entry * e) {
+  e->users ++;
+  e->lastUse = ++ uses;
+  return new FtpCachedFile (this, e);
+}
+
+// Drop least recently used files until an entry of bytes fits, and one is free
+//
+// return:
+//    false, if it doesn't fit in FTP_FILE_CACHE_SIZE
+
+bool FtpFileCache::makeRoom (uint32_t bytes) {
+  if (bytes > FTP_FILE_CACHE_SIZE) {
+    return false;
+  }
+  while (true) {
+    int8_t oldest = -1;
+    bool freeEntry = false;
+    for (uint8_t i = 0; i < FTP_FILE_CACHE_ENTRIES; i ++) {
+      if (entries[i] == NULL) {
+        freeEntry = true;
+      }
+      else if (oldest < 0 || (int32_t) (entries[i]->lastUse - entries[oldest]->lastUse) < 0) {
+        oldest = i;
+      }
+    }
+    if (freeEntry && used + bytes <= FTP_FILE_CACHE_SIZE) {
+      return true;
+    }
+    if (oldest < 0) {                  // all that is left is being sent
+      return false;
+    }
+    drop (oldest);
+  }
+}
+
+// Remove an entry; its file is freed at once, or when the last handle
+// reading it is deleted
+
+void FtpFileCache::drop (uint8_t i) {
+  Entry * e = entries[i];
+  entries[i] = NULL;
+  e->stale = true;
+  if (e->users == 0) {
+    used -= e->bytes;
+    free (e);
+  }
+}
+
+void FtpFileCache::release (Entry * e) {
+  e->users --;
+  if (e->stale && e->users == 0) {
+    used -= e->bytes;
+    free (e);
+  }
+}
@@ -0,0 +1,74 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * cache of whole small files in RAM (PSRAM if the board has it), for RETR
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_FILE_CACHE_H
+#define FTP_FILE_CACHE_H
+
+#include "FtpStorage.h"
+
+#ifndef FTP_FILE_CACHE_SIZE             // max bytes of RAM taken by the cached files, paths included
+#ifdef BOARD_HAS_PSRAM
+#define FTP_FILE_CACHE_SIZE    1048576
+#else
+#define FTP_FILE_CACHE_SIZE    65536
+#endif
+#endif
+#ifndef FTP_FILE_CACHE_MAX_FILE         // larger files are not cached
+#define FTP_FILE_CACHE_MAX_FILE 32768
+#endif
+#ifndef FTP_FILE_CACHE_ENTRIES          // max number of files cached
+#define FTP_FILE_CACHE_ENTRIES 16
+#endif
+
+// Whole files kept in RAM by path, valid as long as the file keeps its
+// size and time, and handed out as FtpStorageFile that lend their bytes
+// (see FtpStorageFile::borrow ()). When full, the least recently used
+// files are dropped. A file being sent stays in RAM until its handle is
+// deleted, even if it is dropped or invalidated meanwhile.
+class FtpFileCache {
+  public:
+    FtpStorageFile * find (const char * path, uint32_t size, time_t mtime);
+    FtpStorageFile * store (const char * path, FtpStorageFile * file);
+    void     invalidate (const char * path);
+    uint8_t  count ();
+    uint32_t footprint ();
+
+  private:
+    struct Entry {
+      uint32_t size,
+               bytes,                   // allocated for the entry, with its path and data
+               lastUse;                 // value of uses when the file was last found or stored
+      time_t   mtime;
+      uint16_t users;                   // handles reading the file
+      bool     stale;                   // dropped, freed when its last handle is deleted
+      uint8_t * data;                   // after the path, in the same allocation
+      char     path[1];
+    };
+    friend class FtpCachedFile;
+
+    FtpStorageFile * open (Entry * e);
+    bool     makeRoom (uint32_t bytes);
+    void     drop (uint8_t i);
+    void     release (Entry * e);
+
+    Entry *  entries[FTP_FILE_CACHE_ENTRIES] = {};
+    uint32_t used = 0,                  // bytes allocated for entries, stale ones included
+             uses = 0;
+};
+
+#endif // FTP_FILE_CACHE_H
@@ -0,0 +1,289 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * digests of files for HASH, XCRC and XMD5: CRC-32, MD5, SHA-1 and SHA-256
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FtpHash.h"
+#include <string.h>
+#include <strings.h>
+
+static const char * const names[FtpHash::COUNT] = { "CRC32", "MD5", "SHA-1", "SHA-256" };
+
+// CRC-32 (IEEE 802.3), a nibble at a time to keep the table small
+static const uint32_t crcTable[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C };
+
+static const uint32_t md5K[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+static const uint8_t  md5R[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+static const uint32_t sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+static inline uint32_t rol (uint32_t x, uint8_t n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t ror (uint32_t x, uint8_t n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t getBE (const uint8_t * p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline uint32_t getLE (const uint8_t * p) {
+  return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0];
+}
+
+// Name of an algorithm, as in HASH replies and FEAT
+
+const char * FtpHash::name (Algorithm algorithm) {
+  return names[algorithm];
+}
+
+// Algorithm of a name, case insensitive
+//
+// return:
+//    the algorithm, or -1 if unknown
+
+int8_t FtpHash::find (const char * name) {
+  for (int8_t i = 0; i < COUNT; i ++) {
+    if (!strcasecmp (name, names[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void FtpHash::begin (Algorithm alg) {
+  static const uint32_t md5Init[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  static const uint32_t sha1Init[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  static const uint32_t sha256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  algorithm = alg;
+  length = 0;
+  if (algorithm == CRC32) {
+    state[0] = 0xFFFFFFFF;
+  }
+  else if (algorithm == MD5) {
+    memcpy (state, md5Init, sizeof (md5Init));
+  }
+  else if (algorithm == SHA1) {
+    memcpy (state, sha1Init, sizeof (sha1Init));
+  }
+  else {
+    memcpy (state, sha256Init, sizeof (sha256Init));
+  }
+}
+
+void FtpHash::update (const uint8_t * p, uint32_t n) {
+  if (algorithm == CRC32) {
+    uint32_t crc = state[0];
+    while (n --) {
+      crc ^= * p ++;
+      crc = (crc >> 4) ^ crcTable[crc & 15];
+      crc = (crc >> 4) ^ crcTable[crc & 15];
+    }
+    state[0] = crc;
+    return;
+  }
+  while (n > 0) {
+    uint8_t used = length & 63;
+    uint8_t take = n < (uint32_t) (64 - used) ? n : 64 - used;
+    memcpy (data + used, p, take);
+    length += take;
+    p += take;
+    n -= take;
+    if ((length & 63) == 0) {
+      block ();
+    }
+  }
+}
+
+// End the digest, and write it to digest (FTP_HASH_MAX_SIZE bytes at most)
+//
+// return:
+//    number of bytes of the digest
+
+uint8_t FtpHash::finish (uint8_t * digest) {
+  if (algorithm == CRC32) {
+    uint32_t crc = ~state[0];
+    for (uint8_t i = 0; i < 4; i ++) {
+      digest[i] = crc >> (24 - 8 * i);
+    }
+    return 4;
+  }
+  // padding: 0x80, zeros, and the length in bits on the last 8 bytes
+  uint64_t bits = length * 8;
+  uint8_t used = length & 63;
+  data[used ++] = 0x80;
+  if (used > 56) {
+    memset (data + used, 0, 64 - used);
+    block ();
+    used = 0;
+  }
+  memset (data + used, 0, 56 - used);
+  for (uint8_t i = 0; i < 8; i ++) {
+    data[algorithm == MD5 ? 56 + i : 63 - i] = bits >> (8 * i);
+  }
+  block ();
+  if (algorithm == MD5) {
+    for (uint8_t i = 0; i < 16; i ++) {
+      digest[i] = state[i / 4] >> (8 * (i % 4));
+    }
+    return 16;
+  }
+  uint8_t size = algorithm == SHA1 ? 20 : 32;
+  for (uint8_t i = 0; i < size; i ++) {
+    digest[i] = state[i / 4] >> (24 - 8 * (i % 4));
+  }
+  return size;
+}
+
+void FtpHash::block () {
+  if (algorithm == MD5) {
+    blockMd5 ();
+  }
+  else if (algorithm == SHA1) {
+    blockSha1 ();
+  }
+  else {
+    blockSha256 ();
+  }
+}
+
+// MD5 (RFC 1321)
+
+void FtpHash::blockMd5 () {
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  for (uint8_t i = 0; i < 64; i ++) {
+    uint32_t f;
+    uint8_t g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    }
+    else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) & 15;
+    }
+    else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) & 15;
+    }
+    else {
+      f = c ^ (b | ~d);
+      g = (7 * i) & 15;
+    }
+    f += a + md5K[i] + getLE (data + 4 * g);
+    a = d;
+    d = c;
+    c = b;
+    b += rol (f, md5R[(i / 16) * 4 + (i & 3)]);
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+// SHA-1 (FIPS 180-4), with the message schedule in 16 words
+
+void FtpHash::blockSha1 () {
+  uint32_t w[16];
+  for (uint8_t i = 0; i < 16; i ++) {
+    w[i] = getBE (data + 4 * i);
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (uint8_t i = 0; i < 80; i ++) {
+    if (i >= 16) {
+      w[i & 15] = rol (w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+    }
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    }
+    else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    }
+    else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    }
+    else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t t = rol (a, 5) + f + e + k + w[i & 15];
+    e = d;
+    d = c;
+    c = rol (b, 30);
+    b = a;
+    a = t;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+// SHA-256 (FIPS 180-4), with the message schedule in 16 words
+
+void FtpHash::blockSha256 () {
+  uint32_t w[16];
+  for (uint8_t i = 0; i < 16; i ++) {
+    w[i] = getBE (data + 4 * i);
+  }
+  uint32_t s[8];
+  memcpy (s, state, sizeof (s));
+  for (uint8_t i = 0; i < 64; i ++) {
+    if (i >= 16) {
+      uint32_t w15 = w[(i + 1) & 15], w2 = w[(i + 14) & 15];
+      w[i & 15] += (ror (w15, 7) ^ ror (w15, 18) ^ (w15 >> 3)) + w[(i + 9) & 15]
+                 + (ror (w2, 17) ^ ror (w2, 19) ^ (w2 >> 10));
+    }
+    uint32_t t1 = s[7] + (ror (s[4], 6) ^ ror (s[4], 11) ^ ror (s[4], 25))
+                + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[i] + w[i & 15];
+    uint32_t t2 = (ror (s[0], 2) ^ ror (s[0], 13) ^ ror (s[0], 22))
+                + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+    memmove (s + 1, s, 7 * sizeof (uint32_t));
+    s[4] += t1;
+    s[0] = t1 + t2;
+  }
+  for (uint8_t i = 0; i < 8; i ++) {
+    state[i] += s[i];
+  }
+}
@@ -0,0 +1,50 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * digests of files for HASH, XCRC and XMD5: CRC-32, MD5, SHA-1 and SHA-256
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_HASH_H
+#define FTP_HASH_H
+
+#include <stdint.h>
+
+#define FTP_HASH_MAX_SIZE      32       // bytes of the longest digest (SHA-256)
+
+// Digest computed over data given in pieces of any size
+class FtpHash {
+  public:
+    enum Algorithm { CRC32, MD5, SHA1, SHA256, COUNT };
+
+    static const char * name (Algorithm algorithm);
+    static int8_t  find (const char * name);
+
+    void     begin (Algorithm algorithm);
+    void     update (const uint8_t * data, uint32_t length);
+    uint8_t  finish (uint8_t * digest);
+
+  private:
+    void     block ();
+    void     blockMd5 ();
+    void     blockSha1 ();
+    void     blockSha256 ();
+
+    Algorithm algorithm;
+    uint32_t state[8];
+    uint64_t length;                    // bytes hashed
+    uint8_t  data[64];                  // partial block
+};
+
+#endif // FTP_HASH_H
@@ -0,0 +1,253 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * index of the paths of the file system, kept in RAM
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FtpPathIndex.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_HEADER   11               // bytes of an entry before its path
+#define PATH_MAX_SIZE  264              // longest path indexed, FTP_CWD_SIZE included
+
+// Forget all entries; the index is built again on next lookup
+
+void FtpPathIndex::clear () {
+  free (entries);
+  entries = NULL;
+  used = allocated = 0;
+  nEntries = 0;
+  state = EMPTY;
+}
+
+// Look a path up
+//
+// parameters:
+//   path: absolute, without a final '/' (but the root)
+//   info: where to store the size, time and kind of the path, or NULL
+//
+// return:
+//    FOUND or MISSING, or UNKNOWN if the tree doesn't fit in the index
+
+FtpPathIndex::Result FtpPathIndex::find (FtpStorage &fsys, const char * path, FtpPathInfo * info) {
+  if (state == EMPTY) {
+    fs = &fsys;
+    if (!build ()) {
+      giveUp ();
+    }
+  }
+  if (state != READY) {
+    return UNKNOWN;
+  }
+  if (!strcmp (path, "/")) {
+    if (info != NULL) {
+      info->size = 0;
+      info->mtime = 0;
+      info->isDir = true;
+    }
+    return FOUND;
+  }
+  uint16_t length = strlen (path);
+  for (uint32_t offset = 0; offset < used; offset += entryLength (offset)) {
+    uint8_t * e = entries + offset;
+    if ((e[0] | e[1] << 8) == length && !memcmp (e + ENTRY_HEADER, path, length)) {
+      if (info != NULL) {
+        uint32_t mtime;
+        memcpy (&info->size, e + 3, 4);
+        memcpy (&mtime, e + 7, 4);
+        info->mtime = mtime;
+        info->isDir = e[2];
+      }
+      return FOUND;
+    }
+  }
+  return MISSING;
+}
+
+// Tell if something is known below a directory (false if the index is not built)
+
+bool FtpPathIndex::hasChildren (const char * dir) {
+  if (state != READY) {
+    return false;
+  }
+  uint16_t length = strlen (dir);
+  for (uint32_t offset = 0; offset < used; offset += entryLength (offset)) {
+    uint8_t * e = entries + offset;
+    if ((e[0] | e[1] << 8) > length && e[ENTRY_HEADER + length] == '/'
+        && !memcmp (e + ENTRY_HEADER, dir, length)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Bring the entry of a path, and those below it, up to date with the file system
+
+void FtpPathIndex::update (const char * path) {
+  if (state != READY) {
+    return;
+  }
+  if (!strcmp (path, "/")) {
+    clear ();
+    return;
+  }
+  remove (path);
+  FtpPathInfo info;
+  if (!fs->stat (path, &info)) {
+    return;
+  }
+  uint32_t offset = used;
+  bool ok = add (path, strlen (path), info.size, info.mtime, info.isDir);
+  if (!ok || !walk (offset)) {
+    giveUp ();
+  }
+}
+
+uint16_t FtpPathIndex::count () {
+  return nEntries;
+}
+
+// Bytes of RAM taken by the index
+
+uint32_t FtpPathIndex::footprint () {
+  return sizeof (* this) + allocated;
+}
+
+bool FtpPathIndex::build () {
+  used = 0;
+  nEntries = 0;
+  state = READY;
+  return walk (used);
+}
+
+// Add the content of the directories from offset to the end of the
+// entries, and of the directories found meanwhile; offset equal to the
+// end walks the root
+//
+// return:
+//    false, if the index is full
+
+bool FtpPathIndex::walk (uint32_t offset) {
+  char dir[PATH_MAX_SIZE];
+  bool root = offset == used;
+  while (root || offset < used) {
+    if (root) {
+      strcpy (dir, "/");
+    }
+    else {
+      uint8_t * e = entries + offset;
+      uint16_t length = e[0] | e[1] << 8;
+      offset += ENTRY_HEADER + length;
+      if (!e[2]) {
+        continue;
+      }
+      memcpy (dir, e + ENTRY_HEADER, length);
+      dir[length] = 0;
+    }
+    root = false;
+    FtpStorageFile * d = fs->openDir (dir);
+    if (d == NULL) {
+      continue;
+    }
+    FtpPathInfo info;
+    const char * name;
+    while ((name = d->next (&info)) != NULL) {
+      if (!addChild (dir, name, info.size, info.mtime, info.isDir)) {
+        delete d;
+        return false;
+      }
+    }
+    delete d;
+  }
+  return true;
+}
+
+// Add an entry found in directory dir
+
+bool FtpPathIndex::addChild (const char * dir, const char * name, uint32_t size, time_t mtime, bool isDir) {
+  char path[PATH_MAX_SIZE];
+  uint16_t dirLength = strcmp (dir, "/") ? strlen (dir) : 0;
+  uint16_t length = dirLength + 1 + strlen (name);
+  if (length >= PATH_MAX_SIZE) {
+    return false;
+  }
+  memcpy (path, dir, dirLength);
+  path[dirLength] = '/';
+  strcpy (path + dirLength + 1, name);
+  return add (path, length, size, mtime, isDir);
+}
+
+bool FtpPathIndex::add (const char * path, uint16_t length, uint32_t size, time_t mtime, bool isDir) {
+  uint32_t needed = used + ENTRY_HEADER + length;
+  if (needed > FTP_PATH_INDEX_SIZE) {
+    return false;
+  }
+  if (needed > allocated) {
+    uint32_t grown = allocated > 0 ? 2 * allocated : 1024;
+    grown = grown < needed ? needed : grown;
+    grown = grown > FTP_PATH_INDEX_SIZE ? FTP_PATH_INDEX_SIZE : grown;
+    uint8_t * p = (uint8_t *) realloc (entries, grown);
+    if (p == NULL) {
+      return false;
+    }
+    entries = p;
+    allocated = grown;
+  }
+  uint8_t * e = entries + used;
+  uint32_t mtime32 = mtime;
+  e[0] = length & 0xFF;
+  e[1] = length >> 8;
+  e[2] = isDir;
+  memcpy (e + 3, &size, 4);
+  memcpy (e + 7, &mtime32, 4);
+  memcpy (e + ENTRY_HEADER, path, length);
+  used = needed;
+  nEntries ++;
+  return true;
+}
+
+// Remove the entry of a path, and those below it
+
+void FtpPathIndex::remove (const char * path) {
+  uint16_t length = strlen (path);
+  uint32_t offset = 0;
+  while (offset < used) {
+    uint8_t * e = entries + offset;
+    uint16_t n = entryLength (offset);
+    uint16_t l = e[0] | e[1] << 8;
+    if (l >= length && !memcmp (e + ENTRY_HEADER, path, length)
+        && (l == length || e[ENTRY_HEADER + length] == '/')) {
+      memmove (e, e + n, used - offset - n);
+      used -= n;
+      nEntries --;
+    }
+    else {
+      offset += n;
+    }
+  }
+}
+
+uint16_t FtpPathIndex::entryLength (uint32_t offset) {
+  return ENTRY_HEADER + (entries[offset] | entries[offset + 1] << 8);
+}
+
+// The tree doesn't fit: free the entries, lookups go to the file system
+
+void FtpPathIndex::giveUp () {
+  clear ();
+  state = TOO_BIG;
+}
@@ -0,0 +1,68 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * index of the paths of the file system, kept in RAM
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_PATH_INDEX_H
+#define FTP_PATH_INDEX_H
+
+#include "FtpStorage.h"
+
+#ifndef FTP_PATH_INDEX_SIZE             // max bytes of RAM taken by the index: 11 per entry, plus its path
+#ifdef ESP8266
+#define FTP_PATH_INDEX_SIZE    8192
+#else
+#define FTP_PATH_INDEX_SIZE    32768
+#endif
+#endif
+
+// Paths of the file system with their size, time and kind, answering
+// exists/size/time lookups without going to the file system (a scan of
+// the whole of it on SPIFFS). Built on the first lookup by walking the
+// tree, and kept up to date by update () after each change. It gives up
+// (lookups answer UNKNOWN) if the tree doesn't fit in FTP_PATH_INDEX_SIZE.
+class FtpPathIndex {
+  public:
+    enum Result { UNKNOWN, MISSING, FOUND };
+
+    void     clear ();
+    Result   find (FtpStorage &fs, const char * path, FtpPathInfo * info = NULL);
+    bool     hasChildren (const char * dir);
+    void     update (const char * path);
+    uint16_t count ();
+    uint32_t footprint ();
+
+  private:
+    enum State { EMPTY, READY, TOO_BIG };
+
+    bool     build ();
+    bool     walk (uint32_t from);
+    bool     addChild (const char * dir, const char * name, uint32_t size, time_t mtime, bool isDir);
+    bool     add (const char * path, uint16_t length, uint32_t size, time_t mtime, bool isDir);
+    void     remove (const char * path);
+    uint16_t entryLength (uint32_t offset);
+    void     giveUp ();
+
+    uint8_t * entries = NULL;           // entries one after the other: length of path (2 bytes),
+                                        // isDir (1), size (4), mtime (4), path (no final 0)
+    uint32_t used = 0,                  // bytes of entries in use
+             allocated = 0;
+    uint16_t nEntries = 0;
+    State    state = EMPTY;
+    FtpStorage * fs = NULL;             // storage indexed
+};
+
+#endif // FTP_PATH_INDEX_H
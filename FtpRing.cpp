@@ -0,0 +1,81 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * ring buffer between one producer and one consumer, without locks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FtpRing.h"
+
+// Start an empty ring
+//
+// parameters:
+//   buffer, size: where the bytes are kept, size a power of 2
+//   position: of the first byte of the stream (its offset in the file)
+
+void FtpRing::begin (uint8_t * buf, uint32_t size, uint32_t position) {
+  buffer = buf;
+  mask = size - 1;
+  head.store (position, std::memory_order_relaxed);
+  tail.store (position, std::memory_order_release);
+}
+
+// Number of bytes written and not read yet
+
+uint32_t FtpRing::count () {
+  return head.load (std::memory_order_acquire) - tail.load (std::memory_order_acquire);
+}
+
+// Room for the producer
+//
+// return:
+//    where to write, and in length how many bytes fit there (0 if the ring is full)
+
+uint8_t * FtpRing::writeSpan (uint32_t * length) {
+  uint32_t h = head.load (std::memory_order_relaxed);
+  uint32_t free = mask + 1 - (h - tail.load (std::memory_order_acquire));
+  uint32_t end = mask + 1 - (h & mask);
+  * length = free < end ? free : end;
+  return buffer + (h & mask);
+}
+
+// Hand the bytes written in the span over to the consumer
+
+void FtpRing::commit (uint32_t length) {
+  head.store (head.load (std::memory_order_relaxed) + length, std::memory_order_release);
+}
+
+// Bytes for the consumer
+//
+// return:
+//    where they are, in length how many of them are contiguous (0 if the
+//    ring is empty), and in position the position of the first one
+
+uint8_t * FtpRing::readSpan (uint32_t * length, uint32_t * position) {
+  uint32_t t = tail.load (std::memory_order_relaxed);
+  uint32_t used = head.load (std::memory_order_acquire) - t;
+  uint32_t end = mask + 1 - (t & mask);
+  * length = used < end ? used : end;
+  if (position != NULL) {
+    * position = t;
+  }
+  return buffer + (t & mask);
+}
+
+// Give the bytes read from the span back to the producer
+
+void FtpRing::consume (uint32_t length) {
+  tail.store (tail.load (std::memory_order_relaxed) + length, std::memory_order_release);
+}
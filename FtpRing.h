@@ -0,0 +1,53 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * ring buffer between one producer and one consumer, without locks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_RING_H
+#define FTP_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Bytes passed from a task that writes them to another that reads them.
+// Each side works in place, on the longest run of contiguous bytes it
+// may use (a span), and then hands it over with commit () or consume ().
+// Positions count the bytes since the start of the stream, and run on
+// over the end of the buffer; a position is at the same place of the
+// buffer as the same offset in a file, so that spans that end at the end
+// of the buffer end on a block of the file too.
+class FtpRing {
+  public:
+    void      begin (uint8_t * buffer, uint32_t size, uint32_t position);
+    uint32_t  count ();
+
+    // producer
+    uint8_t * writeSpan (uint32_t * length);
+    void      commit (uint32_t length);
+
+    // consumer
+    uint8_t * readSpan (uint32_t * length, uint32_t * position = NULL);
+    void      consume (uint32_t length);
+
+  private:
+    uint8_t * buffer;
+    uint32_t  mask;                     // size - 1, size being a power of 2
+    std::atomic<uint32_t> head,         // position of the next byte written
+                          tail;         // position of the next byte read
+};
+
+#endif // FTP_RING_H
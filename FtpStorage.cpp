@@ -0,0 +1,391 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * storage served: the interface of the server to files and directories,
+ * with adapters for fs::FS and for POSIX
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FtpStorage.h"
+#include <string.h>
+#ifdef ESP32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#if FTP_POSIX_MMAP
+#include <sys/mman.h>
+#endif
+#endif
+
+#define REAL_PATH_SIZE 384              // longest path below the root of an FtpPosixStorage, root included
+
+// Last component of a path; some file systems give the full path of the
+// entries of a directory, others their name in it
+
+static const char * baseName (const char * name) {
+  const char * sep = strrchr (name, '/');
+  return sep != NULL ? sep + 1 : name;
+}
+
+/////////////////////////////////////////////////
+//                                             //
+//   fs::FS                                    //
+//                                             //
+/////////////////////////////////////////////////
+
+class FtpFsFile : public FtpStorageFile {
+  public:
+    FtpFsFile (File f) : f (f) {}
+    ~FtpFsFile () { f.close (); }
+
+    uint32_t read (uint8_t * buf, uint32_t length) override {
+      int32_t n = f.read (buf, length);
+      return n > 0 ? n : 0;
+    }
+    uint32_t write (const uint8_t * buf, uint32_t length) override { return f.write (buf, length); }
+    bool     seek (uint32_t position) override { return f.seek (position); }
+    uint32_t position () override { return f.position (); }
+    uint32_t size () override { return f.size (); }
+    time_t   lastWrite () override { return f.getLastWrite (); }
+
+  private:
+    File f;
+};
+
+// Entries of a directory, from Dir on ESP8266 and from openNextFile () on ESP32
+class FtpFsDir : public FtpStorageFile {
+  public:
+    #ifdef ESP8266
+    FtpFsDir (Dir d) : d (d) {}
+
+    const char * next (FtpPathInfo * info) override {
+      if (!d.next ()) {
+        return NULL;
+      }
+      name = d.fileName ();             // keeps the name until the next call
+      info->size = d.fileSize ();
+      info->mtime = d.fileTime ();
+      info->isDir = d.isDirectory ();
+      return baseName (name.c_str ());
+    }
+    #endif
+    #ifdef ESP32
+    FtpFsDir (File d) : d (d) {}
+    ~FtpFsDir () { d.close (); }
+
+    const char * next (FtpPathInfo * info) override {
+      entry = d.openNextFile ();        // keeps the name until the next call
+      if (!entry) {
+        return NULL;
+      }
+      info->size = entry.size ();
+      info->mtime = entry.getLastWrite ();
+      info->isDir = entry.isDirectory ();
+      return baseName (entry.name ());
+    }
+    #endif
+
+  private:
+    #ifdef ESP8266
+    Dir    d;
+    String name;
+    #endif
+    #ifdef ESP32
+    File   d,
+           entry;
+    #endif
+};
+
+FtpStorageFile * FtpFsStorage::open (const char * path, const char * mode) {
+  File f = fs->open (path, mode);
+  if (!f || f.isDirectory ()) {
+    f.close ();
+    return NULL;
+  }
+  return new FtpFsFile (f);
+}
+
+// On ESP8266, a directory that doesn't exist lists as empty
+
+FtpStorageFile * FtpFsStorage::openDir (const char * path) {
+  #ifdef ESP8266
+  return new FtpFsDir (fs->openDir (path));
+  #endif
+  #ifdef ESP32
+  File d = fs->open (path);
+  if (!d || !d.isDirectory ()) {
+    d.close ();
+    return NULL;
+  }
+  return new FtpFsDir (d);
+  #endif
+}
+
+bool FtpFsStorage::stat (const char * path, FtpPathInfo * info) {
+  if (info == NULL) {
+    return fs->exists (path);
+  }
+  File f = fs->open (path, "r");
+  if (!f) {
+    return false;
+  }
+  info->size = f.size ();
+  info->mtime = f.getLastWrite ();
+  info->isDir = f.isDirectory ();
+  f.close ();
+  return true;
+}
+
+bool FtpFsStorage::mkdir (const char * path) {
+  return fs->mkdir (path);
+}
+
+bool FtpFsStorage::rmdir (const char * path) {
+  return fs->rmdir (path);
+}
+
+bool FtpFsStorage::remove (const char * path) {
+  return fs->remove (path);
+}
+
+bool FtpFsStorage::rename (const char * from, const char * to) {
+  return fs->rename (from, to);
+}
+
+bool FtpFsStorage::setTime (const char * path, time_t mtime) {
+  return ftpSetFileTime (* fs, path, mtime);
+}
+
+#ifdef ESP32
+/////////////////////////////////////////////////
+//                                             //
+//   POSIX                                     //
+//                                             //
+/////////////////////////////////////////////////
+
+static void fillInfo (const struct stat & st, FtpPathInfo * info) {
+  info->size = st.st_size;
+  info->mtime = st.st_mtime;
+  info->isDir = S_ISDIR (st.st_mode);
+}
+
+// A file, read and written with pread () and pwrite () at the offset it keeps
+class FtpPosixFile : public FtpStorageFile {
+  public:
+    FtpPosixFile (int fd, uint32_t offset, bool readOnly) : fd (fd), offset (offset), readOnly (readOnly) {}
+    ~FtpPosixFile () {
+      #if FTP_POSIX_MMAP
+      if (map != NULL && map != MAP_FAILED) {
+        munmap (map, mapSize);
+      }
+      #endif
+      close (fd);
+    }
+
+    uint32_t read (uint8_t * buf, uint32_t length) override {
+      ssize_t n = pread (fd, buf, length, offset);
+      if (n <= 0) {
+        return 0;
+      }
+      offset += n;
+      return n;
+    }
+
+    uint32_t write (const uint8_t * buf, uint32_t length) override {
+      ssize_t n = pwrite (fd, buf, length, offset);
+      if (n <= 0) {
+        return 0;
+      }
+      offset += n;
+      return n;
+    }
+
+    bool seek (uint32_t position) override {
+      offset = position;
+      return true;
+    }
+
+    uint32_t position () override {
+      return offset;
+    }
+
+    uint32_t size () override {
+      struct stat st;
+      return fstat (fd, &st) == 0 ? st.st_size : 0;
+    }
+
+    time_t lastWrite () override {
+      struct stat st;
+      return fstat (fd, &st) == 0 ? st.st_mtime : 0;
+    }
+
+    // The file is mapped on the first call, if it was opened for reading
+    const uint8_t * borrow (uint32_t * length) override {
+      #if FTP_POSIX_MMAP
+      if (map == NULL) {
+        mapSize = readOnly ? size () : 0;
+        map = mapSize > 0 ? mmap (NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+      }
+      if (map == MAP_FAILED) {
+        return NULL;
+      }
+      * length = offset < mapSize ? mapSize - offset : 0;
+      return (const uint8_t *) map + offset;
+      #else
+      return NULL;
+      #endif
+    }
+
+    void release (uint32_t length) override {
+      offset += length;
+    }
+
+  private:
+    int      fd;
+    uint32_t offset;
+    bool     readOnly;                  // opened with "r": can be mapped
+    #if FTP_POSIX_MMAP
+    void *   map = NULL;
+    uint32_t mapSize = 0;
+    #endif
+};
+
+// Entries of a directory, with their size and time from stat ()
+class FtpPosixDir : public FtpStorageFile {
+  public:
+    FtpPosixDir (DIR * d, const char * dir) : d (d) {
+      strcpy (real, dir);
+      length = strlen (real);
+      real[length ++] = '/';
+    }
+    ~FtpPosixDir () { closedir (d); }
+
+    const char * next (FtpPathInfo * info) override {
+      struct dirent * e;
+      while ((e = readdir (d)) != NULL) {
+        if (!strcmp (e->d_name, ".") || !strcmp (e->d_name, "..")
+            || length + strlen (e->d_name) >= REAL_PATH_SIZE) {
+          continue;
+        }
+        strcpy (real + length, e->d_name);
+        struct stat st;
+        if (::stat (real, &st) == 0) {
+          fillInfo (st, info);
+          return e->d_name;
+        }
+      }
+      return NULL;
+    }
+
+  private:
+    DIR *    d;
+    char     real[REAL_PATH_SIZE];      // path of the entry, from the directory on
+    uint16_t length;                    // length of the directory, its final '/' included
+};
+
+// Path on the POSIX file system of a path served
+//
+// return:
+//    false, if it is too long or has a ".." component, that could take
+//    it out of the root
+
+bool FtpPosixStorage::realPath (char * real, const char * path) {
+  for (const char * p = strstr (path, ".."); p != NULL; p = strstr (p + 2, "..")) {
+    if ((p == path || p[-1] == '/') && (p[2] == 0 || p[2] == '/')) {
+      return false;
+    }
+  }
+  uint16_t rootLength = strlen (root);
+  if (!strcmp (path, "/")) {
+    path = "";
+  }
+  if (rootLength + strlen (path) >= REAL_PATH_SIZE) {
+    return false;
+  }
+  strcpy (real, root);
+  strcpy (real + rootLength, path);
+  return true;
+}
+
+FtpStorageFile * FtpPosixStorage::open (const char * path, const char * mode) {
+  char real[REAL_PATH_SIZE];
+  if (!realPath (real, path)) {
+    return NULL;
+  }
+  int flags = mode[0] == 'w' ? O_WRONLY | O_CREAT | O_TRUNC
+            : mode[0] == 'a' ? O_WRONLY | O_CREAT | O_APPEND
+            : mode[1] == '+' ? O_RDWR : O_RDONLY;
+  int fd = ::open (real, flags, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat (fd, &st) != 0 || S_ISDIR (st.st_mode)) {
+    close (fd);
+    return NULL;
+  }
+  return new FtpPosixFile (fd, mode[0] == 'a' ? st.st_size : 0, flags == O_RDONLY);
+}
+
+FtpStorageFile * FtpPosixStorage::openDir (const char * path) {
+  char real[REAL_PATH_SIZE];
+  if (!realPath (real, path)) {
+    return NULL;
+  }
+  DIR * d = opendir (real);
+  return d != NULL ? new FtpPosixDir (d, real) : NULL;
+}
+
+bool FtpPosixStorage::stat (const char * path, FtpPathInfo * info) {
+  char real[REAL_PATH_SIZE];
+  struct stat st;
+  if (!realPath (real, path) || ::stat (real, &st) != 0) {
+    return false;
+  }
+  if (info != NULL) {
+    fillInfo (st, info);
+  }
+  return true;
+}
+
+bool FtpPosixStorage::mkdir (const char * path) {
+  char real[REAL_PATH_SIZE];
+  return realPath (real, path) && ::mkdir (real, 0755) == 0;
+}
+
+bool FtpPosixStorage::rmdir (const char * path) {
+  char real[REAL_PATH_SIZE];
+  return realPath (real, path) && ::rmdir (real) == 0;
+}
+
+bool FtpPosixStorage::remove (const char * path) {
+  char real[REAL_PATH_SIZE];
+  return realPath (real, path) && unlink (real) == 0;
+}
+
+bool FtpPosixStorage::rename (const char * from, const char * to) {
+  char realFrom[REAL_PATH_SIZE];
+  char realTo[REAL_PATH_SIZE];
+  return realPath (realFrom, from) && realPath (realTo, to) && ::rename (realFrom, realTo) == 0;
+}
+
+bool FtpPosixStorage::setTime (const char * path, time_t mtime) {
+  char real[REAL_PATH_SIZE];
+  struct utimbuf times = { mtime, mtime };
+  return realPath (real, path) && utime (real, &times) == 0;
+}
+#endif
@@ -0,0 +1,144 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * storage served: the interface of the server to files and directories,
+ * with adapters for fs::FS and for POSIX
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_STORAGE_H
+#define FTP_STORAGE_H
+
+#include <FS.h>
+#include <errno.h>
+#include <time.h>
+
+#ifndef FTP_POSIX_MMAP                  // 1 if the C library maps files in memory (mmap ()), so that
+#ifdef __linux__                        // FtpPosixStorage lends the bytes of a file to the socket
+#define FTP_POSIX_MMAP     1
+#else
+#define FTP_POSIX_MMAP     0
+#endif
+#endif
+
+// Kind, size and time of a file or directory
+struct FtpPathInfo {
+  uint32_t size;
+  time_t   mtime;
+  bool     isDir;
+};
+
+// A file, or a directory being listed, opened by an FtpStorage; the
+// server deletes it to close it
+class FtpStorageFile {
+  public:
+    virtual ~FtpStorageFile () {}
+
+    // file: read () and write () return the number of bytes moved, 0 at
+    // the end of the file or on error; size () is UINT32_MAX if it is not
+    // known in advance (a file made as it is read)
+    virtual uint32_t read (uint8_t * buf, uint32_t length) { return 0; }
+    virtual uint32_t write (const uint8_t * buf, uint32_t length) { return 0; }
+    virtual bool     seek (uint32_t position) { return false; }
+    virtual uint32_t position () { return 0; }
+    virtual uint32_t size () { return 0; }
+    virtual time_t   lastWrite () { return 0; }
+    // why write () took less bytes than given, for the reply to STOR;
+    // NULL if the file system is the cause (full, or can't create a file)
+    virtual const char * error () { return NULL; }
+
+    // Lend the bytes from the position on, in place, where the storage
+    // holds them in memory (RAM, mapped flash or file): the server sends
+    // them without copying them, then moves the position with release ().
+    // Returns NULL if the storage can't, and a length of 0 at the end.
+    virtual const uint8_t * borrow (uint32_t * length) { return NULL; }
+    virtual void     release (uint32_t length) {}
+
+    // directory: name of the next entry, valid until the next call, or NULL
+    virtual const char * next (FtpPathInfo * info) { return NULL; }
+};
+
+// Files and directories served, by their absolute path ("/dir/file")
+class FtpStorage {
+  public:
+    virtual ~FtpStorage () {}
+    // mode: "r", "r+", "w" or "a", as for fopen (); NULL if it can't be
+    // opened, or is a directory
+    virtual FtpStorageFile * open (const char * path, const char * mode) = 0;
+    // entries of a directory; NULL if it can't be listed
+    virtual FtpStorageFile * openDir (const char * path) = 0;
+    // false, if the path doesn't exist; info may be NULL
+    virtual bool stat (const char * path, FtpPathInfo * info) = 0;
+    virtual bool mkdir (const char * path) = 0;
+    virtual bool rmdir (const char * path) = 0;
+    virtual bool remove (const char * path) = 0;
+    virtual bool rename (const char * from, const char * to) = 0;
+    // modification time, for MFMT; false if not done, errno being ENOTSUP
+    // if the storage can't set it
+    virtual bool setTime (const char * path, time_t mtime) { errno = ENOTSUP; return false; }
+};
+
+// Storage on an fs::FS of the core (SPIFFS, LittleFS, SD, SD_MMC, FFat)
+class FtpFsStorage : public FtpStorage {
+  public:
+    FtpFsStorage (fs::FS * fs = NULL) : fs (fs) {}
+    void setFS (fs::FS &fsys) { fs = &fsys; }
+
+    FtpStorageFile * open (const char * path, const char * mode) override;
+    FtpStorageFile * openDir (const char * path) override;
+    bool stat (const char * path, FtpPathInfo * info) override;
+    bool mkdir (const char * path) override;
+    bool rmdir (const char * path) override;
+    bool remove (const char * path) override;
+    bool rename (const char * from, const char * to) override;
+    bool setTime (const char * path, time_t mtime) override;
+
+  private:
+    fs::FS * fs;
+};
+
+#ifdef ESP32
+// Storage in a directory of the POSIX file system: on ESP32 where an FS
+// is mounted in the VFS ("/littlefs", "/sdcard"...), on Linux any one
+class FtpPosixStorage : public FtpStorage {
+  public:
+    FtpPosixStorage (const char * root) : root (root) {}
+
+    FtpStorageFile * open (const char * path, const char * mode) override;
+    FtpStorageFile * openDir (const char * path) override;
+    bool stat (const char * path, FtpPathInfo * info) override;
+    bool mkdir (const char * path) override;
+    bool rmdir (const char * path) override;
+    bool remove (const char * path) override;
+    bool rename (const char * from, const char * to) override;
+    bool setTime (const char * path, time_t mtime) override;
+
+  private:
+    bool realPath (char * real, const char * path);
+
+    const char * root;                  // kept by the caller
+};
+#endif
+
+// Set the modification time of a file of an fs::FS, for MFMT. The library
+// defines it weak (in ESPFtpServer.cpp): on ESP8266 through the time
+// callback of the FS (LittleFS stamps files when they are closed), that
+// is then set back to the default of the core, returning time (NULL); on
+// ESP32 with utime () on the file below FTP_VFS_MOUNT, failing with errno
+// ENOTSUP if it isn't there, so that MFMT answers it is not supported. An
+// application can define it for another file system, or to restore a time
+// callback of its own.
+bool ftpSetFileTime (fs::FS &fs, const char * path, time_t mtime);
+
+#endif // FTP_STORAGE_H
@@ -0,0 +1,458 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * virtual tar archives: a directory read as a tar file, and a tar file
+ * written as the files it holds
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FtpTar.h"
+#include <string.h>
+
+// Fields of a ustar header: offset of each
+#define TAR_NAME       0                // 100 bytes
+#define TAR_MODE       100              // 8
+#define TAR_UID        108              // 8
+#define TAR_GID        116              // 8
+#define TAR_SIZE       124              // 12
+#define TAR_MTIME      136              // 12
+#define TAR_CHKSUM     148              // 8
+#define TAR_TYPE       156              // 1
+#define TAR_MAGIC      257              // 6, then version (2)
+#define TAR_PREFIX     345              // 155
+
+static uint32_t least (uint32_t a, uint32_t b) {
+  return a < b ? a : b;
+}
+
+static bool endsWithTar (const char * path, uint16_t length) {
+  return length > 4 && !strcmp (path + length - 4, ".tar");
+}
+
+// Write value in octal, on width - 1 digits and a final 0
+
+static void putOctal (uint8_t * field, uint8_t width, uint32_t value) {
+  field[-- width] = 0;
+  while (width > 0) {
+    field[-- width] = '0' + (value & 7);
+    value >>= 3;
+  }
+}
+
+// Read a value in octal, after the spaces or NULs that some writers put
+// before its digits (GNU and BSD tar pad the checksum so)
+
+static uint32_t getOctal (const uint8_t * field, uint8_t width) {
+  uint32_t value = 0;
+  uint8_t i = 0;
+  while (i < width && (field[i] == ' ' || field[i] == 0)) {
+    i ++;
+  }
+  for ( ; i < width && field[i] >= '0' && field[i] <= '7'; i ++) {
+    value = value << 3 | (field[i] - '0');
+  }
+  return value;
+}
+
+// Sum of the bytes of a header, its checksum field counted as spaces
+
+static uint32_t checksum (const uint8_t * header) {
+  uint32_t sum = 0;
+  for (uint16_t i = 0; i < FTP_TAR_BLOCK; i ++) {
+    sum += i >= TAR_CHKSUM && i < TAR_CHKSUM + 8 ? ' ' : header[i];
+  }
+  return sum;
+}
+
+// Fill a ustar header
+//
+// return:
+//    false, if the name doesn't fit in the name and prefix fields
+
+static bool makeHeader (uint8_t * header, const char * name, const FtpPathInfo & info) {
+  uint16_t length = strlen (name);
+  uint16_t split = 0;                  // length of the prefix, 0 if the name fits in its field
+  if (length > 100) {
+    for (split = length - 101; split < length - 1 && (name[split] != '/' || split == 0); split ++) {
+    }
+    if (split >= length - 1 || split > 155) {
+      return false;
+    }
+  }
+  memset (header, 0, FTP_TAR_BLOCK);
+  if (split == 0) {
+    memcpy (header + TAR_NAME, name, length);
+  }
+  else {
+    memcpy (header + TAR_PREFIX, name, split);
+    memcpy (header + TAR_NAME, name + split + 1, length - split - 1);
+  }
+  putOctal (header + TAR_MODE, 8, info.isDir ? 0755 : 0644);
+  putOctal (header + TAR_UID, 8, 0);
+  putOctal (header + TAR_GID, 8, 0);
+  putOctal (header + TAR_SIZE, 12, info.isDir ? 0 : info.size);
+  putOctal (header + TAR_MTIME, 12, info.mtime > 0 ? info.mtime : 0);
+  header[TAR_TYPE] = info.isDir ? '5' : '0';
+  memcpy (header + TAR_MAGIC, "ustar\0" "00", 8);
+  putOctal (header + TAR_CHKSUM, 7, checksum (header));
+  header[TAR_CHKSUM + 7] = ' ';
+  return true;
+}
+
+/////////////////////////////////////////////////
+//                                             //
+//   RETR <dir>.tar                            //
+//                                             //
+/////////////////////////////////////////////////
+
+// Archive of the directory of a path ending with .tar ("/logs.tar" for
+// /logs, "/.tar" for the root)
+//
+// return:
+//    NULL, if the path doesn't end with .tar or there is no such directory
+
+FtpTarReader * FtpTarReader::open (FtpStorage &fs, const char * archive) {
+  uint16_t length = strlen (archive);
+  FtpPathInfo info;
+  if (!endsWithTar (archive, length) || length - 4 >= FTP_TAR_PATH_SIZE
+      || (length > 5 && archive[length - 5] == '/')) {
+    return NULL;
+  }
+  FtpTarReader * r = new FtpTarReader (fs);
+  memcpy (r->path, archive, length - 4);
+  r->path[length - 4] = 0;
+  const char * dir = length == 5 ? "/" : r->path;
+  if (!fs.stat (dir, &info) || !info.isDir || (r->dirs[0] = fs.openDir (dir)) == NULL) {
+    delete r;
+    return NULL;
+  }
+  r->depth = 1;
+  r->dirLengths[0] = length == 5 ? 0 : length - 4;
+  r->mtime = info.mtime;
+  if (length == 5) {                   // the root: members named from it on
+    r->nameStart = 1;
+  }
+  else {                               // the directory is the first member
+    r->nameStart = strrchr (r->path, '/') - r->path + 1;
+    char name[FTP_TAR_PATH_SIZE + 1];
+    strcpy (name, r->path + r->nameStart);
+    strcat (name, "/");
+    if (makeHeader (r->header, name, info)) {
+      r->headerLeft = FTP_TAR_BLOCK;
+    }
+  }
+  return r;
+}
+
+FtpTarReader::~FtpTarReader () {
+  delete file;
+  while (depth > 0) {
+    delete dirs[-- depth];
+  }
+}
+
+uint32_t FtpTarReader::read (uint8_t * buf, uint32_t length) {
+  uint32_t n = 0;
+  while (n < length) {
+    uint32_t m = length - n;
+    if (headerLeft > 0) {
+      m = least (m, headerLeft);
+      memcpy (buf + n, header + FTP_TAR_BLOCK - headerLeft, m);
+      headerLeft -= m;
+    }
+    else if (dataLeft > 0) {
+      m = file->read (buf + n, least (m, dataLeft));
+      if (m == 0) {                    // shorter than when its header was made
+        m = least (length - n, dataLeft);
+        memset (buf + n, 0, m);
+      }
+      dataLeft -= m;
+    }
+    else if (zerosLeft > 0) {
+      m = least (m, zerosLeft);
+      memset (buf + n, 0, m);
+      zerosLeft -= m;
+    }
+    else if (ended || !nextEntry ()) {
+      break;
+    }
+    else {
+      m = 0;
+    }
+    n += m;
+  }
+  offset += n;
+  return n;
+}
+
+// Get the next member ready: its header, its file and its padding, or
+// the end of the archive
+//
+// return:
+//    false, once the end of the archive is read
+
+bool FtpTarReader::nextEntry () {
+  delete file;
+  file = NULL;
+  if (ended) {
+    return false;
+  }
+  FtpPathInfo info;
+  while (walk (&info) != NULL) {
+    char name[FTP_TAR_PATH_SIZE + 1];
+    strcpy (name, path + nameStart);
+    if (info.isDir) {
+      strcat (name, "/");
+    }
+    else {
+      if ((file = fs.open (path, "r")) == NULL) {
+        continue;
+      }
+      info.size = file->size ();
+    }
+    if (makeHeader (header, name, info)) {
+      headerLeft = FTP_TAR_BLOCK;
+      dataLeft = info.isDir ? 0 : info.size;
+      zerosLeft = (FTP_TAR_BLOCK - dataLeft % FTP_TAR_BLOCK) % FTP_TAR_BLOCK;
+      return true;
+    }
+    delete file;
+    file = NULL;
+  }
+  ended = true;
+  zerosLeft = 2 * FTP_TAR_BLOCK;       // end of archive: two empty headers
+  return true;
+}
+
+// Next entry of the tree, depth first, its path in path
+//
+// return:
+//    the path, or NULL when the whole tree is walked
+
+const char * FtpTarReader::walk (FtpPathInfo * info) {
+  while (depth > 0) {
+    uint16_t length = dirLengths[depth - 1];
+    path[length] = 0;
+    const char * name = dirs[depth - 1]->next (info);
+    if (name == NULL) {
+      delete dirs[-- depth];
+      continue;
+    }
+    if (length + 1 + strlen (name) >= FTP_TAR_PATH_SIZE) {
+      continue;
+    }
+    path[length] = '/';
+    strcpy (path + length + 1, name);
+    if (info->isDir && depth < FTP_TAR_DEPTH && (dirs[depth] = fs.openDir (path)) != NULL) {
+      dirLengths[depth ++] = strlen (path);
+    }
+    return path;
+  }
+  return NULL;
+}
+
+/////////////////////////////////////////////////
+//                                             //
+//   STOR /.untar/<dir>/<name>.tar             //
+//                                             //
+/////////////////////////////////////////////////
+
+// Tell if a path names an archive to extract, below FTP_TAR_EXTRACT_DIR,
+// and where to
+//
+// parameters:
+//   archive: absolute path given to STOR
+//   dir: where to store the directory to extract into, of FTP_TAR_PATH_SIZE bytes
+//
+// return:
+//    false, if the path is not below FTP_TAR_EXTRACT_DIR or doesn't end with .tar
+
+bool FtpTarWriter::target (const char * archive, char * dir) {
+  uint16_t prefix = strlen (FTP_TAR_EXTRACT_DIR);
+  uint16_t length = strlen (archive);
+  if (strncmp (archive, FTP_TAR_EXTRACT_DIR, prefix) || archive[prefix] != '/'
+      || !endsWithTar (archive, length)) {
+    return false;
+  }
+  const char * last = strrchr (archive, '/');
+  if (last == archive + prefix) {
+    strcpy (dir, "/");
+  }
+  else {
+    memcpy (dir, archive + prefix, last - archive - prefix);
+    dir[last - archive - prefix] = 0;
+  }
+  return true;
+}
+
+// Extraction into a directory
+//
+// return:
+//    NULL, if it is not a directory
+
+FtpTarWriter * FtpTarWriter::open (FtpStorage &fs, const char * dir) {
+  FtpPathInfo info;
+  if (!fs.stat (dir, &info) || !info.isDir) {
+    return NULL;
+  }
+  FtpTarWriter * w = new FtpTarWriter (fs);
+  w->dirLength = strcmp (dir, "/") ? strlen (dir) : 0;
+  memcpy (w->path, dir, w->dirLength);
+  w->path[w->dirLength] = 0;
+  strcpy (w->made, w->path);
+  return w;
+}
+
+FtpTarWriter::~FtpTarWriter () {
+  delete file;
+}
+
+uint32_t FtpTarWriter::write (const uint8_t * buf, uint32_t length) {
+  uint32_t n = 0;
+  while (n < length && zeroBlocks < 2 && !corrupt) {
+    uint32_t m = length - n;
+    if (dataLeft > 0) {
+      m = least (m, dataLeft);
+      if (file != NULL && file->write (buf + n, m) != m) {
+        break;
+      }
+      dataLeft -= m;
+      if (dataLeft == 0) {
+        delete file;
+        file = NULL;
+      }
+    }
+    else if (padLeft > 0) {
+      m = least (m, padLeft);
+      padLeft -= m;
+    }
+    else {
+      m = least (m, FTP_TAR_BLOCK - headerFill);
+      memcpy (header + headerFill, buf + n, m);
+      headerFill += m;
+      if (headerFill == FTP_TAR_BLOCK) {
+        headerFill = 0;
+        if (!beginMember ()) {
+          break;
+        }
+      }
+    }
+    n += m;
+  }
+  if (zeroBlocks >= 2) {               // what follows the end of the archive is ignored
+    n = length;
+  }
+  offset += n;
+  return n;
+}
+
+// Make the directory or open the file of the header just received
+//
+// return:
+//    false, if the header is corrupt or the file can't be created
+
+bool FtpTarWriter::beginMember () {
+  uint16_t i;
+  for (i = 0; i < FTP_TAR_BLOCK && header[i] == 0; i ++) {
+  }
+  if (i == FTP_TAR_BLOCK) {
+    zeroBlocks ++;
+    return true;
+  }
+  zeroBlocks = 0;
+  if (getOctal (header + TAR_CHKSUM, 8) != checksum (header)) {
+    corrupt = true;
+    return false;
+  }
+  dataLeft = getOctal (header + TAR_SIZE, 12);
+  padLeft = (FTP_TAR_BLOCK - dataLeft % FTP_TAR_BLOCK) % FTP_TAR_BLOCK;
+  char type = header[TAR_TYPE];
+  if (type != '0' && type != 0 && type != '7' && type != '5') {
+    return true;                       // links, extended headers...: skipped
+  }
+
+  // name: prefix/name, without "/" or "./" at its beginning nor "/" at its end
+  char name[FTP_TAR_PATH_SIZE];
+  uint16_t length = 0;
+  if (!memcmp (header + TAR_MAGIC, "ustar", 5) && header[TAR_PREFIX] != 0) {
+    length = strnlen ((char *) header + TAR_PREFIX, 155);
+    memcpy (name, header + TAR_PREFIX, length);
+    name[length ++] = '/';
+  }
+  uint16_t nameLength = strnlen ((char *) header + TAR_NAME, 100);
+  memcpy (name + length, header + TAR_NAME, nameLength);
+  length += nameLength;
+  name[length] = 0;
+  const char * p = name;
+  while (* p == '/' || (p[0] == '.' && p[1] == '/')) {
+    p += * p == '/' ? 1 : 2;
+  }
+  length -= p - name;
+  while (length > 0 && p[length - 1] == '/') {
+    length --;
+  }
+  if (length == 0 || dirLength + 1 + length >= FTP_TAR_PATH_SIZE) {
+    return true;
+  }
+  for (const char * c = p; c < p + length; c ++) {
+    if (c[0] == '.' && c[1] == '.' && (c == p || c[-1] == '/') && (c + 2 == p + length || c[2] == '/')) {
+      return true;                     // "..": out of the directory
+    }
+  }
+  path[dirLength] = '/';
+  memcpy (path + dirLength + 1, p, length);
+  length += dirLength + 1;
+  path[length] = 0;
+
+  if (type == '5') {
+    makeDirs (length);
+    return true;
+  }
+  makeDirs (strrchr (path, '/') - path);
+  file = fs.open (path, "w");
+  if (file == NULL) {
+    return false;
+  }
+  if (dataLeft == 0) {
+    delete file;
+    file = NULL;
+  }
+  return true;
+}
+
+// Make the directories of the first length bytes of path, below the
+// directory extracted to; those that can't be made show when their
+// files are created
+
+void FtpTarWriter::makeDirs (uint16_t length) {
+  if (length <= dirLength || (strlen (made) == length && !strncmp (made, path, length))) {
+    return;
+  }
+  char end = path[length];
+  path[length] = 0;
+  for (uint16_t i = dirLength + 1; i <= length; i ++) {
+    if (path[i] == '/' || path[i] == 0) {
+      char c = path[i];
+      path[i] = 0;
+      FtpPathInfo info;
+      if (!fs.stat (path, &info)) {
+        fs.mkdir (path);
+      }
+      path[i] = c;
+    }
+  }
+  strcpy (made, path);
+  path[length] = end;
+}
@@ -0,0 +1,111 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * virtual tar archives: a directory read as a tar file, and a tar file
+ * written as the files it holds
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_TAR_H
+#define FTP_TAR_H
+
+#include "FtpStorage.h"
+#include <stdint.h>
+
+#ifndef FTP_TAR_DEPTH                   // levels of subdirectories put in an archive, deeper ones are left out;
+#define FTP_TAR_DEPTH      4            // each level holds a directory open while it is archived
+#endif
+#ifndef FTP_TAR_EXTRACT_DIR             // STOR <FTP_TAR_EXTRACT_DIR>/<dir>/<name>.tar extracts the archive
+#define FTP_TAR_EXTRACT_DIR "/.untar"   // into <dir>, as the one of RETR <dir>/<name>.tar was made
+#endif
+
+#define FTP_TAR_PATH_SIZE  264          // longest path archived or extracted, FTP_CWD_SIZE included
+#define FTP_TAR_BLOCK      512          // size of a header, and unit of the data of a file
+
+// A directory, with its files and subdirectories, read as a tar archive
+// (POSIX ustar), made as it is read: the directories are walked one
+// entry at a time, and each file is read when its turn comes, so that it
+// takes the same RAM whatever the size of the tree. Members are named
+// from the directory on ("logs/a.txt" for /logs), the whole file system
+// being archived from the root. The size of the archive is not known in
+// advance (size () returns UINT32_MAX), and it can only be read from
+// the beginning.
+class FtpTarReader : public FtpStorageFile {
+  public:
+    static FtpTarReader * open (FtpStorage &fs, const char * archive);
+    ~FtpTarReader ();
+
+    uint32_t read (uint8_t * buf, uint32_t length) override;
+    bool     seek (uint32_t position) override { return position == offset; }
+    uint32_t position () override { return offset; }
+    uint32_t size () override { return UINT32_MAX; }
+    time_t   lastWrite () override { return mtime; }
+
+  private:
+    FtpTarReader (FtpStorage &fs) : fs (fs) {}
+    bool     nextEntry ();
+    const char * walk (FtpPathInfo * info);
+
+    FtpStorage & fs;
+    FtpStorageFile * dirs[FTP_TAR_DEPTH] = {}; // directories being walked, the deepest last
+    uint16_t dirLengths[FTP_TAR_DEPTH];  // length of their path
+    uint8_t  depth = 0;                 // number of dirs open
+    uint16_t nameStart;                 // offset in path of the names of the members
+    char     path[FTP_TAR_PATH_SIZE];   // member being archived
+    FtpStorageFile * file = NULL;       // file being archived
+    uint8_t  header[FTP_TAR_BLOCK];
+    uint16_t headerLeft = 0;            // bytes of header not read yet
+    uint32_t dataLeft = 0,              // bytes of the file not read yet
+             zerosLeft = 0,             // padding of the file, or the end of the archive
+             offset = 0;                // position in the archive
+    time_t   mtime = 0;                 // of the directory
+    bool     ended = false;             // all members are archived
+};
+
+// A tar archive written as it arrives: its directories and files are
+// made below a directory, the other members (links, extended headers)
+// being skipped, as are members named outside of the directory (with
+// ".."). write () takes less bytes than given when the archive is
+// corrupt, error () then telling so, or a file can't be written.
+class FtpTarWriter : public FtpStorageFile {
+  public:
+    static bool target (const char * archive, char * dir);
+    static FtpTarWriter * open (FtpStorage &fs, const char * dir);
+    ~FtpTarWriter ();
+
+    uint32_t write (const uint8_t * buf, uint32_t length) override;
+    uint32_t position () override { return offset; }
+    uint32_t size () override { return offset; }
+    const char * error () override { return corrupt ? "Bad tar header" : NULL; }
+
+  private:
+    FtpTarWriter (FtpStorage &fs) : fs (fs) {}
+    bool     beginMember ();
+    void     makeDirs (uint16_t length);
+
+    FtpStorage & fs;
+    uint16_t dirLength;                 // length of the directory extracted to, in path
+    char     path[FTP_TAR_PATH_SIZE];   // member being extracted
+    char     made[FTP_TAR_PATH_SIZE];   // last directory known to exist
+    FtpStorageFile * file = NULL;       // file being extracted, NULL if skipped
+    uint8_t  header[FTP_TAR_BLOCK];
+    uint16_t headerFill = 0;            // bytes of header received
+    uint32_t dataLeft = 0,              // bytes of the member not received yet
+             padLeft = 0,
+             offset = 0;                // bytes of the archive received
+    uint8_t  zeroBlocks = 0;            // empty headers in a row, 2 end the archive
+    bool     corrupt = false;           // a header was wrong: nothing more is taken
+};
+
+#endif // FTP_TAR_H
@@ -0,0 +1,534 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * zlib streams (RFC 1950/1951) for MODE Z, in bounded memory
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "FtpZlib.h"
+#include <string.h>
+
+// Base and extra bits of the length codes 257..285, and of the distance codes
+
+static const uint16_t lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t  lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t  distExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Adler-32 checksum of the uncompressed data (RFC 1950)
+
+uint32_t ftpAdler32 (uint32_t adler, const uint8_t * data, uint32_t length) {
+  uint32_t a = adler & 0xFFFF, b = adler >> 16;
+  while (length > 0) {
+    uint32_t n = length < 5552 ? length : 5552;  // no overflow before the modulo
+    length -= n;
+    while (n --) {
+      a += * data ++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+static uint8_t highBit (uint32_t v) {
+  uint8_t n = 0;
+  while (v >>= 1) {
+    n ++;
+  }
+  return n;
+}
+
+/*******************************************************************************
+ **                                 DEFLATE                                    **
+ *******************************************************************************/
+
+void FtpDeflate::begin () {
+  memset (head, 0, sizeof (head));
+  memset (prev, 0, sizeof (prev));
+  nWindow = 0;
+  adler = 1;
+  bitBuf = 0;
+  bitCount = 0;
+  started = false;
+}
+
+// Compress length bytes (at most FTP_ZLIB_WINDOW) into out, that must hold
+// FTP_ZLIB_BOUND (length) bytes. Each call makes a block, that may refer
+// to the data of the previous ones; last ends the stream.
+//
+// return:
+//    number of bytes written to out
+
+uint16_t FtpDeflate::compress (const uint8_t * data, uint16_t length, uint8_t * outBuf, bool last) {
+  out = outBuf;
+  nOut = 0;
+  if (!started) {
+    // zlib header: deflate, window size, no dictionary, check bits
+    uint16_t header = ((FTP_ZLIB_WINDOW_BITS - 8) << 12 | 8 << 8);
+    header += 31 - header % 31;
+    out[nOut ++] = header >> 8;
+    out[nOut ++] = header & 0xFF;
+    started = true;
+  }
+  if (length > FTP_ZLIB_WINDOW) {
+    length = FTP_ZLIB_WINDOW;
+  }
+
+  if (length > 0) {
+    adler = ftpAdler32 (adler, data, length);
+    if (nWindow + length > 2 * FTP_ZLIB_WINDOW) {
+      // slide the window by half, with the positions in the hash chains
+      memmove (window, window + FTP_ZLIB_WINDOW, nWindow - FTP_ZLIB_WINDOW);
+      nWindow -= FTP_ZLIB_WINDOW;
+      for (uint16_t i = 0; i < FTP_ZLIB_WINDOW; i ++) {
+        head[i] = head[i] > FTP_ZLIB_WINDOW ? head[i] - FTP_ZLIB_WINDOW : 0;
+        prev[i] = prev[i] > FTP_ZLIB_WINDOW ? prev[i] - FTP_ZLIB_WINDOW : 0;
+      }
+    }
+    memcpy (window + nWindow, data, length);
+
+    putBits (1 << 1, 3);               // not last, fixed Huffman codes
+    uint16_t pos = nWindow, end = nWindow + length;
+    while (pos < end) {
+      uint16_t bestLength = 0, bestDistance = 0;
+      if (end - pos >= 3) {
+        uint16_t h = hash (window + pos);
+        uint16_t maxLength = end - pos < 258 ? end - pos : 258;
+        uint16_t candidate = head[h];
+        for (uint8_t chain = 0; chain < FTP_ZLIB_CHAIN && candidate > 0; chain ++) {
+          uint16_t c = candidate - 1;
+          if (c >= pos || pos - c >= FTP_ZLIB_WINDOW) {
+            break;                     // too far, or a slot reused meanwhile
+          }
+          if (window[c + bestLength] == window[pos + bestLength]) {
+            uint16_t n = 0;
+            while (n < maxLength && window[c + n] == window[pos + n]) {
+              n ++;
+            }
+            if (n > bestLength) {
+              bestLength = n;
+              bestDistance = pos - c;
+              if (n == maxLength) {
+                break;
+              }
+            }
+          }
+          candidate = prev[c & (FTP_ZLIB_WINDOW - 1)];
+        }
+        prev[pos & (FTP_ZLIB_WINDOW - 1)] = head[h];
+        head[h] = pos + 1;
+      }
+      if (bestLength >= 3) {
+        putMatch (bestLength, bestDistance);
+        // the strings inside the match can be matched later
+        for (uint16_t i = 1; i < bestLength && pos + i + 3 <= end; i ++) {
+          uint16_t h = hash (window + pos + i);
+          prev[(pos + i) & (FTP_ZLIB_WINDOW - 1)] = head[h];
+          head[h] = pos + i + 1;
+        }
+        pos += bestLength;
+      }
+      else {
+        putLiteral (window[pos ++]);
+      }
+    }
+    nWindow = end;
+    putCode (0, 7);                    // end of block
+  }
+
+  if (last) {
+    putBits (1 | 1 << 1, 3);           // empty last block
+    putCode (0, 7);
+    if (bitCount > 0) {
+      putBits (0, 8 - bitCount);
+    }
+    for (int8_t shift = 24; shift >= 0; shift -= 8) {
+      out[nOut ++] = adler >> shift;
+    }
+  }
+  return nOut;
+}
+
+void FtpDeflate::putBits (uint32_t bits, uint8_t count) {
+  bitBuf |= bits << bitCount;
+  bitCount += count;
+  while (bitCount >= 8) {
+    out[nOut ++] = bitBuf;
+    bitBuf >>= 8;
+    bitCount -= 8;
+  }
+}
+
+// Huffman codes are written from their most significant bit
+
+void FtpDeflate::putCode (uint16_t code, uint8_t count) {
+  uint16_t reversed = 0;
+  for (uint8_t i = 0; i < count; i ++) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  putBits (reversed, count);
+}
+
+void FtpDeflate::putLiteral (uint8_t c) {
+  if (c < 144) {
+    putCode (0x30 + c, 8);
+  }
+  else {
+    putCode (0x190 + c - 144, 9);
+  }
+}
+
+void FtpDeflate::putMatch (uint16_t length, uint16_t distance) {
+  uint8_t code;
+  if (length == 258) {
+    code = 28;
+  }
+  else if (length < 11) {
+    code = length - 3;
+  }
+  else {
+    uint8_t n = highBit (length - 3);
+    code = 4 * (n - 1) + ((length - 3) >> (n - 2) & 3);
+  }
+  if (code < 23) {
+    putCode (code + 1, 7);             // symbols 257..279
+  }
+  else {
+    putCode (0xC0 + code - 23, 8);     // symbols 280..285
+  }
+  putBits (length - lengthBase[code], lengthExtra[code]);
+
+  if (distance <= 4) {
+    code = distance - 1;
+  }
+  else {
+    uint8_t n = highBit (distance - 1);
+    code = 2 * n + ((distance - 1) >> (n - 1) & 1);
+  }
+  putCode (code, 5);
+  putBits (distance - distBase[code], distExtra[code]);
+}
+
+uint16_t FtpDeflate::hash (const uint8_t * p) {
+  uint32_t v = p[0] | p[1] << 8 | (uint32_t) p[2] << 16;
+  return (v * 2654435761u) >> (32 - FTP_ZLIB_WINDOW_BITS);
+}
+
+/*******************************************************************************
+ **                                 INFLATE                                    **
+ *******************************************************************************/
+
+// The compressed data is gathered in a buffer, and a block header or a
+// code is only decoded once all its bits are there (unless the stream is
+// said to be complete), so decoding never stops in the middle of one.
+
+void FtpInflate::begin () {
+  iIn = nIn = 0;
+  bitBuf = 0;
+  bitCount = 0;
+  total = 0;
+  adler = 1;
+  state = HEADER;
+  result = RUNNING;
+  lastBlock = false;
+  copyLeft = 0;
+}
+
+FtpInflate::Status FtpInflate::status () {
+  return result;
+}
+
+// Where to put the next compressed bytes, and how many fit
+
+uint8_t * FtpInflate::inputBuffer (uint16_t * room) {
+  if (iIn > 0) {
+    memmove (in, in + iIn, nIn - iIn);
+    nIn -= iIn;
+    iIn = 0;
+  }
+  * room = FTP_INFLATE_INPUT - nIn;
+  return in + nIn;
+}
+
+void FtpInflate::inputAdded (uint16_t count) {
+  nIn += count;
+}
+
+bool FtpInflate::need (uint16_t bits, bool final) {
+  return (uint32_t) (nIn - iIn) * 8 + bitCount >= bits || final;
+}
+
+uint32_t FtpInflate::getBits (uint8_t count) {
+  while (bitCount < count) {
+    if (iIn == nIn) {
+      result = ERROR;                  // stream cut short
+      return 0;
+    }
+    bitBuf |= (uint32_t) in[iIn ++] << bitCount;
+    bitCount += 8;
+  }
+  uint32_t v = bitBuf & ((1UL << count) - 1);
+  bitBuf >>= count;
+  bitCount -= count;
+  return v;
+}
+
+// Decode a symbol with a canonical Huffman table (as zlib's puff.c)
+
+int16_t FtpInflate::decode (const uint16_t * count, const uint16_t * symbol) {
+  int32_t code = 0, first = 0, index = 0;
+  for (uint8_t len = 1; len < 16; len ++) {
+    code |= getBits (1);
+    int32_t n = count[len];
+    if (code - n < first) {
+      return symbol[index + (code - first)];
+    }
+    index += n;
+    first = (first + n) << 1;
+    code <<= 1;
+  }
+  result = ERROR;
+  return -1;
+}
+
+bool FtpInflate::buildTable (uint16_t * count, uint16_t * symbol, const uint8_t * length, uint16_t n) {
+  uint16_t offset[16];
+  memset (count, 0, 16 * sizeof (uint16_t));
+  for (uint16_t i = 0; i < n; i ++) {
+    count[length[i]] ++;
+  }
+  count[0] = 0;
+  offset[1] = 0;
+  for (uint8_t len = 1; len < 15; len ++) {
+    offset[len + 1] = offset[len] + count[len];
+  }
+  for (uint16_t i = 0; i < n; i ++) {
+    if (length[i] != 0) {
+      symbol[offset[length[i]] ++] = i;
+    }
+  }
+  return true;
+}
+
+// Code lengths of a block with dynamic Huffman codes
+
+bool FtpInflate::readTables () {
+  static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  uint8_t lengths[320];
+  uint16_t nLen = getBits (5) + 257;
+  uint16_t nDist = getBits (5) + 1;
+  uint16_t nCode = getBits (4) + 4;
+  if (nLen > 286 || nDist > 30) {
+    return false;
+  }
+  memset (lengths, 0, 19);
+  for (uint8_t i = 0; i < nCode; i ++) {
+    lengths[order[i]] = getBits (3);
+  }
+  buildTable (lenCount, lenSymbol, lengths, 19);
+  for (uint16_t i = 0; i < nLen + nDist; ) {
+    int16_t sym = decode (lenCount, lenSymbol);
+    if (sym < 0) {
+      return false;
+    }
+    if (sym < 16) {
+      lengths[i ++] = sym;
+      continue;
+    }
+    uint8_t len = 0;
+    uint8_t repeat;
+    if (sym == 16) {
+      if (i == 0) {
+        return false;
+      }
+      len = lengths[i - 1];
+      repeat = 3 + getBits (2);
+    }
+    else if (sym == 17) {
+      repeat = 3 + getBits (3);
+    }
+    else {
+      repeat = 11 + getBits (7);
+    }
+    if (i + repeat > nLen + nDist) {
+      return false;
+    }
+    while (repeat --) {
+      lengths[i ++] = len;
+    }
+  }
+  buildTable (lenCount, lenSymbol, lengths, nLen);
+  buildTable (distCount, distSymbol, lengths + nLen, nDist);
+  return result != ERROR;
+}
+
+void FtpInflate::put (uint8_t * out, uint16_t * nOut, uint8_t c) {
+  window[total & (FTP_INFLATE_WINDOW - 1)] = c;
+  total ++;
+  out[(* nOut) ++] = c;
+}
+
+// Decompress into out, at most room bytes; final tells that all the
+// compressed data has been given
+//
+// return:
+//    number of bytes written to out; see status () for the end or errors
+
+uint16_t FtpInflate::inflate (uint8_t * out, uint16_t room, bool final) {
+  uint16_t nOut = 0, nChecked = 0;
+  while (result == RUNNING) {
+    if (copyLeft > 0) {                // rest of a match
+      while (copyLeft > 0 && nOut < room) {
+        put (out, &nOut, window[(total - copyDistance) & (FTP_INFLATE_WINDOW - 1)]);
+        copyLeft --;
+      }
+      if (copyLeft > 0) {
+        break;
+      }
+    }
+    if (state == HEADER) {
+      if (!need (16, final)) {
+        break;
+      }
+      uint16_t header = getBits (8) << 8;
+      header |= getBits (8);
+      if ((header & 0x0F00) != 0x0800 || header % 31 != 0 || (header & 0x20) != 0) {
+        result = ERROR;                // not deflate, or needs a dictionary
+      }
+      state = BLOCK;
+    }
+    else if (state == BLOCK) {
+      if (lastBlock) {
+        bitBuf >>= bitCount & 7;       // the trailer starts on a byte
+        bitCount -= bitCount & 7;
+        state = TRAILER;
+        continue;
+      }
+      if (!need (600 * 8, final)) {    // up to the longest header of dynamic codes
+        break;
+      }
+      lastBlock = getBits (1);
+      uint8_t type = getBits (2);
+      if (type == 0) {
+        bitBuf >>= bitCount & 7;
+        bitCount -= bitCount & 7;
+        uint16_t len = getBits (16);
+        uint16_t nlen = getBits (16);
+        if ((uint16_t) ~nlen != len) {
+          result = ERROR;
+        }
+        storedLeft = len;
+        state = STORED;
+      }
+      else if (type == 1) {
+        uint8_t lengths[288 + 30];
+        memset (lengths, 8, 144);
+        memset (lengths + 144, 9, 112);
+        memset (lengths + 256, 7, 24);
+        memset (lengths + 280, 8, 8);
+        buildTable (lenCount, lenSymbol, lengths, 288);
+        memset (lengths, 5, 30);
+        buildTable (distCount, distSymbol, lengths, 30);
+        state = CODES;
+      }
+      else if (type == 2 && readTables ()) {
+        state = CODES;
+      }
+      else {
+        result = ERROR;
+      }
+    }
+    else if (state == STORED) {
+      while (storedLeft > 0 && nOut < room && need (8, false)) {
+        put (out, &nOut, getBits (8));
+        storedLeft --;
+      }
+      if (storedLeft > 0) {
+        if (final && !need (8, false)) {
+          result = ERROR;
+        }
+        break;
+      }
+      state = BLOCK;
+    }
+    else if (state == CODES) {
+      if (nOut == room) {
+        break;
+      }
+      if (!need (48, final)) {         // longest code, with its distance
+        break;
+      }
+      int16_t sym = decode (lenCount, lenSymbol);
+      if (sym < 0) {
+        break;
+      }
+      if (sym < 256) {
+        put (out, &nOut, sym);
+      }
+      else if (sym == 256) {
+        state = BLOCK;
+      }
+      else if (sym > 285) {
+        result = ERROR;
+      }
+      else {
+        sym -= 257;
+        copyLeft = lengthBase[sym] + getBits (lengthExtra[sym]);
+        int16_t dsym = decode (distCount, distSymbol);
+        if (dsym < 0 || dsym > 29) {
+          result = ERROR;
+          break;
+        }
+        copyDistance = distBase[dsym] + getBits (distExtra[dsym]);
+        if (copyDistance > total) {
+          result = ERROR;
+        }
+        else if (copyDistance > FTP_INFLATE_WINDOW) {
+          result = TOO_FAR;            // needs a larger FTP_INFLATE_WINDOW_BITS
+        }
+      }
+    }
+    else if (state == TRAILER) {
+      if (!need (32, final)) {
+        break;
+      }
+      adler = ftpAdler32 (adler, out, nOut);
+      nChecked = nOut;
+      uint32_t check = 0;
+      for (uint8_t i = 0; i < 4; i ++) {
+        check = (check << 8) | getBits (8);
+      }
+      if (result == RUNNING) {
+        result = check == adler ? DONE : ERROR;
+      }
+      state = END;
+    }
+    else {
+      break;
+    }
+  }
+  adler = ftpAdler32 (adler, out + nChecked, nOut - nChecked);
+  return nOut;
+}
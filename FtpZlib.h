@@ -0,0 +1,120 @@
+/*
+ * FTP SERVER FOR ESP8266/ESP32
+ * zlib streams (RFC 1950/1951) for MODE Z, in bounded memory
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTP_ZLIB_H
+#define FTP_ZLIB_H
+
+#include <stdint.h>
+
+#ifndef FTP_ZLIB_WINDOW_BITS            // window of compression: 2^bits bytes, using 6 times as much RAM
+#ifdef ESP8266
+#define FTP_ZLIB_WINDOW_BITS   10
+#else
+#define FTP_ZLIB_WINDOW_BITS   12
+#endif
+#endif
+#if FTP_ZLIB_WINDOW_BITS < 8 || FTP_ZLIB_WINDOW_BITS > 14
+#error "FTP_ZLIB_WINDOW_BITS must be from 8 to 14"
+#endif
+#define FTP_ZLIB_WINDOW        (1 << FTP_ZLIB_WINDOW_BITS)
+
+#ifndef FTP_ZLIB_CHAIN                  // max number of earlier strings compared to find a match
+#define FTP_ZLIB_CHAIN         16
+#endif
+
+#ifndef FTP_INFLATE_WINDOW_BITS         // window of decompression; data referring further back is refused
+#ifdef ESP8266
+#define FTP_INFLATE_WINDOW_BITS 12
+#else
+#define FTP_INFLATE_WINDOW_BITS 15
+#endif
+#endif
+#if FTP_INFLATE_WINDOW_BITS < 8 || FTP_INFLATE_WINDOW_BITS > 15
+#error "FTP_INFLATE_WINDOW_BITS must be from 8 to 15"
+#endif
+#define FTP_INFLATE_WINDOW     (1 << FTP_INFLATE_WINDOW_BITS)
+#define FTP_INFLATE_INPUT      1024     // compressed bytes buffered, enough for a block header
+
+// Room needed for the output of compressing n bytes, the end of the stream included
+#define FTP_ZLIB_BOUND(n)      ((n) + (n) / 8 + 16)
+
+uint32_t ftpAdler32 (uint32_t adler, const uint8_t * data, uint32_t length);
+
+// Compress a stream, in blocks of fixed Huffman codes
+class FtpDeflate {
+  public:
+    void     begin ();
+    uint16_t compress (const uint8_t * data, uint16_t length, uint8_t * out, bool last);
+
+  private:
+    void     putBits (uint32_t bits, uint8_t count);
+    void     putCode (uint16_t code, uint8_t count);
+    void     putLiteral (uint8_t c);
+    void     putMatch (uint16_t length, uint16_t distance);
+    uint16_t hash (const uint8_t * p);
+
+    uint8_t  window[2 * FTP_ZLIB_WINDOW]; // data compressed so far, the last part of
+    uint16_t head[FTP_ZLIB_WINDOW],       // position + 1 of the last string of each hash
+             prev[FTP_ZLIB_WINDOW];       // position + 1 of the previous string of same hash
+    uint16_t nWindow;
+    uint32_t adler;
+    uint32_t bitBuf;                      // bits not yet written to out
+    uint8_t  bitCount;
+    uint8_t * out;
+    uint16_t nOut;
+    bool     started;
+};
+
+// Decompress a stream fed in pieces of any size
+class FtpInflate {
+  public:
+    enum Status { RUNNING, DONE, ERROR, TOO_FAR };
+
+    void     begin ();
+    uint8_t * inputBuffer (uint16_t * room);
+    void     inputAdded (uint16_t count);
+    uint16_t inflate (uint8_t * out, uint16_t room, bool final);
+    Status   status ();
+
+  private:
+    bool     need (uint16_t bits, bool final);
+    uint32_t getBits (uint8_t count);
+    int16_t  decode (const uint16_t * count, const uint16_t * symbol);
+    bool     buildTable (uint16_t * count, uint16_t * symbol, const uint8_t * length, uint16_t n);
+    bool     readTables ();
+    void     put (uint8_t * out, uint16_t * nOut, uint8_t c);
+
+    enum State { HEADER, BLOCK, STORED, CODES, TRAILER, END };
+    uint8_t  in[FTP_INFLATE_INPUT];
+    uint16_t iIn, nIn;
+    uint32_t bitBuf;
+    uint8_t  bitCount;
+    uint8_t  window[FTP_INFLATE_WINDOW];
+    uint32_t total;                       // bytes output
+    uint32_t adler;
+    State    state;
+    Status   result;
+    bool     lastBlock;
+    uint16_t storedLeft;                  // bytes left in a stored block
+    uint16_t copyLeft,                    // bytes of a match left to copy
+             copyDistance;
+    uint16_t lenCount[16], lenSymbol[288],
+             distCount[16], distSymbol[30];
+};
+
+#endif // FTP_ZLIB_H
@@ -93,6 +93,7 @@ void setup (void) {
   if (FS_ID.begin ()) {
     Serial.println ("File system opened (" + String (FS_NAME) + ")");
     ftpSrv.begin ("esp32", "esp32");    //username, password for ftp.  set ports in ESPFtpServer.h  (default 21, 50009 for PASV)
+    //ftpSrv.setServerRate (200000);    //keep transfers under 200 kbytes/s, leaving room for other traffic (see also SITE RATE)
   }
   else {
     Serial.println ("File system could not be opened; ftp server will not work");
@@ -0,0 +1,174 @@
+// Compare the cost of directory listings: the former String/sprintf lines,
+// sent one by one, against FtpSession::formatEntry () batched per segment.
+// Creates BENCH_FILES empty files in BENCH_DIR on first run.
+
+// Uncomment the file system to use
+
+#define FS_LITTLEFS
+//#define FS_SPIFFS
+//#define FS_SD_MMC
+
+#include <time.h>
+#include "ESPFtpServer.h"
+
+#if defined(FS_LITTLEFS)
+#ifdef ESP32
+#include "LITTLEFS.h"
+#define FS_ID LITTLEFS
+#endif
+#ifdef ESP8266
+#include "LittleFS.h"
+#define FS_ID LittleFS
+#endif
+#define FS_NAME "LittleFS"
+#elif defined(FS_SPIFFS)
+#ifdef ESP32
+#include "SPIFFS.h"
+#endif
+#define FS_ID SPIFFS
+#define FS_NAME "SPIFFS"
+#elif defined(FS_SD_MMC)
+#include "SD_MMC.h"
+#define FS_ID SD_MMC
+#define FS_NAME "SD_MMC"
+#else 
+#define FS_ID SD
+#define FS_NAME "UNDEF"
+#endif
+
+#define BENCH_DIR   "/bench"
+#define BENCH_FILES 2000
+
+// Stands for the data connection: counts bytes and write calls (TCP segments)
+class SegmentCounter : public Print {
+  public:
+    size_t write (uint8_t c) {
+      return write (&c, 1);
+    }
+    size_t write (const uint8_t * buffer, size_t size) {
+      writes ++;
+      bytes += size;
+      return size;
+    }
+    uint32_t writes = 0;
+    uint32_t bytes = 0;
+};
+
+// The listing line as it was built before, for comparison
+void legacyLine (Print & out, const char * name, uint32_t size, time_t ftime, bool isDir) {
+  char buffer[80];
+  String fname = name;
+  fname.remove (0, fname.lastIndexOf ("/") + 1);
+  String fsize = String (size);
+  String spaces = "";
+  while (spaces.length () < 14 - fsize.length ()) {
+    spaces += " ";
+  }
+  struct tm * ptm = gmtime (&ftime);
+  if (isDir) {
+    sprintf (buffer, "%04u-%02u-%02u  %02u:%02u    <DIR>           %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, fname.c_str ());
+  }
+  else {
+    sprintf (buffer, "%04u-%02u-%02u  %02u:%02u    %s  %s", ptm->tm_year + 1900, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, (spaces + fsize).c_str (), fname.c_str ());
+  }
+  out.println (buffer);
+}
+
+// The listing line as the server builds it now, sent per FTP_LIST_MSS bytes
+char     batch[FTP_LIST_MSS + FTP_FIL_SIZE + 64];
+uint16_t nBatch = 0;
+
+void batchedLine (Print & out, const char * name, uint32_t size, time_t ftime, bool isDir) {
+  nBatch += FtpSession::formatEntry (batch + nBatch, "LIST", name, size, ftime, isDir);
+  if (nBatch >= FTP_LIST_MSS) {
+    out.write ((uint8_t *) batch, FTP_LIST_MSS);
+    memmove (batch, batch + FTP_LIST_MSS, nBatch - FTP_LIST_MSS);
+    nBatch -= FTP_LIST_MSS;
+  }
+}
+
+void batchedEnd (Print & out) {
+  out.write ((uint8_t *) batch, nBatch);
+  nBatch = 0;
+}
+
+typedef void (* LineFunction) (Print & out, const char * name, uint32_t size, time_t ftime, bool isDir);
+
+void report (const char * label, uint32_t us, SegmentCounter & out, uint32_t heapBefore) {
+  Serial.printf ("%-28s %8u us  %6u bytes  %5u writes  heap %6u -> %6u", label, us, out.bytes, out.writes, heapBefore, ESP.getFreeHeap ());
+  #ifdef ESP8266
+  Serial.printf ("  fragmentation %u%%", ESP.getHeapFragmentation ());
+  #endif
+  Serial.println ();
+}
+
+// Format BENCH_FILES made up entries: the cost of formatting alone
+void benchFormat (const char * label, LineFunction line) {
+  SegmentCounter out;
+  char name[32];
+  uint32_t heap = ESP.getFreeHeap ();
+  uint32_t start = micros ();
+  for (uint16_t i = 0; i < BENCH_FILES; i ++) {
+    sprintf (name, "log_%05u.csv", i);
+    line (out, name, 1000UL * i, 1600000000 + 3600UL * i, false);
+  }
+  if (line == batchedLine) {
+    batchedEnd (out);
+  }
+  report (label, micros () - start, out, heap);
+}
+
+// Walk BENCH_DIR: the cost of a listing as the server sends it
+void benchWalk (const char * label, LineFunction line) {
+  SegmentCounter out;
+  uint32_t heap = ESP.getFreeHeap ();
+  uint32_t start = micros ();
+  #ifdef ESP8266
+  Dir dir = FS_ID.openDir (BENCH_DIR);
+  while (dir.next ()) {
+    line (out, dir.fileName ().c_str (), dir.fileSize (), dir.fileTime (), dir.isDirectory ());
+  }
+  #endif
+  #ifdef ESP32
+  File dir = FS_ID.open (BENCH_DIR);
+  File entry = dir.openNextFile ();
+  while (entry) {
+    line (out, entry.name (), entry.size (), entry.getLastWrite (), entry.isDirectory ());
+    entry = dir.openNextFile ();
+  }
+  #endif
+  if (line == batchedLine) {
+    batchedEnd (out);
+  }
+  report (label, micros () - start, out, heap);
+}
+
+void setup (void) {
+  Serial.begin (115200);
+  Serial.println ();
+
+  if (!FS_ID.begin ()) {
+    Serial.println ("File system could not be opened (" + String (FS_NAME) + ")");
+    return;
+  }
+  if (!FS_ID.exists (BENCH_DIR)) {
+    Serial.println ("Creating " + String (BENCH_FILES) + " files in " + String (BENCH_DIR) + ", this takes a while...");
+    FS_ID.mkdir (BENCH_DIR);
+    for (uint16_t i = 0; i < BENCH_FILES; i ++) {
+      char path[40];
+      sprintf (path, "%s/log_%05u.csv", BENCH_DIR, i);
+      File f = FS_ID.open (path, "w");
+      f.close ();
+      yield ();
+    }
+  }
+
+  Serial.println ("Listing of " + String (BENCH_FILES) + " entries on " + String (FS_NAME));
+  benchFormat ("format, String + sprintf", legacyLine);
+  benchFormat ("format, formatEntry", batchedLine);
+  benchWalk ("directory, String + sprintf", legacyLine);
+  benchWalk ("directory, formatEntry", batchedLine);
+}
+
+void loop (void) {
+}
@@ -0,0 +1,107 @@
+// Host stand-in for the Arduino core: just enough for ESPFtpServer.cpp
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <string>
+#include <algorithm>
+using std::min;
+using std::max;
+#include "Esp.h"
+
+typedef bool boolean;
+
+uint32_t millis ();
+uint32_t micros ();
+void     delay (uint32_t ms);
+void     yield ();
+
+class String {
+  public:
+    String () {}
+    String (const char * s) : s_ (s ? s : "") {}
+    String (const std::string & s) : s_ (s) {}
+    String (char c) : s_ (1, c) {}
+    String (int v)           { s_ = std::to_string (v); }
+    String (unsigned v)      { s_ = std::to_string (v); }
+    String (long v)          { s_ = std::to_string (v); }
+    String (unsigned long v) { s_ = std::to_string (v); }
+    String (long long v)     { s_ = std::to_string (v); }
+    String (unsigned long long v) { s_ = std::to_string (v); }
+
+    const char * c_str () const { return s_.c_str (); }
+    unsigned length () const { return s_.length (); }
+    char operator[] (unsigned i) const { return s_[i]; }
+    bool operator== (const String & o) const { return s_ == o.s_; }
+    bool operator== (const char * o) const { return s_ == o; }
+    bool operator!= (const String & o) const { return s_ != o.s_; }
+    String & operator+= (const String & o) { s_ += o.s_; return * this; }
+    String & operator+= (const char * o) { s_ += o; return * this; }
+    String & operator+= (char c) { s_ += c; return * this; }
+    int  indexOf (char c) const { size_t p = s_.find (c); return p == std::string::npos ? -1 : (int) p; }
+    int  indexOf (const char * c) const { size_t p = s_.find (c); return p == std::string::npos ? -1 : (int) p; }
+    int  lastIndexOf (char c) const { size_t p = s_.rfind (c); return p == std::string::npos ? -1 : (int) p; }
+    int  lastIndexOf (const char * c) const { size_t p = s_.rfind (c); return p == std::string::npos ? -1 : (int) p; }
+    void remove (unsigned i) { if (i < s_.length ()) s_.erase (i); }
+    void remove (unsigned i, unsigned n) { if (i < s_.length ()) s_.erase (i, n); }
+    String substring (unsigned a) const { return a < s_.length () ? String (s_.substr (a)) : String (); }
+    String substring (unsigned a, unsigned b) const { return a < b && a < s_.length () ? String (s_.substr (a, b - a)) : String (); }
+    bool startsWith (const String & p) const { return s_.compare (0, p.s_.length (), p.s_) == 0; }
+    bool endsWith (const String & p) const { return s_.length () >= p.s_.length () && s_.compare (s_.length () - p.s_.length (), p.s_.length (), p.s_) == 0; }
+    long toInt () const { return atol (s_.c_str ()); }
+
+  private:
+    std::string s_;
+    friend String operator+ (const String & a, const String & b);
+};
+
+inline String operator+ (const String & a, const String & b) { return String (a.s_ + b.s_); }
+inline String operator+ (const String & a, const char * b) { return a + String (b); }
+inline String operator+ (const char * a, const String & b) { return String (a) + b; }
+
+class Print {
+  public:
+    virtual ~Print () {}
+    virtual size_t write (uint8_t c) { return write (&c, 1); }
+    virtual size_t write (const uint8_t * b, size_t n) = 0;
+    size_t write (const char * s) { return write ((const uint8_t *) s, strlen (s)); }
+    virtual int availableForWrite () { return 0; }
+    size_t print (const char * s) { return write ((const uint8_t *) s, strlen (s)); }
+    size_t print (const String & s) { return print (s.c_str ()); }
+    size_t print (char c) { return write ((uint8_t) c); }
+    size_t print (long v) { return print (String (v)); }
+    size_t print (unsigned long v) { return print (String (v)); }
+    size_t print (int v) { return print (String (v)); }
+    size_t print (unsigned v) { return print (String (v)); }
+    size_t println () { return print ("\r\n"); }
+    template <typename T> size_t println (T v) { size_t n = print (v); return n + println (); }
+    size_t printf (const char * fmt, ...) __attribute__ ((format (printf, 2, 3)));
+};
+
+class HostSerial : public Print {
+  public:
+    void begin (unsigned long) {}
+    size_t write (const uint8_t * b, size_t n) override { return fwrite (b, 1, n, stderr); }
+    using Print::write;
+};
+extern HostSerial Serial;
+
+class IPAddress {
+  public:
+    IPAddress () { b_[0] = b_[1] = b_[2] = b_[3] = 0; }
+    IPAddress (uint8_t a, uint8_t b, uint8_t c, uint8_t d) { b_[0] = a; b_[1] = b; b_[2] = c; b_[3] = d; }
+    uint8_t   operator[] (int i) const { return b_[i]; }
+    uint8_t & operator[] (int i) { return b_[i]; }
+    bool operator== (const IPAddress & o) const { return !memcmp (b_, o.b_, 4); }
+    bool operator!= (const IPAddress & o) const { return !(* this == o); }
+  private:
+    uint8_t b_[4];
+};
+
+#endif
@@ -0,0 +1,2 @@
+// Host stand-in for the WiFi singleton of the ESP8266 core
+#include "WiFi.h"
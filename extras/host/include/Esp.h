@@ -0,0 +1,11 @@
+// Host stand-in for the ESP object
+#ifndef HOST_ESP_H
+#define HOST_ESP_H
+#include <stdint.h>
+class HostEsp {
+  public:
+    uint32_t getFreeHeap () { return 0; }
+    uint32_t getHeapFragmentation () { return 0; }
+};
+extern HostEsp ESP;
+#endif
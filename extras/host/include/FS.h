@@ -0,0 +1,96 @@
+// Host stand-in for the Arduino fs::FS / fs::File API, backed by a directory on disk
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include "Arduino.h"
+#include <memory>
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+struct FileImpl;
+
+class File : public Print {
+  public:
+    File () {}
+    explicit File (std::shared_ptr<FileImpl> p) : p_ (p) {}
+
+    operator bool () const;
+    size_t   write (const uint8_t * b, size_t n) override;
+    using Print::write;
+    int      read ();
+    size_t   read (uint8_t * b, size_t n);
+    size_t   readBytes (char * b, size_t n) { return read ((uint8_t *) b, n); }
+    int      available ();
+    bool     seek (uint32_t pos, SeekMode mode = SeekSet);
+    size_t   position () const;
+    size_t   size () const;
+    void     close ();
+    void     flush () {}
+    const char * name () const;
+    const char * path () const;
+    bool     isDirectory () const;
+    time_t   getLastWrite ();
+    File     openNextFile (const char * mode = "r");
+    void     rewindDirectory ();
+
+  private:
+    std::shared_ptr<FileImpl> p_;
+};
+
+#ifdef ESP8266
+struct DirImpl;
+
+class Dir {
+  public:
+    Dir () {}
+    explicit Dir (std::shared_ptr<DirImpl> p) : p_ (p) {}
+    bool   next ();
+    String fileName ();
+    size_t fileSize ();
+    time_t fileTime ();
+    bool   isDirectory ();
+    bool   isFile () { return !isDirectory (); }
+    File   openFile (const char * mode);
+  private:
+    std::shared_ptr<DirImpl> p_;
+};
+#endif
+
+class FS {
+  public:
+    explicit FS (const char * root = ".");
+    bool begin () { return true; }
+    void setRoot (const char * root);
+    File open (const char * path, const char * mode = "r");
+    File open (const String & path, const char * mode = "r") { return open (path.c_str (), mode); }
+    bool exists (const char * path);
+    bool exists (const String & path) { return exists (path.c_str ()); }
+    bool remove (const char * path);
+    bool rename (const char * from, const char * to);
+    bool mkdir (const char * path);
+    bool rmdir (const char * path);
+    #ifdef ESP8266
+    Dir  openDir (const char * path);
+    bool setTimeCallback (time_t (* cb) (void)) { timeCallback_ = cb; return true; }
+    time_t (* timeCallback_) (void) = nullptr;
+    #endif
+    std::string real (const char * path) const;
+    uint32_t latencyMicros = 0;         // added to each read and write of a file, as by a slow card
+  private:
+    std::string root_;
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+#ifdef ESP8266
+using fs::Dir;
+#endif
+
+#endif
@@ -0,0 +1,13 @@
+// Host stand-in for the WiFi singleton
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+#include "WiFiClient.h"
+
+class HostWiFi {
+  public:
+    IPAddress localIP () { return IPAddress (127, 0, 0, 1); }
+};
+extern HostWiFi WiFi;
+
+#endif
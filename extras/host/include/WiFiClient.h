@@ -0,0 +1,57 @@
+// Host stand-in for WiFiClient / WiFiServer over POSIX sockets
+#ifndef HOST_WIFICLIENT_H
+#define HOST_WIFICLIENT_H
+
+#include "Arduino.h"
+#include <memory>
+
+struct HostSocket;
+
+class WiFiClient : public Print {
+  public:
+    WiFiClient () {}
+    explicit WiFiClient (int fd);
+
+    uint8_t   connected ();
+    operator  bool ();
+    int       available ();
+    int       read ();
+    int       read (uint8_t * b, size_t n);
+    size_t    write (const uint8_t * b, size_t n) override;
+    using Print::write;
+    int       availableForWrite () override;
+    void      stop ();
+    void      flush () {}
+    int       setNoDelay (bool nodelay);
+    int       fd () const;
+    IPAddress remoteIP () const;
+    uint16_t  remotePort () const;
+    IPAddress localIP () const;
+    uint16_t  localPort () const;
+    int       connect (IPAddress ip, uint16_t port);
+
+  private:
+    std::shared_ptr<HostSocket> s_;
+};
+
+class WiFiServer {
+  public:
+    WiFiServer (uint16_t port = 80) : port_ (port) {}
+    ~WiFiServer ();
+    void       begin ();
+    void       begin (uint16_t port) { port_ = port; begin (); }
+    bool       hasClient ();
+    WiFiClient available ();
+    WiFiClient accept () { return available (); }
+    void       stop ();
+    void       close () { stop (); }
+    int        fd () const { return fd_; }
+    uint16_t   port () const { return port_; }
+
+  private:
+    uint16_t port_;
+    int      fd_ = -1;
+    int      pending_ = -1;
+};
+
+#endif
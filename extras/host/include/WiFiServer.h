@@ -0,0 +1,2 @@
+// Host stand-in: WiFiServer lives with WiFiClient
+#include "WiFiClient.h"
@@ -0,0 +1,15 @@
+// Host stand-in: threads are not pinned to a core, nor named
+#ifndef HOST_ESP_PTHREAD_H
+#define HOST_ESP_PTHREAD_H
+#include <stddef.h>
+typedef int esp_err_t;
+struct esp_pthread_cfg_t {
+  size_t       stack_size;
+  size_t       prio;
+  bool         inherit_cfg;
+  const char * thread_name;
+  int          pin_to_core;
+};
+inline esp_pthread_cfg_t esp_pthread_get_default_config () { return esp_pthread_cfg_t (); }
+inline esp_err_t esp_pthread_set_cfg (const esp_pthread_cfg_t * cfg) { return 0; }
+#endif
@@ -0,0 +1,4 @@
+// Host stand-in: lwIP sockets are POSIX sockets
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <errno.h>
@@ -0,0 +1,63 @@
+// Count the heap allocations of the host build, for ftpAllocCount ()
+//
+// malloc, calloc and realloc are replaced by wrappers around the glibc
+// ones, and new and delete go through them, so that allocations made by
+// the library, the stand-ins and the C++ runtime are all seen.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+extern "C" void * __libc_malloc (size_t size);
+extern "C" void * __libc_calloc (size_t count, size_t size);
+extern "C" void * __libc_realloc (void * ptr, size_t size);
+
+static std::atomic<uint32_t> allocCount (0);
+
+uint32_t ftpAllocCount () {
+  return allocCount.load (std::memory_order_relaxed);
+}
+
+extern "C" void * malloc (size_t size) {
+  allocCount.fetch_add (1, std::memory_order_relaxed);
+  return __libc_malloc (size);
+}
+
+extern "C" void * calloc (size_t count, size_t size) {
+  allocCount.fetch_add (1, std::memory_order_relaxed);
+  return __libc_calloc (count, size);
+}
+
+extern "C" void * realloc (void * ptr, size_t size) {
+  allocCount.fetch_add (1, std::memory_order_relaxed);
+  return __libc_realloc (ptr, size);
+}
+
+void * operator new (size_t size) {
+  void * p = malloc (size);
+  if (p == nullptr) {
+    throw std::bad_alloc ();
+  }
+  return p;
+}
+
+void * operator new[] (size_t size) {
+  return operator new (size);
+}
+
+void operator delete (void * ptr) noexcept {
+  free (ptr);
+}
+
+void operator delete[] (void * ptr) noexcept {
+  free (ptr);
+}
+
+void operator delete (void * ptr, size_t) noexcept {
+  free (ptr);
+}
+
+void operator delete[] (void * ptr, size_t) noexcept {
+  free (ptr);
+}
@@ -0,0 +1,394 @@
+// Benchmark of the FTP server on the host
+//
+//   bench [-s megabytes] [-f files] [-r rounds] [-w ms] [-l us] [-k kbytes/s] [-p]
+//
+// Runs the server in a thread on a temporary directory, and drives it from
+// the main thread as a client with plain sockets: RETR and STOR of a file
+// of -s MB (8 by default), LIST and MLSD of a directory of -f files (500),
+// and a few commands without transfer, each -r times (5). The server calls
+// handleFTP (fs) in a loop, or handleFTP (fs, ms) with -w. -l adds a
+// latency to each read and write of a file, and -k limits the rate of
+// RETR and STOR, to see how the two add up (FTP_FS_TASK overlaps them).
+// -p serves the directory through FtpPosixStorage instead of fs::FS,
+// RETR sending the files mapped with mmap () without copying them.
+//
+// Reported for each transfer: MB/s (or ms for listings) and the number of
+// heap allocations made from PASV to the 226 reply; for each command:
+// latency from sending it to the end of its reply. The client side uses
+// fixed buffers only, so the allocations counted are the server's. Last,
+// the CPU used by the process while the client stays logged in, idle.
+
+#include "ESPFtpServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define BENCH_USER "bench"
+#define BENCH_PASS "bench"
+
+static std::atomic<bool> serverRunning (true);
+static uint32_t waitMillis = 0;     // -w: wait of handleFTP (), 0 for polling
+static FtpStorage * storage;        // served by handleFTP ()
+
+static double now () {
+  return std::chrono::duration<double> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+static double cpuTime () {
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void fail (const char * what) {
+  fprintf (stderr, "bench: %s (%s)\n", what, strerror (errno));
+  exit (1);
+}
+
+/*******************************************************************************
+ **                                 CLIENT                                     **
+ *******************************************************************************/
+
+static int  ctrl = -1;              // control connection
+static char ctrlBuf[1024];          // chars received on ctrl, not yet used
+static int  nCtrlBuf = 0;
+static char lastReply[1024];        // last line of the last reply
+
+static int connectTo (uint16_t port) {
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in a;
+  memset (&a, 0, sizeof (a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons (port);
+  a.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &a, sizeof (a)) < 0) {
+    fail ("can't connect");
+  }
+  int one = 1;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  return fd;
+}
+
+// Read a reply, multi-line ones included; return its code
+
+static int readReply () {
+  for (;;) {
+    // look for the last line of a reply: 3 digits and a space
+    char * line = ctrlBuf;
+    char * eol;
+    while ((eol = (char *) memchr (line, '\n', nCtrlBuf - (line - ctrlBuf))) != NULL) {
+      if (eol - line >= 4 && isdigit (line[0]) && line[3] == ' ') {
+        int len = eol - line;
+        memcpy (lastReply, line, len);
+        lastReply[len > 0 && line[len - 1] == '\r' ? len - 1 : len] = 0;
+        nCtrlBuf -= eol + 1 - ctrlBuf;
+        memmove (ctrlBuf, eol + 1, nCtrlBuf);
+        return atoi (lastReply);
+      }
+      line = eol + 1;
+    }
+    if (nCtrlBuf == (int) sizeof (ctrlBuf)) {
+      nCtrlBuf = 0;                  // reply too long, drop it
+    }
+    ssize_t n = recv (ctrl, ctrlBuf + nCtrlBuf, sizeof (ctrlBuf) - nCtrlBuf, 0);
+    if (n <= 0) {
+      fail ("control connection lost");
+    }
+    nCtrlBuf += n;
+  }
+}
+
+static int command (const char * format, const char * arg = "") {
+  char line[512];
+  int n = snprintf (line, sizeof (line) - 2, format, arg);
+  line[n ++] = '\r';
+  line[n ++] = '\n';
+  if (send (ctrl, line, n, 0) != n) {
+    fail ("can't send command");
+  }
+  return readReply ();
+}
+
+static void expect (int code, int expected, const char * what) {
+  if (code != expected) {
+    fprintf (stderr, "bench: %s: expected %d, got \"%s\"\n", what, expected, lastReply);
+    exit (1);
+  }
+}
+
+// Send PASV and open the data connection
+
+static int passive () {
+  expect (command ("PASV"), 227, "PASV");
+  unsigned h1, h2, h3, h4, p1, p2;
+  const char * p = strchr (lastReply, '(');
+  if (p == NULL || sscanf (p, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) {
+    fail ("can't parse PASV reply");
+  }
+  return connectTo (p1 * 256 + p2);
+}
+
+struct Transfer {
+  double   seconds;
+  uint64_t bytes;
+  uint32_t allocs;
+};
+
+// RETR, LIST, MLSD: read the data connection to its end
+
+static Transfer download (const char * cmd, const char * name) {
+  static char data[65536];
+  Transfer t = { now (), 0, ftpAllocCount () };
+  int fd = passive ();
+  expect (command (cmd, name), 150, cmd);
+  ssize_t n;
+  while ((n = recv (fd, data, sizeof (data), 0)) > 0) {
+    t.bytes += n;
+  }
+  close (fd);
+  expect (readReply (), 226, cmd);
+  t.seconds = now () - t.seconds;
+  t.allocs = ftpAllocCount () - t.allocs;
+  return t;
+}
+
+static Transfer upload (const char * name, uint64_t size) {
+  static char data[65536];
+  Transfer t = { now (), 0, ftpAllocCount () };
+  int fd = passive ();
+  expect (command ("STOR %s", name), 150, "STOR");
+  while (t.bytes < size) {
+    size_t len = size - t.bytes < sizeof (data) ? size - t.bytes : sizeof (data);
+    memset (data, (int) (t.bytes >> 16), len);
+    ssize_t n = send (fd, data, len, 0);
+    if (n <= 0) {
+      fail ("data connection lost");
+    }
+    t.bytes += n;
+  }
+  close (fd);
+  expect (readReply (), 226, "STOR");
+  t.seconds = now () - t.seconds;
+  t.allocs = ftpAllocCount () - t.allocs;
+  return t;
+}
+
+/*******************************************************************************
+ **                                 REPORT                                     **
+ *******************************************************************************/
+
+static void reportTransfer (const char * what, Transfer * t, int rounds, bool rate) {
+  double best = t[0].seconds, sum = 0;
+  uint32_t allocs = 0;
+  for (int i = 0; i < rounds; i ++) {
+    sum += t[i].seconds;
+    allocs += t[i].allocs;
+    if (t[i].seconds < best) {
+      best = t[i].seconds;
+    }
+  }
+  if (rate) {
+    printf ("%-16s %9.1f MB/s  (best %.1f)   %6.1f allocations per transfer\n", what,
+            t[0].bytes * rounds / sum / 1e6, t[0].bytes / best / 1e6, (double) allocs / rounds);
+  }
+  else {
+    printf ("%-16s %9.3f ms    (first %.3f)  %6.1f allocations per transfer, %llu bytes\n", what,
+            rounds > 1 ? (sum - t[0].seconds) / (rounds - 1) * 1e3 : sum * 1e3, t[0].seconds * 1e3,
+            (double) allocs / rounds, (unsigned long long) t[0].bytes);
+  }
+}
+
+static void reportCommand (const char * cmd, const char * arg, int expected, int count) {
+  double best = 1e9, sum = 0;
+  uint32_t allocs = ftpAllocCount ();
+  for (int i = 0; i < count; i ++) {
+    double t = now ();
+    expect (command (cmd, arg), expected, cmd);
+    t = now () - t;
+    sum += t;
+    if (t < best) {
+      best = t;
+    }
+  }
+  allocs = ftpAllocCount () - allocs;
+  char name[32];
+  snprintf (name, sizeof (name), cmd, arg);
+  printf ("%-16s %9.1f us    (best %.1f)    %6.1f allocations per command\n", name,
+          sum / count * 1e6, best * 1e6, (double) allocs / count);
+}
+
+/*******************************************************************************
+ **                                  MAIN                                      **
+ *******************************************************************************/
+
+static void makeFile (const char * path, uint64_t size) {
+  static char data[65536];
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fail (path);
+  }
+  uint32_t x = 1;
+  for (size_t i = 0; i < sizeof (data); i ++) {
+    x = x * 1103515245 + 12345;
+    data[i] = x >> 24;
+  }
+  for (uint64_t done = 0; done < size; ) {
+    size_t len = size - done < sizeof (data) ? size - done : sizeof (data);
+    if (write (fd, data, len) != (ssize_t) len) {
+      fail (path);
+    }
+    done += len;
+  }
+  close (fd);
+}
+
+int main (int argc, char ** argv) {
+  int megabytes = 8, files = 500, rounds = 5;
+  uint32_t latency = 0, rate = 0;
+  bool posix = false;
+  int opt;
+  while ((opt = getopt (argc, argv, "s:f:r:w:l:k:p")) != -1) {
+    if (opt == 's') megabytes = atoi (optarg);
+    else if (opt == 'f') files = atoi (optarg);
+    else if (opt == 'r') rounds = atoi (optarg);
+    else if (opt == 'w') waitMillis = atoi (optarg);
+    else if (opt == 'l') latency = atoi (optarg);
+    else if (opt == 'k') rate = atoi (optarg);
+    else if (opt == 'p') posix = true;
+    else {
+      fprintf (stderr, "usage: bench [-s megabytes] [-f files] [-r rounds] [-w ms] [-l us] [-k kbytes/s] [-p]\n");
+      return 2;
+    }
+  }
+  if (rounds < 1 || rounds > 100) {
+    rounds = 5;
+  }
+
+  // tree served: /big.bin, /list/fNNNNN.txt, and /up.bin written by STOR
+  char root[] = "/tmp/ftpbench.XXXXXX";
+  if (mkdtemp (root) == NULL) {
+    fail ("can't make temporary directory");
+  }
+  char path[256];
+  uint64_t size = (uint64_t) megabytes << 20;
+  snprintf (path, sizeof (path), "%s/big.bin", root);
+  makeFile (path, size);
+  snprintf (path, sizeof (path), "%s/list", root);
+  mkdir (path, 0755);
+  for (int i = 0; i < files; i ++) {
+    snprintf (path, sizeof (path), "%s/list/f%05d.txt", root, i);
+    makeFile (path, 100 + i);
+  }
+
+  #ifdef ESP8266
+  const char * core = "ESP8266";
+  #else
+  const char * core = "ESP32";
+  #endif
+  printf ("ESPFtpServer host benchmark (%s core), %d MB file, %d files listed, %d rounds, %s, %s\n",
+          core, megabytes, files, rounds, waitMillis > 0 ? "waiting for events" : "polling",
+          posix ? "POSIX storage" : "fs::FS");
+  fflush (stdout);
+
+  static fs::FS disk (root);
+  static FtpFsStorage fsStorage (&disk);
+  storage = &fsStorage;
+  if (posix) {
+    #ifdef ESP32
+    storage = new FtpPosixStorage (root);
+    #else
+    fail ("no POSIX storage with the ESP8266 core");
+    #endif
+  }
+  static FtpServer ftpSrv;
+  ftpSrv.begin (BENCH_USER, BENCH_PASS);
+  ftpSrv.setServerRate (rate * 1000);
+  disk.latencyMicros = latency;
+  std::thread server ([] {
+    while (serverRunning) {
+      if (waitMillis > 0) {
+        ftpSrv.handleFTP (* storage, waitMillis);
+      }
+      else {
+        ftpSrv.handleFTP (* storage);
+        yield ();
+      }
+    }
+  });
+
+  ctrl = connectTo (FTP_CTRL_PORT);
+  expect (readReply (), 220, "banner");
+  expect (command ("USER %s", BENCH_USER), 331, "USER");
+  expect (command ("PASS %s", BENCH_PASS), 230, "PASS");
+  expect (command ("TYPE I"), 200, "TYPE");
+
+  static Transfer retr[100], stor[100], list[100], mlsd[100];
+  for (int i = 0; i < rounds; i ++) {
+    retr[i] = download ("RETR %s", "big.bin");
+    if (retr[i].bytes != size) {
+      fprintf (stderr, "bench: RETR got %llu bytes of %llu\n",
+               (unsigned long long) retr[i].bytes, (unsigned long long) size);
+      return 1;
+    }
+  }
+  for (int i = 0; i < rounds; i ++) {
+    stor[i] = upload ("up.bin", size);
+  }
+  snprintf (path, sizeof (path), "%s/up.bin", root);
+  struct stat st;
+  if (stat (path, &st) != 0 || (uint64_t) st.st_size != size) {
+    fprintf (stderr, "bench: STOR wrote %llu bytes of %llu\n",
+             (unsigned long long) st.st_size, (unsigned long long) size);
+    return 1;
+  }
+  expect (command ("CWD %s", "/list"), 250, "CWD");
+  for (int i = 0; i < rounds; i ++) {
+    list[i] = download ("LIST", "");
+  }
+  for (int i = 0; i < rounds; i ++) {
+    mlsd[i] = download ("MLSD", "");
+  }
+
+  reportTransfer ("RETR", retr, rounds, true);
+  reportTransfer ("STOR", stor, rounds, true);
+  reportTransfer ("LIST", list, rounds, false);
+  reportTransfer ("MLSD", mlsd, rounds, false);
+  reportCommand ("NOOP", "", 200, 200 * rounds);
+  reportCommand ("PWD", "", 257, 200 * rounds);
+  reportCommand ("CWD %s", "/", 250, 200 * rounds);
+  reportCommand ("TYPE I", "", 200, 200 * rounds);
+  reportCommand ("SIZE %s", "big.bin", 213, 200 * rounds);
+
+  double cpu = cpuTime ();
+  double t = now ();
+  usleep (1000000);
+  printf ("%-16s %9.1f %%       CPU while logged in, without commands\n", "idle",
+          100 * (cpuTime () - cpu) / (now () - t));
+
+  command ("QUIT");
+  close (ctrl);
+  serverRunning = false;
+  server.join ();
+
+  unlink (path);
+  snprintf (path, sizeof (path), "%s/big.bin", root);
+  unlink (path);
+  for (int i = 0; i < files; i ++) {
+    snprintf (path, sizeof (path), "%s/list/f%05d.txt", root, i);
+    unlink (path);
+  }
+  snprintf (path, sizeof (path), "%s/list", root);
+  rmdir (path);
+  rmdir (root);
+  return 0;
+}
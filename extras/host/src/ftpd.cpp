@@ -0,0 +1,46 @@
+// FTP server on the host, serving a directory
+//
+//   ftpd [-p] [directory [user [password]]]
+//
+// Listens on FTP_CTRL_PORT of the loopback interface (2121 with the
+// Makefile), until interrupted. -p serves the directory through
+// FtpPosixStorage instead of fs::FS (ESP32 core).
+
+#include "ESPFtpServer.h"
+#include <signal.h>
+#include <string.h>
+
+static volatile bool running = true;
+
+static void stop (int) {
+  running = false;
+}
+
+int main (int argc, char ** argv) {
+  signal (SIGINT, stop);
+  signal (SIGTERM, stop);
+  bool posix = argc > 1 && !strcmp (argv[1], "-p");
+  if (posix) {
+    argc --;
+    argv ++;
+  }
+  const char * root = argc > 1 ? argv[1] : ".";
+  static fs::FS disk (root);
+  static FtpFsStorage fsStorage (&disk);
+  FtpStorage * storage = &fsStorage;
+  if (posix) {
+    #ifdef ESP32
+    storage = new FtpPosixStorage (root);
+    #else
+    fprintf (stderr, "ftpd: no POSIX storage with the ESP8266 core\n");
+    return 2;
+    #endif
+  }
+  static FtpServer ftpSrv;
+  ftpSrv.begin (argc > 2 ? argv[2] : "esp", argc > 3 ? argv[3] : "esp");
+  fprintf (stderr, "ftpd: serving %s on port %d%s\n", root, FTP_CTRL_PORT, posix ? ", POSIX storage" : "");
+  while (running) {
+    ftpSrv.handleFTP (* storage, 1000);   // sleeps until there is something to do
+  }
+  return 0;
+}
@@ -0,0 +1,543 @@
+// Host stand-in implementations: clock, serial, POSIX-backed FS and sockets
+#include "Arduino.h"
+#include "FS.h"
+#include "WiFiClient.h"
+#include "WiFi.h"
+
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+HostWiFi   WiFi;
+HostEsp    ESP;
+
+static const auto hostEpoch = std::chrono::steady_clock::now ();
+
+uint32_t millis () {
+  return (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - hostEpoch).count ();
+}
+
+uint32_t micros () {
+  return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - hostEpoch).count ();
+}
+
+void delay (uint32_t ms) {
+  std::this_thread::sleep_for (std::chrono::milliseconds (ms));
+}
+
+void yield () {
+  sched_yield ();
+}
+
+size_t Print::printf (const char * fmt, ...) {
+  char tmp[256];
+  va_list ap;
+  va_start (ap, fmt);
+  int n = vsnprintf (tmp, sizeof (tmp), fmt, ap);
+  va_end (ap);
+  if (n < 0) {
+    return 0;
+  }
+  return write ((const uint8_t *) tmp, (size_t) n < sizeof (tmp) ? n : sizeof (tmp) - 1);
+}
+
+/*******************************************************************************
+ **                                   FS                                       **
+ *******************************************************************************/
+
+namespace fs {
+
+struct FileImpl {
+  std::string path;      // path as seen by the FTP server
+  std::string real;      // path on the host
+  std::string base;      // last path component
+  int         fd = -1;
+  DIR *       dir = nullptr;
+  FS *        owner = nullptr;
+  bool        writable = false;
+
+  ~FileImpl () {
+    if (fd >= 0) {
+      #ifdef ESP8266
+      // as LittleFS: a file opened for writing takes the time of the callback
+      if (writable && owner->timeCallback_ != nullptr) {
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = owner->timeCallback_ ();
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        futimens (fd, times);
+      }
+      #endif
+      ::close (fd);
+    }
+    if (dir) {
+      closedir (dir);
+    }
+  }
+};
+
+static std::string joinPath (const std::string & a, const char * b) {
+  if (!a.empty () && a.back () == '/') {
+    return a + b;
+  }
+  return a + "/" + b;
+}
+
+FS::FS (const char * root) : root_ (root) {}
+
+void FS::setRoot (const char * root) {
+  root_ = root;
+}
+
+std::string FS::real (const char * path) const {
+  std::string r = root_;
+  if (path[0] != '/') {
+    r += "/";
+  }
+  r += path;
+  while (r.size () > 1 && r.back () == '/') {
+    r.pop_back ();
+  }
+  return r;
+}
+
+File FS::open (const char * path, const char * mode) {
+  auto f = std::make_shared<FileImpl> ();
+  f->path = path;
+  f->real = real (path);
+  const char * slash = strrchr (path, '/');
+  f->base = slash ? slash + 1 : path;
+  f->owner = this;
+  struct stat st;
+  if (mode[0] == 'r' && mode[1] != '+' && stat (f->real.c_str (), &st) == 0 && S_ISDIR (st.st_mode)) {
+    f->dir = opendir (f->real.c_str ());
+    return f->dir ? File (f) : File ();
+  }
+  int flags = O_RDONLY;
+  if (!strcmp (mode, "r+")) {
+    flags = O_RDWR;
+  }
+  else if (mode[0] == 'w') {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  }
+  else if (mode[0] == 'a') {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+  }
+  f->fd = ::open (f->real.c_str (), flags, 0644);
+  f->writable = flags != O_RDONLY;
+  return f->fd >= 0 ? File (f) : File ();
+}
+
+bool FS::exists (const char * path) {
+  struct stat st;
+  return stat (real (path).c_str (), &st) == 0;
+}
+
+bool FS::remove (const char * path) {
+  return ::unlink (real (path).c_str ()) == 0;
+}
+
+bool FS::rename (const char * from, const char * to) {
+  return ::rename (real (from).c_str (), real (to).c_str ()) == 0;
+}
+
+bool FS::mkdir (const char * path) {
+  return ::mkdir (real (path).c_str (), 0755) == 0;
+}
+
+bool FS::rmdir (const char * path) {
+  return ::rmdir (real (path).c_str ()) == 0;
+}
+
+File::operator bool () const {
+  return p_ && (p_->fd >= 0 || p_->dir);
+}
+
+size_t File::write (const uint8_t * b, size_t n) {
+  if (!p_ || p_->fd < 0) {
+    return 0;
+  }
+  if (p_->owner->latencyMicros > 0) {
+    std::this_thread::sleep_for (std::chrono::microseconds (p_->owner->latencyMicros));
+  }
+  ssize_t w = ::write (p_->fd, b, n);
+  return w > 0 ? w : 0;
+}
+
+int File::read () {
+  uint8_t c;
+  return read (&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read (uint8_t * b, size_t n) {
+  if (!p_ || p_->fd < 0) {
+    return 0;
+  }
+  if (p_->owner->latencyMicros > 0) {
+    std::this_thread::sleep_for (std::chrono::microseconds (p_->owner->latencyMicros));
+  }
+  ssize_t r = ::read (p_->fd, b, n);
+  return r > 0 ? r : 0;
+}
+
+int File::available () {
+  return p_ && p_->fd >= 0 ? (int) (size () - position ()) : 0;
+}
+
+bool File::seek (uint32_t pos, SeekMode mode) {
+  if (!p_ || p_->fd < 0) {
+    return false;
+  }
+  int whence = mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END;
+  return lseek (p_->fd, pos, whence) >= 0;
+}
+
+size_t File::position () const {
+  if (!p_ || p_->fd < 0) {
+    return 0;
+  }
+  off_t o = lseek (p_->fd, 0, SEEK_CUR);
+  return o < 0 ? 0 : o;
+}
+
+size_t File::size () const {
+  struct stat st;
+  if (!p_ || stat (p_->real.c_str (), &st) != 0) {
+    return 0;
+  }
+  return S_ISDIR (st.st_mode) ? 0 : st.st_size;
+}
+
+void File::close () {
+  p_.reset ();
+}
+
+const char * File::name () const {
+  return p_ ? p_->base.c_str () : "";
+}
+
+const char * File::path () const {
+  return p_ ? p_->path.c_str () : "";
+}
+
+bool File::isDirectory () const {
+  return p_ && p_->dir;
+}
+
+time_t File::getLastWrite () {
+  struct stat st;
+  if (!p_ || stat (p_->real.c_str (), &st) != 0) {
+    return 0;
+  }
+  return st.st_mtime;
+}
+
+File File::openNextFile (const char * mode) {
+  if (!p_ || !p_->dir) {
+    return File ();
+  }
+  struct dirent * de;
+  while ((de = readdir (p_->dir)) != nullptr) {
+    if (strcmp (de->d_name, ".") && strcmp (de->d_name, "..")) {
+      return p_->owner->open (joinPath (p_->path, de->d_name).c_str (), mode);
+    }
+  }
+  return File ();
+}
+
+void File::rewindDirectory () {
+  if (p_ && p_->dir) {
+    rewinddir (p_->dir);
+  }
+}
+
+#ifdef ESP8266
+struct DirImpl {
+  File        dir;
+  File        cur;
+};
+
+Dir FS::openDir (const char * path) {
+  auto d = std::make_shared<DirImpl> ();
+  d->dir = open (path, "r");
+  return Dir (d);
+}
+
+bool Dir::next () {
+  if (!p_) {
+    return false;
+  }
+  p_->cur = p_->dir.openNextFile ();
+  return (bool) p_->cur;
+}
+
+String Dir::fileName () {
+  return p_ ? String (p_->cur.name ()) : String ();
+}
+
+size_t Dir::fileSize () {
+  return p_ ? p_->cur.size () : 0;
+}
+
+time_t Dir::fileTime () {
+  return p_ ? p_->cur.getLastWrite () : 0;
+}
+
+bool Dir::isDirectory () {
+  return p_ && p_->cur.isDirectory ();
+}
+
+File Dir::openFile (const char * mode) {
+  return p_ ? p_->cur.openNextFile (mode) : File ();
+}
+#endif
+
+} // namespace fs
+
+#ifdef ESP32
+// The library sets file times with utime () below FTP_VFS_MOUNT; here the
+// files are below the root of the FS
+
+bool ftpSetFileTime (fs::FS &fs, const char * path, time_t mtime) {
+  struct utimbuf times = { mtime, mtime };
+  return utime (fs.real (path).c_str (), &times) == 0;
+}
+#endif
+
+/*******************************************************************************
+ **                                 SOCKETS                                    **
+ *******************************************************************************/
+
+struct HostSocket {
+  int  fd = -1;
+  bool peerClosed = false;
+  ~HostSocket () {
+    if (fd >= 0) {
+      ::close (fd);
+    }
+  }
+};
+
+static void setNonBlocking (int fd) {
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+WiFiClient::WiFiClient (int fd) : s_ (std::make_shared<HostSocket> ()) {
+  s_->fd = fd;
+  setNonBlocking (fd);
+}
+
+uint8_t WiFiClient::connected () {
+  if (!s_ || s_->fd < 0) {
+    return 0;
+  }
+  if (available () > 0) {
+    return 1;
+  }
+  if (s_->peerClosed) {
+    return 0;
+  }
+  char c;
+  ssize_t r = recv (s_->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    s_->peerClosed = true;
+    return 0;
+  }
+  return 1;
+}
+
+WiFiClient::operator bool () {
+  return s_ && s_->fd >= 0;
+}
+
+int WiFiClient::available () {
+  if (!s_ || s_->fd < 0) {
+    return 0;
+  }
+  int n = 0;
+  if (ioctl (s_->fd, FIONREAD, &n) < 0) {
+    return 0;
+  }
+  return n;
+}
+
+int WiFiClient::read () {
+  uint8_t c;
+  return read (&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read (uint8_t * b, size_t n) {
+  if (!s_ || s_->fd < 0) {
+    return -1;
+  }
+  ssize_t r = recv (s_->fd, b, n, MSG_DONTWAIT);
+  if (r == 0) {
+    s_->peerClosed = true;
+  }
+  return r > 0 ? (int) r : (r == 0 ? 0 : -1);
+}
+
+size_t WiFiClient::write (const uint8_t * b, size_t n) {
+  if (!s_ || s_->fd < 0) {
+    return 0;
+  }
+  size_t done = 0;
+  // like the ESP cores, a plain write() waits (bounded) for room in the send buffer
+  uint32_t start = millis ();
+  while (done < n && millis () - start < 5000) {
+    ssize_t w = send (s_->fd, b + done, n - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (w > 0) {
+      done += w;
+    }
+    else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      std::this_thread::sleep_for (std::chrono::microseconds (100));
+    }
+    else {
+      break;
+    }
+  }
+  return done;
+}
+
+int WiFiClient::availableForWrite () {
+  if (!s_ || s_->fd < 0) {
+    return 0;
+  }
+  int sndbuf = 0, queued = 0;
+  socklen_t len = sizeof (sndbuf);
+  getsockopt (s_->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+  ioctl (s_->fd, TIOCOUTQ, &queued);
+  // the kernel doubles SO_SNDBUF for bookkeeping; only half is payload
+  int room = sndbuf / 2 - queued;
+  return room > 0 ? room : 0;
+}
+
+void WiFiClient::stop () {
+  s_.reset ();
+}
+
+int WiFiClient::setNoDelay (bool nodelay) {
+  int v = nodelay ? 1 : 0;
+  return s_ ? setsockopt (s_->fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof (v)) : -1;
+}
+
+int WiFiClient::fd () const {
+  return s_ ? s_->fd : -1;
+}
+
+static void sockName (int fd, bool peer, IPAddress & ip, uint16_t & port) {
+  struct sockaddr_in a;
+  socklen_t len = sizeof (a);
+  memset (&a, 0, sizeof (a));
+  if (fd >= 0) {
+    peer ? getpeername (fd, (struct sockaddr *) &a, &len) : getsockname (fd, (struct sockaddr *) &a, &len);
+  }
+  uint32_t h = ntohl (a.sin_addr.s_addr);
+  ip = IPAddress (h >> 24, h >> 16, h >> 8, h);
+  port = ntohs (a.sin_port);
+}
+
+IPAddress WiFiClient::remoteIP () const {
+  IPAddress ip; uint16_t port;
+  sockName (fd (), true, ip, port);
+  return ip;
+}
+
+uint16_t WiFiClient::remotePort () const {
+  IPAddress ip; uint16_t port;
+  sockName (fd (), true, ip, port);
+  return port;
+}
+
+IPAddress WiFiClient::localIP () const {
+  IPAddress ip; uint16_t port;
+  sockName (fd (), false, ip, port);
+  return ip;
+}
+
+uint16_t WiFiClient::localPort () const {
+  IPAddress ip; uint16_t port;
+  sockName (fd (), false, ip, port);
+  return port;
+}
+
+int WiFiClient::connect (IPAddress ip, uint16_t port) {
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in a;
+  memset (&a, 0, sizeof (a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons (port);
+  a.sin_addr.s_addr = htonl (((uint32_t) ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3]);
+  if (::connect (fd, (struct sockaddr *) &a, sizeof (a)) < 0) {
+    ::close (fd);
+    return 0;
+  }
+  * this = WiFiClient (fd);
+  return 1;
+}
+
+WiFiServer::~WiFiServer () {
+  stop ();
+}
+
+void WiFiServer::begin () {
+  stop ();
+  fd_ = socket (AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt (fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  struct sockaddr_in a;
+  memset (&a, 0, sizeof (a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons (port_);
+  a.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (fd_, (struct sockaddr *) &a, sizeof (a)) < 0 || listen (fd_, 8) < 0) {
+    perror ("WiFiServer::begin");
+    ::close (fd_);
+    fd_ = -1;
+    return;
+  }
+  setNonBlocking (fd_);
+}
+
+bool WiFiServer::hasClient () {
+  if (pending_ >= 0) {
+    return true;
+  }
+  if (fd_ < 0) {
+    return false;
+  }
+  pending_ = ::accept (fd_, nullptr, nullptr);
+  return pending_ >= 0;
+}
+
+WiFiClient WiFiServer::available () {
+  if (!hasClient ()) {
+    return WiFiClient ();
+  }
+  int fd = pending_;
+  pending_ = -1;
+  return WiFiClient (fd);
+}
+
+void WiFiServer::stop () {
+  if (pending_ >= 0) {
+    ::close (pending_);
+    pending_ = -1;
+  }
+  if (fd_ >= 0) {
+    ::close (fd_);
+    fd_ = -1;
+  }
+}
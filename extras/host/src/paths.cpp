@@ -0,0 +1,192 @@
+// Test of the paths the FTP server accepts, on the host
+//
+//   paths [-p]
+//
+// Serves a temporary directory from a thread, as bench does, with a file
+// next to it that the clients must not reach, and checks the replies to
+// paths made of "." and ".." components: none may go above the root, and
+// those that stay below it must still name the right file. -p serves the
+// directory through FtpPosixStorage instead of fs::FS. Exits with 1 if a
+// reply is wrong, 0 otherwise.
+
+#include "ESPFtpServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <thread>
+
+#define TEST_USER "test"
+#define TEST_PASS "test"
+
+static std::atomic<bool> serverRunning (true);
+static int  ctrl = -1;              // control connection
+static char ctrlBuf[1024];          // chars received on ctrl, not yet used
+static int  nCtrlBuf = 0;
+static char lastReply[1024];        // last line of the last reply
+static int  failures = 0;
+
+static void fail (const char * what) {
+  fprintf (stderr, "paths: %s (%s)\n", what, strerror (errno));
+  exit (1);
+}
+
+static int connectTo (uint16_t port) {
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in a;
+  memset (&a, 0, sizeof (a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons (port);
+  a.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &a, sizeof (a)) < 0) {
+    fail ("can't connect");
+  }
+  return fd;
+}
+
+// Read a reply, multi-line ones included; return its code
+
+static int readReply () {
+  for (;;) {
+    char * line = ctrlBuf;
+    char * eol;
+    while ((eol = (char *) memchr (line, '\n', nCtrlBuf - (line - ctrlBuf))) != NULL) {
+      if (eol - line >= 4 && isdigit (line[0]) && line[3] == ' ') {
+        int len = eol - line;
+        memcpy (lastReply, line, len);
+        lastReply[len > 0 && line[len - 1] == '\r' ? len - 1 : len] = 0;
+        nCtrlBuf -= eol + 1 - ctrlBuf;
+        memmove (ctrlBuf, eol + 1, nCtrlBuf);
+        return atoi (lastReply);
+      }
+      line = eol + 1;
+    }
+    if (nCtrlBuf == (int) sizeof (ctrlBuf)) {
+      nCtrlBuf = 0;                  // reply too long, drop it
+    }
+    ssize_t n = recv (ctrl, ctrlBuf + nCtrlBuf, sizeof (ctrlBuf) - nCtrlBuf, 0);
+    if (n <= 0) {
+      fail ("control connection lost");
+    }
+    nCtrlBuf += n;
+  }
+}
+
+// Send a command and check the code of its reply, and that the reply
+// holds text if it is given
+
+static void check (const char * cmd, int expected, const char * text = NULL) {
+  char line[512];
+  int n = snprintf (line, sizeof (line) - 2, "%s", cmd);
+  line[n ++] = '\r';
+  line[n ++] = '\n';
+  if (send (ctrl, line, n, 0) != n) {
+    fail ("can't send command");
+  }
+  int code = readReply ();
+  bool ok = code == expected && (text == NULL || strstr (lastReply, text) != NULL);
+  printf ("%-4s %-36s %s\n", ok ? "ok" : "FAIL", cmd, lastReply);
+  if (!ok) {
+    failures ++;
+  }
+}
+
+static void makeFile (const char * path, const char * text) {
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write (fd, text, strlen (text)) != (ssize_t) strlen (text)) {
+    fail (path);
+  }
+  close (fd);
+}
+
+int main (int argc, char ** argv) {
+  bool posix = argc > 1 && !strcmp (argv[1], "-p");
+
+  // <top>/outside.txt (11 bytes), and the served <top>/root/dir/inside.txt (6)
+  char top[] = "/tmp/ftppaths.XXXXXX";
+  if (mkdtemp (top) == NULL) {
+    fail ("can't make temporary directory");
+  }
+  char root[32], dir[40], inside[56], outside[40];
+  snprintf (root, sizeof (root), "%s/root", top);
+  snprintf (dir, sizeof (dir), "%s/dir", root);
+  snprintf (inside, sizeof (inside), "%s/inside.txt", dir);
+  snprintf (outside, sizeof (outside), "%s/outside.txt", top);
+  mkdir (root, 0755);
+  mkdir (dir, 0755);
+  makeFile (inside, "inside");
+  makeFile (outside, "not served");
+
+  static fs::FS disk (root);
+  static FtpFsStorage fsStorage (&disk);
+  static FtpStorage * storage = &fsStorage;
+  if (posix) {
+    #ifdef ESP32
+    storage = new FtpPosixStorage (root);
+    #else
+    fail ("no POSIX storage with the ESP8266 core");
+    #endif
+  }
+  static FtpServer ftpSrv;
+  ftpSrv.begin (TEST_USER, TEST_PASS);
+  std::thread server ([] {
+    while (serverRunning) {
+      ftpSrv.handleFTP (* storage, 10);
+    }
+  });
+
+  ctrl = connectTo (FTP_CTRL_PORT);
+  if (readReply () != 220) {
+    fail ("no banner");
+  }
+  check ("USER " TEST_USER, 331);
+  check ("PASS " TEST_PASS, 230);
+
+  // out of the root: not found, or the root itself
+  check ("SIZE ../outside.txt", 450);
+  check ("SIZE /../outside.txt", 450);
+  check ("SIZE dir/../../outside.txt", 450);
+  check ("SIZE ./.././outside.txt", 450);
+  check ("RETR /../outside.txt", 550);
+  check ("DELE ../outside.txt", 550);
+  check ("CWD ../..", 250, "is /");
+  check ("PWD", 257, "\"/\"");
+  check ("SIZE outside.txt", 450);
+
+  // below the root: the file named
+  check ("SIZE dir/inside.txt", 213, "6");
+  check ("SIZE /dir/./inside.txt", 213, "6");
+  check ("SIZE //dir//inside.txt", 213, "6");
+  check ("SIZE ../dir/../dir/inside.txt", 213, "6");
+  check ("CWD dir", 250, "is /dir");
+  check ("SIZE ../dir/inside.txt", 213, "6");
+  check ("SIZE ../../../dir/inside.txt", 213, "6");
+  check ("CWD ./..", 250, "is /");
+  check ("CWD dir/", 250, "is /dir");
+  check ("CDUP", 250, "is /");
+  check ("CDUP", 250, "is /");
+
+  struct stat st;
+  if (stat (outside, &st) != 0) {
+    printf ("FAIL %s deleted\n", outside);
+    failures ++;
+  }
+
+  check ("QUIT", 221);
+  close (ctrl);
+  serverRunning = false;
+  server.join ();
+
+  unlink (inside);
+  unlink (outside);
+  rmdir (dir);
+  rmdir (root);
+  rmdir (top);
+  printf ("%s: %d failure(s)\n", posix ? "POSIX storage" : "fs::FS", failures);
+  return failures > 0 ? 1 : 0;
+}